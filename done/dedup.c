@@ -1,16 +1,7 @@
 #include "imgStore.h"
+#include "imgst_index.h"
 #include <stdbool.h>
 
-bool SHA_equal(unsigned char sha1[], unsigned char sha2[])
-{
-    for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-        if(sha1[i] != sha2[i]) {
-            return false;
-        }
-    }
-    return true;
-}
-
 /** @copybrief */
 int do_name_and_content_dedup(struct imgst_file * imgstFile, uint32_t index)
 {
@@ -23,26 +14,22 @@ int do_name_and_content_dedup(struct imgst_file * imgstFile, uint32_t index)
         return ERR_INVALID_ARGUMENT;
     }
 
+    //the id index only knows the other valid images, any match is a conflict
+    uint32_t same_id = 0;
     int ret = ERR_NONE;
-    bool content_dup = false;
-    for(int i = 0; i < imgstFile->header.max_files; ++i) {
-
-        if(imgstFile->metadata[i].is_valid && i != index) {
-
-            if(!strcmp(imgstFile->metadata[i].img_id, imgstFile->metadata[index].img_id)) {
-                ret = ERR_DUPLICATE_ID;
-            }
-            if(SHA_equal(imgstFile->metadata[i].SHA, imgstFile->metadata[index].SHA)) {
-                for(int j = RES_THUMB; j <= RES_ORIG; ++j) {
-                    content_dup = true;
-                    imgstFile->metadata[index].size[j] = imgstFile->metadata[i].size[j];
-                    imgstFile->metadata[index].offset[j] = imgstFile->metadata[i].offset[j];
-                }
-            }
-        }
+    if(imgst_index_find_id(imgstFile, imgstFile->metadata[index].img_id, &same_id) == ERR_NONE && same_id != index) {
+        ret = ERR_DUPLICATE_ID;
     }
 
-    if(!content_dup) {
+    //any other image with the same content already stores it, share its data
+    uint32_t same_content = 0;
+    bool content_dup = imgst_index_find_sha(imgstFile, imgstFile->metadata[index].SHA, index, &same_content) == ERR_NONE;
+    if(content_dup) {
+        for(int j = RES_THUMB; j <= RES_ORIG; ++j) {
+            imgstFile->metadata[index].size[j] = imgstFile->metadata[same_content].size[j];
+            imgstFile->metadata[index].offset[j] = imgstFile->metadata[same_content].offset[j];
+        }
+    } else {
         imgstFile->metadata[index].offset[RES_ORIG] = 0; //if no duplication => res_origin = 0
     }
     return ret;
@@ -1,14 +1,42 @@
 #include <vips/vips.h>
 #include <stdint.h> // for uint32_t, uint64_t
 #include <stdlib.h>
+#include <string.h> // for memcpy
 #include "image_content.h"
 #include "imgStore.h"
+#include "imgst_io.h"
+#include "jpeg_header.h"
 
 //position of img in the image_array
 #define INDEX_ORIG_IMG 0
-#define INDEX_RESIZED_IMG 1
+#define INDEX_RESIZED_IMG(res) (1 + (res))
+#define INDEX_MEMORY_IMG(res) (1 + NB_VARIANTS + (res))
+#define INDEX_SHRUNK_IMG (1 + 2 * NB_VARIANTS)
+#define NB_IMG (INDEX_SHRUNK_IMG + 1)
 
+//an embedded thumbnail further off the aspect ratio of the image has black bars
+#define MAX_EXIF_ASPECT_DIFF 0.02
 
+//the JPEG decoder can scale by 1/2, 1/4 and 1/8 in the DCT domain while it decodes
+#define MAX_SHRINK_ON_LOAD 8
+
+//a smaller variant is made from a larger one (instead of the original) if it is at least twice as large
+#define MAX_CASCADE_RATIO 0.5
+
+
+
+/**
+ * @param image
+ * @param max_width width of the box the image must fit in
+ * @param max_height height of the box
+ * @return the shrink factor of the image
+ */
+static double box_shrink_value(const VipsImage* image, uint32_t max_width, uint32_t max_height)
+{
+    const double h_shrink = (double) max_width  / (double) image->Xsize ;
+    const double v_shrink = (double) max_height / (double) image->Ysize ;
+    return h_shrink > v_shrink ? v_shrink : h_shrink ;
+}
 
 /**
  * @param imgstFile structure for header, metadata and file pointer.
@@ -20,41 +48,21 @@ double shrink_value(const VipsImage *image, struct imgst_file* imgstFile, uint16
 {
     int max_width  = imgstFile->header.res_resized[2*res + X_COORD_LOCATION];
     int max_height = imgstFile->header.res_resized[2*res + Y_COORD_LOCATION];
-
-    const double h_shrink = (double) max_width  / (double) image->Xsize ;
-    const double v_shrink = (double) max_height / (double) image->Ysize ;
-    return h_shrink > v_shrink ? v_shrink : h_shrink ;
+    return box_shrink_value(image, max_width, max_height);
 }
 
-//----------------------------------------------------------------------------------------------------------
 /**
- *
- * @param res resolution of picture interested
- * @param imgstFile structure for header, metadata and file pointer.
- * @param index at which we want to check the arguments
- * @return Some error code. 0 if no error.
+ * @param image the original image (only its header is needed)
+ * @param ratio of the largest variant to make from it
+ * @return the largest factor of shrink-on-load that keeps the decoded image at least as large as that variant
  */
-int check_arg_resize(uint16_t res, struct imgst_file* imgstFile, size_t index)
+static int shrink_on_load(const VipsImage* image, double ratio)
 {
-    if(res != RES_THUMB && res != RES_SMALL && res != RES_ORIG) {
-        fprintf(stderr, "res not corresponding to RES_SMALL: %d or RES_THUMB: %d \n", RES_SMALL, RES_THUMB);
-        return ERR_INVALID_ARGUMENT;
-    }
-    if(imgstFile == NULL) {
-        fprintf(stderr, "Error: lazily_resize received NULL pointer as pointer of imgstFile");
-        return ERR_INVALID_ARGUMENT;
-    }
-    if(index >= imgstFile->header.max_files || !imgstFile->metadata[index].is_valid) {
-        fprintf(stderr, "invalid index");
-        return ERR_INVALID_ARGUMENT;
+    int shrink = MAX_SHRINK_ON_LOAD;
+    while(shrink > 1 && (ratio * shrink > 1.0 || image->Xsize < shrink || image->Ysize < shrink)) {
+        shrink /= 2;
     }
-
-    //move file pointer to the specified image
-    if (fseek(imgstFile->file, imgstFile->metadata[index].offset[res], SEEK_SET) != ERR_NONE) {
-        fprintf(stderr, "Error during fseek to correct metadata location");
-        return ERR_IO;
-    }
-    return ERR_NONE;
+    return shrink;
 }
 
 /**
@@ -74,121 +82,262 @@ void free_and_unref(void* to_unref, void* to_free)
 }
 
 /**
- * helper function to load, resize an image with VIPS, and then write it into the database
- * @param res
- * @param imgstFile
- * @param index
- * @param img_size_out
- * @return error code as defined in error.h
+ * @copybrief
  */
-int load_resize_image(uint16_t res, struct imgst_file* imgstFile, uint32_t index, size_t* img_size_out)
+void free_variants(struct variant variants[NB_VARIANTS])
 {
+    for(int res = 0; res < NB_VARIANTS; ++res) {
+        free(variants[res].image);
+        variants[res].image = NULL;
+        variants[res].size = 0;
+    }
+}
 
-    //res of the original image
-    uint32_t size_origin_img = imgstFile->metadata[index].size[RES_ORIG];
-    int const nb_image_to_resize = 1;
+/**
+ * makes the thumbnail from the one embedded in the EXIF data of the original, without decoding the original
+ * @param original the original image (only its header is needed)
+ * @param thumb output
+ * @return ERR_IMGLIB if there is no embedded thumbnail as large as the one to make, else ERR_NONE (or another error)
+ */
+static int exif_thumbnail(struct imgst_file* imgstFile, const void* orig_image, size_t orig_size, const VipsImage* original,
+                          struct variant* thumb)
+{
+    const void* embedded = NULL;
+    size_t embedded_size = 0;
+    uint32_t width = 0, height = 0;
+    if(jpeg_exif_thumbnail(orig_image, orig_size, &embedded, &embedded_size) != ERR_NONE ||
+       jpeg_dimensions(embedded, embedded_size, &width, &height) != ERR_NONE) {
+        return ERR_IMGLIB;
+    }
+    double const aspect = (double) original->Xsize / original->Ysize;
+    double const aspect_diff = (double) width / height - aspect;
+    if(aspect_diff > MAX_EXIF_ASPECT_DIFF * aspect || -aspect_diff > MAX_EXIF_ASPECT_DIFF * aspect) {
+        return ERR_IMGLIB;
+    }
 
-    //allocate memory to be able to store image at image pointer
-    void* img_buffer = calloc(1, size_origin_img);
-    if(img_buffer == NULL) {
-        fprintf(stderr, "Error while allocate space in memory for an size_image_in");
-        return ERR_OUT_OF_MEMORY;
+    VipsObject* parent = VIPS_OBJECT(vips_image_new());
+    VipsImage** image_array = (VipsImage**) vips_object_local_array(parent, 2);
+    if(vips_jpegload_buffer((void*) embedded, embedded_size, &image_array[0], (char*) NULL) != ERR_NONE) {
+        free_and_unref(parent, NULL);
+        return ERR_IMGLIB;
+    }
+    double const ratio = shrink_value(image_array[0], imgstFile, RES_THUMB);
+    if(ratio > 1.0) {
+        free_and_unref(parent, NULL);
+        return ERR_IMGLIB; //would be upscaled
     }
 
-    //read file at position specified by metadata and store it at allocated memory location pointed by orig_img
-    fseek(imgstFile->file, imgstFile->metadata[index].offset[RES_ORIG], SEEK_SET);
-    if(fread(img_buffer, size_origin_img, nb_image_to_resize, imgstFile->file) != nb_image_to_resize) {
-        fprintf(stderr, "Error: while loading metadata");
-        free_and_unref(NULL, img_buffer);
-        return ERR_IO;
+    int ret = ERR_NONE;
+    if(width == (uint32_t) (ratio * width + 0.5) && height == (uint32_t) (ratio * height + 0.5)) {
+        //already the size of the thumbnail: a copy of its bytes
+        thumb->image = malloc(embedded_size);
+        if(thumb->image == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            memcpy(thumb->image, embedded, embedded_size);
+            thumb->size = embedded_size;
+        }
+    } else if(vips_resize(image_array[0], &image_array[1], ratio, NULL) != ERR_NONE ||
+              vips_jpegsave_buffer(image_array[1], &thumb->image, &thumb->size, (char*) NULL) != ERR_NONE) {
+        ret = ERR_IMGLIB;
+    }
+    free_and_unref(parent, NULL);
+    return ret;
+}
+
+/**
+ * @copybrief
+ */
+int resize_variants(struct imgst_file* imgstFile, const void* orig_image, size_t orig_size, const bool wanted[NB_VARIANTS],
+                    struct variant variants[NB_VARIANTS], uint32_t* width, uint32_t* height)
+{
+    if(imgstFile == NULL || orig_image == NULL || wanted == NULL || variants == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    for(int res = 0; res < NB_VARIANTS; ++res) {
+        variants[res] = (struct variant) {
+            NULL, 0
+        };
     }
 
     VipsObject* parent = VIPS_OBJECT(vips_image_new());
-    //at index 0 store origin image and at 1 the resized one
-    VipsImage** image_array = (VipsImage**) vips_object_local_array(parent, 2*nb_image_to_resize);
+    //at index 0 store origin image, then the resized ones and their copies in memory (see INDEX_*)
+    VipsImage** image_array = (VipsImage**) vips_object_local_array(parent, NB_IMG);
     //will be unref when its parent will be so
 
-    if(vips_jpegload_buffer(img_buffer, size_origin_img, &image_array[INDEX_ORIG_IMG], (char*) NULL) != ERR_NONE) {
+    //only the header is decoded here, the pixels when the first variant is saved
+    if(vips_jpegload_buffer((void*) orig_image, orig_size, &image_array[INDEX_ORIG_IMG], (char*) NULL) != ERR_NONE) {
         fprintf(stderr, "Error: while loading image to the buffer");
-        free_and_unref(NULL, img_buffer);
+        free_and_unref(parent, NULL);
         return ERR_IMGLIB;
     }
+    if(width != NULL) *width = image_array[INDEX_ORIG_IMG]->Xsize;
+    if(height != NULL) *height = image_array[INDEX_ORIG_IMG]->Ysize;
+
+    //the variants to make from the pixels of the original
+    bool to_decode[NB_VARIANTS];
+    memcpy(to_decode, wanted, sizeof(to_decode));
+    if(to_decode[RES_THUMB] && (imgstFile->header.flags & IMGST_EXIF_THUMBS) &&
+       exif_thumbnail(imgstFile, orig_image, orig_size, image_array[INDEX_ORIG_IMG], &variants[RES_THUMB]) == ERR_NONE) {
+        to_decode[RES_THUMB] = false;
+    }
 
-    //END IMAGE LOADING ---------------------------------------------------------------------------------------
-
-    double const ratio = shrink_value(image_array[INDEX_ORIG_IMG], imgstFile, res);
-
-    if(vips_resize(image_array[INDEX_ORIG_IMG], &image_array[INDEX_RESIZED_IMG], ratio, NULL) != ERR_NONE) {
-        fprintf(stderr, "Error: while vips was resizing the image");
-        free_and_unref(parent, img_buffer);
-        return ERR_IMGLIB;
+    //the pixels are decoded already scaled down towards the largest variant wanted
+    VipsImage* original = image_array[INDEX_ORIG_IMG];
+    int largest = NB_VARIANTS - 1;
+    while(largest >= 0 && !to_decode[largest]) {
+        --largest;
+    }
+    int const shrink = largest < 0 ? 1 : shrink_on_load(original, shrink_value(original, imgstFile, largest));
+    if(shrink > 1) {
+        if(vips_jpegload_buffer((void*) orig_image, orig_size, &image_array[INDEX_SHRUNK_IMG], "shrink", shrink, (char*) NULL) != ERR_NONE) {
+            fprintf(stderr, "Error: while loading image to the buffer");
+            free_and_unref(parent, NULL);
+            return ERR_IMGLIB;
+        }
+        original = image_array[INDEX_SHRUNK_IMG];
     }
 
-    //END IMAGE RESIZING ----------------------------------------------------------------------------------
+    //END IMAGE LOADING ---------------------------------------------------------------------------------------
 
+    //from the largest variant to the smallest, so that a smaller one can be made from the larger one
+    VipsImage* larger = NULL;
+    int ret = ERR_NONE;
+    for(int res = largest; ret == ERR_NONE && res >= 0; --res) {
+        if(!to_decode[res]) {
+            continue;
+        }
+        VipsImage* source = original;
+        if(larger != NULL && shrink_value(larger, imgstFile, res) <= MAX_CASCADE_RATIO) {
+            source = larger;
+        }
+        double const ratio = shrink_value(source, imgstFile, res);
+
+        if(vips_resize(source, &image_array[INDEX_RESIZED_IMG(res)], ratio, NULL) != ERR_NONE) {
+            fprintf(stderr, "Error: while vips was resizing the image");
+            ret = ERR_IMGLIB;
+            break;
+        }
+        //computed once (decoding the original), then read from memory by its save and the smaller variants
+        image_array[INDEX_MEMORY_IMG(res)] = vips_image_copy_memory(image_array[INDEX_RESIZED_IMG(res)]);
+        if(image_array[INDEX_MEMORY_IMG(res)] == NULL) {
+            fprintf(stderr, "Error: while vips was resizing the image");
+            ret = ERR_IMGLIB;
+            break;
+        }
+        larger = image_array[INDEX_MEMORY_IMG(res)];
+
+        //END IMAGE RESIZING ----------------------------------------------------------------------------------
+
+        if(vips_jpegsave_buffer(larger, &variants[res].image, &variants[res].size, (char*) NULL) != ERR_NONE) {
+            fprintf(stderr, "Error: while saving image to the buffer");
+            ret = ERR_IMGLIB;
+        } else if(variants[res].image == NULL) {
+            fprintf(stderr, "Error while allocate space in memory for an size_image_out");
+            ret = ERR_OUT_OF_MEMORY;
+        }
+    }
+    free_and_unref(parent, NULL);
 
-    if(vips_jpegsave_buffer(image_array[INDEX_RESIZED_IMG], &img_buffer, img_size_out, (char*) NULL) != ERR_NONE) {
-        fprintf(stderr, "Error: while saving image to the buffer");
-        free_and_unref(parent, img_buffer);
-        free_and_unref(NULL, image_array);
-        return ERR_IMGLIB;
-    };
-    //don't need image_array & image_ptr_in anymore
+    if(ret != ERR_NONE) {
+        free_variants(variants);
+    }
+    return ret;
+}
 
-    if(img_buffer == NULL) {
-        fprintf(stderr, "Error while allocate space in memory for an size_image_out");
-        free_and_unref(parent, img_buffer);
+/**
+ * reads the original image at orig_offset (immutable, so no lock is needed)
+ * @param img_buffer output, allocated, to free
+ * @return Some error code. 0 if no error.
+ */
+static int read_original(struct imgst_file* imgstFile, uint64_t orig_offset, uint32_t orig_size, void** img_buffer)
+{
+    //allocate memory to be able to store image at image pointer (entirely overwritten by the read)
+    *img_buffer = malloc(orig_size);
+    if(*img_buffer == NULL) {
+        fprintf(stderr, "Error while allocate space in memory for an size_image_in");
         return ERR_OUT_OF_MEMORY;
     }
 
-    //set the writing pointer to the end of the file
-    if (fseek(imgstFile->file, NO_OFFSET, SEEK_END) != ERR_NONE) {
-        fprintf(stderr, "Error: can't set head reader at the end of the file");
-        free_and_unref(parent, img_buffer);
+    //read file at the position of the original image
+    if(imgst_pread(imgstFile, *img_buffer, orig_size, orig_offset) != ERR_NONE) {
+        fprintf(stderr, "Error: while loading metadata");
+        free(*img_buffer);
+        *img_buffer = NULL;
         return ERR_IO;
     }
+    return ERR_NONE;
+}
 
-    //write new resized image to end of file
-    if(fwrite(img_buffer, *img_size_out, nb_image_to_resize, imgstFile->file) != nb_image_to_resize) {
-        fprintf(stderr, "ERROR: can't write resized");
-        free_and_unref(parent, img_buffer);
-        return ERR_IO;
+/**
+ * @copybrief
+ */
+int resize_image(struct imgst_file* imgstFile, uint64_t orig_offset, uint32_t orig_size, const bool wanted[NB_VARIANTS],
+                 struct variant variants[NB_VARIANTS])
+{
+    if(imgstFile == NULL || wanted == NULL || variants == NULL) {
+        return ERR_INVALID_ARGUMENT;
     }
 
-    //don't need image_ptr_out anymore
-    free_and_unref(parent, img_buffer);
+    void* img_buffer = NULL;
+    int const err_read = read_original(imgstFile, orig_offset, orig_size, &img_buffer);
+    if(err_read != ERR_NONE) {
+        return err_read;
+    }
 
-    return ERR_NONE;
+    int const ret = resize_variants(imgstFile, img_buffer, orig_size, wanted, variants, NULL, NULL);
+    free_and_unref(NULL, img_buffer);
+    return ret;
 }
 
-//----------------------------------------------------------------------------------------------------------
 /**
- * @copybref
+ * @copybrief
  */
-int lazily_resize(uint16_t res, struct imgst_file* imgstFile, uint32_t index)
+int resize_box(struct imgst_file* imgstFile, uint64_t orig_offset, uint32_t orig_size, uint32_t width, uint32_t height,
+               void** image, size_t* size)
 {
-    int err_check_arg_resize = check_arg_resize(res, imgstFile, index);
-    if(err_check_arg_resize != ERR_NONE) {
-        return err_check_arg_resize;
-    }
-    // if image already exist in this resolution do nothing
-    if(res == RES_ORIG || imgstFile->metadata[index].size[res] != 0) {
-        return ERR_NONE;
+    if(imgstFile == NULL || image == NULL || size == NULL || width == 0 || height == 0) {
+        return ERR_INVALID_ARGUMENT;
     }
+    *image = NULL;
+    *size = 0;
 
-    size_t size_image_out = 0;
-    //loads the image and resizes it;
-    int err_load_resize = load_resize_image(res, imgstFile, index, &size_image_out);
-    if(err_load_resize != ERR_NONE) {
-        return err_load_resize;
+    void* img_buffer = NULL;
+    int const err_read = read_original(imgstFile, orig_offset, orig_size, &img_buffer);
+    if(err_read != ERR_NONE) {
+        return err_read;
     }
 
-    //update metadata
-    imgstFile->metadata[index].offset[res] = ftell(imgstFile->file) - size_image_out;
-    imgstFile->metadata[index].size[res] = size_image_out;
+    VipsObject* parent = VIPS_OBJECT(vips_image_new());
+    VipsImage** image_array = (VipsImage**) vips_object_local_array(parent, 3);
+    int ret = ERR_NONE;
 
-    //write updated metadata into the file
-    return write_metadata(imgstFile, index);
+    //the header tells how much the decoder can already scale it down
+    if(vips_jpegload_buffer(img_buffer, orig_size, &image_array[0], (char*) NULL) != ERR_NONE) {
+        fprintf(stderr, "Error: while loading image to the buffer");
+        ret = ERR_IMGLIB;
+    } else {
+        VipsImage* source = image_array[0];
+        double const ratio = box_shrink_value(source, width, height);
+        int const shrink = shrink_on_load(source, ratio);
+        if(shrink > 1) {
+            if(vips_jpegload_buffer(img_buffer, orig_size, &image_array[1], "shrink", shrink, (char*) NULL) != ERR_NONE) {
+                ret = ERR_IMGLIB;
+            }
+            source = image_array[1];
+        }
+
+        //never larger than the original (nor shrunk on load then)
+        double const shrunk_ratio = ratio < 1.0 && ret == ERR_NONE ? box_shrink_value(source, width, height) : 1.0;
+        if(ret == ERR_NONE &&
+           (vips_resize(source, &image_array[2], shrunk_ratio, NULL) != ERR_NONE ||
+            vips_jpegsave_buffer(image_array[2], image, size, (char*) NULL) != ERR_NONE)) {
+            fprintf(stderr, "Error: while vips was resizing the image");
+            ret = ERR_IMGLIB;
+        }
+    }
+    free_and_unref(parent, img_buffer);
+    return ret;
 }
 
 /**
@@ -200,6 +349,11 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
         return ERR_INVALID_ARGUMENT;
     }
 
+    //read in the frame header, vips only for the streams it can't understand
+    if(jpeg_dimensions(image_buffer, image_size, width, height) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
     VipsImage* image = (VipsImage*) VIPS_OBJECT(vips_image_new());
 
     if(vips_jpegload_buffer ((void *)image_buffer,  image_size, &image, (char*) NULL)!= ERR_NONE) {
@@ -5,18 +5,81 @@
 #endif //DONE_IMAGE_CONTENT_H
 
 #include <stdint.h> // for uint32_t, uint64_t
+#include <stdbool.h>
 #include <stddef.h>
 #include "imgStore.h"
 
+#define NB_VARIANTS RES_ORIG // the resolutions made from the original: RES_THUMB and RES_SMALL
+
+/**
+ * @brief a resolution of an image made from its original
+ */
+struct variant {
+    void* image; // NULL if not made
+    size_t size;
+};
+
+/**
+ * @brief frees the variants of an image
+ *
+ * @param variants indexed by resolution
+ */
+void free_variants(struct variant variants[NB_VARIANTS]);
+
+/**
+ * @brief makes the wanted variants of an original image held in memory, decoding it once
+ *
+ * The original is decoded already scaled down by the JPEG decoder (1/2, 1/4
+ * or 1/8) as far as the largest variant allows. The small image is kept in
+ * memory and the thumbnail is made from it when it is large enough, rather
+ * than from the original. With IMGST_EXIF_THUMBS, the thumbnail is made
+ * from the one embedded in the EXIF data when it is large enough.
+ *
+ * @param imgstFile structure for header (sizes of the resolutions)
+ * @param orig_image the original image
+ * @param orig_size size of the original image
+ * @param wanted the resolutions to make, indexed by resolution
+ * @param variants output, indexed by resolution (to free with free_variants)
+ * @param width output (if not NULL), width of the original image
+ * @param height output (if not NULL), height of the original image
+ * @return Some error code. 0 if no error.
+ */
+int resize_variants(struct imgst_file* imgstFile, const void* orig_image, size_t orig_size, const bool wanted[NB_VARIANTS],
+                    struct variant variants[NB_VARIANTS], uint32_t* width, uint32_t* height);
+
 /**
- * @brief: Add image of the res specified to the database if not already present
+ * @brief makes the wanted variants of the original image at orig_offset, without writing anything in the imgStore
+ *
+ * Only reads immutable bytes of the file, so it can run without holding the lock of imgstFile.
+ *
+ * @param imgstFile structure for header, metadata
+ * @param orig_offset position of the original image in the file
+ * @param orig_size size of the original image
+ * @param wanted the resolutions to make, indexed by resolution
+ * @param variants output, indexed by resolution (to free with free_variants)
+ * @return Some error code. 0 if no error.
+ */
+int resize_image(struct imgst_file* imgstFile, uint64_t orig_offset, uint32_t orig_size, const bool wanted[NB_VARIANTS],
+                 struct variant variants[NB_VARIANTS]);
+
+/**
+ * @brief makes the original image at orig_offset fit in a box of any size, without writing anything in the imgStore
+ *
+ * The original is decoded already scaled down by the JPEG decoder as far as
+ * the box allows, and never scaled up. Only reads immutable bytes of the file,
+ * so it can run without holding the lock of imgstFile.
  *
- * @param res of the image we want to create
  * @param imgstFile structure for header, metadata
- * @param index of image we have to modify
+ * @param orig_offset position of the original image in the file
+ * @param orig_size size of the original image
+ * @param width of the box
+ * @param height of the box
+ * @param image output, the resized image (to free)
+ * @param size output, size of the resized image
  * @return Some error code. 0 if no error.
  */
-int lazily_resize(uint16_t res, struct imgst_file* imgstFile, uint32_t index);
+int resize_box(struct imgst_file* imgstFile, uint64_t orig_offset, uint32_t orig_size, uint32_t width, uint32_t height,
+               void** image, size_t* size);
 
 /**
  * @brief stores the height and width of the image
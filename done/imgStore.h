@@ -23,6 +23,8 @@
                     */
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint32_t, uint64_t
+#include <pthread.h> // for pthread_rwlock_t
+#include <stdbool.h>
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
 #define CAT_TXT "EPFL ImgStore binary"
@@ -30,6 +32,7 @@
 /* constraints */
 #define MAX_IMGST_NAME  31  // max. size of a ImgStore name
 #define MAX_IMG_ID     127  // max. size of an image id
+#define SHA_STRING_LENGTH (2 * SHA256_DIGEST_LENGTH + 1) // SHA in hexadecimal, with its null byte
 #define MAX_MAX_FILES 100000
 #define VECTOR_PADDING 100
 
@@ -53,6 +56,14 @@
 
 #define NB_HEADER_PER_FILE 1
 
+/* For imgst_header.flags: the thumbnail and small images are made when the image is inserted */
+#define IMGST_EAGER_VARIANTS 0x1
+/* For imgst_header.flags: the thumbnail is made from the one embedded by the camera (EXIF) when it is large enough */
+#define IMGST_EXIF_THUMBS 0x2
+
+/* For the in-memory indexes: marks an empty bucket or the end of a chain */
+#define INDEX_NIL UINT32_MAX
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -66,8 +77,8 @@ struct imgst_header {
     const uint16_t res_resized[(NB_RES - 1)*(NB_DIMENSIONS)]; // max resolution of images thumbnailX, thumbnailY, smallX,_y
     //don't have origin res here + should not be modified after initialisation (image creation)
 
-    //both fields below are reserved for potential future improvements
-    uint32_t unused_32;
+    uint32_t flags; // options chosen at creation (IMGST_*)
+    //the field below is reserved for potential future improvements
     uint64_t unused_64;
 };
 
@@ -82,10 +93,93 @@ struct img_metadata {
 };
 
 
+/**
+ * in-memory chained hash table from a key to metadata slots (never stored on disk),
+ * the links are stored per slot so that a slot belongs to at most one chain
+ */
+struct slot_index {
+    uint32_t nb_buckets; // always a power of two
+    uint32_t* heads; // first slot of each bucket, INDEX_NIL if the bucket is empty
+    uint32_t* next; // next slot in the same bucket (one entry per metadata slot)
+};
+
+/**
+ * in-memory slots of the valid metadata sorted by img_id (never stored on disk),
+ * so that the images can be listed by pages
+ */
+struct id_order {
+    uint32_t* slots; // NULL while the indexes are being built
+    uint32_t nb_slots;
+};
+
+/**
+ * in-memory struct-of-arrays copy of the metadata fields used by the scans and lookups,
+ * so that they do not pull the (cold) img_id and SHA of every metadata through the cache
+ */
+struct metadata_columns {
+    uint64_t* valid; // bit i (of word i / 64) is set when metadata[i] is NON_EMPTY
+    uint32_t free_hint; // every word of valid before this one is full (no EMPTY metadata)
+    uint64_t* id_hash; // hash of the img_id of each metadata
+    uint64_t (*offset)[NB_RES]; // offsets of each metadata
+    uint32_t (*size)[NB_RES]; // sizes of each metadata
+    uint32_t* generation; // of the image in each slot, tells it apart from the ones stored there before (in memory only)
+    uint32_t last_generation; // given to the last image added
+};
+
+/**
+ * read-only memory mapping of the imgStore file; when the file outgrows it, a larger
+ * one is added in front of the list and the older ones stay valid until do_close
+ */
+struct imgst_mapping {
+    const char* address; // first byte of the file
+    size_t size; // number of bytes of the file that can be viewed through this mapping
+    struct imgst_mapping* previous; // older (smaller) mapping, NULL if none
+};
+
+/** the JSON list of the images (see do_list), serialized once per imgst_version */
+struct imgst_list_cache {
+    pthread_mutex_t lock; // listings share imgst_file->lock, they rebuild the list one at a time
+    char* json; // NULL until the imgStore is listed
+    size_t len;
+    uint32_t version; // imgst_version of json
+    char sha[SHA_STRING_LENGTH]; // of json, tells the lists of different imgStores apart
+};
+
 struct imgst_file {
     FILE *file;
+    int fd; // descriptor of file, every read and write is positional on it (see imgst_io.h)
+    uint64_t end_offset; // size of the file, where the next image is appended
+    struct imgst_mapping* mapping; // read-only mappings of the file (see do_read_view), NULL until the first view
     struct imgst_header header;
     struct img_metadata* metadata;
+    struct slot_index id_index; // img_id -> slot of the valid images, built by do_open
+    struct slot_index sha_index; // SHA -> slots of the valid images having this content, built by do_open
+    struct id_order id_order; // slots of the valid images sorted by img_id, built by do_open
+    struct metadata_columns columns; // built by do_open, refreshed by write_metadata
+    struct imgst_wal* wal; // log of the header and metadata writes (see imgst_wal.h), NULL if not opened for writing
+    struct imgst_resizer* resizer; // resizes in flight (see imgst_resize.h)
+    bool eager_variants; // make the variants in do_insert, from IMGST_EAGER_VARIANTS unless changed by the caller
+    //called by do_delete with the slot of the deleted image (once the lock is released), NULL if none
+    void (*on_delete)(void* arg, uint32_t index);
+    void* on_delete_arg;
+    //the do_* functions may be called by several threads: lookups share lock, mutations take it alone
+    pthread_rwlock_t lock;
+    pthread_mutex_t mapping_lock; // readers sharing lock add mappings one at a time
+    struct imgst_list_cache list_cache;
+};
+
+/** the image of a slot: the same slot and generation always hold the same image */
+struct image_version {
+    uint32_t index;
+    uint32_t generation;
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // of the original, to tell its content apart from the images stored before under its id
+};
+
+/** what do_read_available does when the resolution asked does not exist yet */
+enum resize_policy {
+    RESIZE_WAIT, // resize the image right away, as do_read_location
+    RESIZE_CLOSEST, // resize it in the background, give the closest larger resolution meanwhile
+    RESIZE_LATER // resize it in the background, give no image meanwhile
 };
 
 /** different format types accepted */
@@ -109,6 +203,14 @@ void vector_metadata_delete(struct imgst_file* imgst_file);
  */
 void print_header( const struct imgst_header * header);
 
+/**
+ * @brief Writes a SHA in hexadecimal.
+ *
+ * @param SHA The SHA to write.
+ * @param sha_string Output, of SHA_STRING_LENGTH chars (null-terminated).
+ */
+void sha_to_string(const unsigned char *SHA, char *sha_string);
+
 /**
  * @brief Prints image metadata informations.
  *
@@ -138,7 +240,31 @@ void do_close (struct imgst_file * const imgst_file);
  * @param imgst_file Structure for header, metadata and file pointer to be freed/closed.
  * @return string containing info about the database (header fields and metadatas)
  */
-char* do_list(const struct imgst_file* imgst_file, enum do_list_mode format);
+char* do_list(struct imgst_file* imgst_file, enum do_list_mode format);
+
+/**
+ * @brief Lists a page of the images in the order of their ids, in JSON
+ *
+ * Takes a time proportional to the size of the page, the page is
+ * {"Images": [...], "next": <cursor of the next page, null if none>}.
+ *
+ * @param imgst_file The main in-memory data structure
+ * @param prefix Only the ids starting with it are listed ("" for all of them)
+ * @param cursor "next" of the previous page, NULL for the first page
+ * @param limit Max number of images in the page (at least 1)
+ * @return the page (to free), NULL if out of memory
+ */
+char* do_list_page(struct imgst_file* imgst_file, const char* prefix, const char* cursor, uint32_t limit);
+
+/**
+ * @brief Gives the JSON list of do_list, serialized again only once the imgStore changed
+ *
+ * @param imgst_file The main in-memory data structure
+ * @param sha Output, SHA of the JSON list in hexadecimal (SHA_STRING_LENGTH chars)
+ * @param json Output (ignored if NULL), copy of the JSON list (to free)
+ * @return Some error code. 0 if no error.
+ */
+int do_list_json_cached(struct imgst_file* imgst_file, char* sha, char** json);
 
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
@@ -184,6 +310,59 @@ int resolution_atoi(const char* resolution);
  */
 int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgst_file* imgst_file);
 
+/**
+ * @brief Gives access to the content of an image without copying it, through a
+ *        read-only memory mapping of the imgStore file.
+ *
+ * The image is resized first if needed, as in do_read. The returned view stays
+ * valid until do_close, even if the file grows in the meantime.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param image_view Location of the pointer to the first byte of the image
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_view(const char* img_id, int resolution, const char** image_view, uint32_t* image_size, struct imgst_file* imgst_file);
+
+/**
+ * @brief Gives the position of an image in the imgStore file, for callers doing
+ *        their own I/O on imgst_file->fd (e.g. sendfile).
+ *
+ * The image is resized first if needed, as in do_read.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param image_offset Location of the offset of the image in the file
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_location(const char* img_id, int resolution, uint64_t* image_offset, uint32_t* image_size, struct imgst_file* imgst_file);
+
+/**
+ * @brief Gives the position of an image in the imgStore file, as do_read_location,
+ *        without waiting for a missing resolution unless policy is RESIZE_WAIT.
+ *
+ * A missing resolution is left to the background resize threads (see
+ * imgst_resizer_start); meanwhile, the closest larger resolution is given
+ * with RESIZE_CLOSEST, and no image with RESIZE_LATER.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param policy What to do if the resolution does not exist yet.
+ * @param served_res Location of the resolution given, -1 if no image is given
+ * @param image_offset Location of the offset of the image in the file
+ * @param image_size Location of the image size variable (0 if no image is given)
+ * @param version Location of the slot, generation and SHA of the image (ignored if NULL), to cache it
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_available(const char* img_id, int resolution, enum resize_policy policy, int* served_res,
+                      uint64_t* image_offset, uint32_t* image_size, struct image_version* version,
+                      struct imgst_file* imgst_file);
+
 /**
  * @brief Insert image in the imgStore file
  *
@@ -194,6 +373,31 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
  */
 int do_insert(const char* buffer, size_t img_size, const char* img_id, struct imgst_file* imgst_file);
 
+/**
+ * @brief one image of a batch insertion (see do_insert_batch)
+ */
+struct insert_item {
+    const char* buffer; // raw image content
+    size_t size;
+    const char* img_id;
+    int result; // output, error code of the insertion of this image
+};
+
+/**
+ * @brief Insert several images in the imgStore file at once
+ *
+ * The images are hashed in parallel and deduplicated against the imgStore
+ * and against each other, the new contents are appended with a single
+ * vectored write, then the modified metadata and the header are written
+ * once for the whole batch.
+ *
+ * @param items images to insert, the result of each insertion is stored in it
+ * @param nb_items number of images
+ * @return ERR_NONE if the batch was written (an image may still have failed,
+ *         see its result), else the error that prevented it
+ */
+int do_insert_batch(struct insert_item* items, size_t nb_items, struct imgst_file* imgst_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
@@ -221,6 +425,15 @@ int write_header(struct imgst_file* imgst_file);
  */
 int write_metadata(struct imgst_file* imgst_file, size_t i);
 
+/**
+ * helper method to write the metadata of nb consecutive images with a single write
+ * @param imgst_file
+ * @param first index of the first metadata in the array
+ * @param nb number of metadata to write
+ * @return error code as defined in error.h
+ */
+int write_metadata_range(struct imgst_file* imgst_file, size_t first, size_t nb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,6 +14,7 @@
 #include "image_content.h"
 #include "dedup.h"
 
+#include <limits.h> // for INT_MAX
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -97,6 +98,7 @@ do_create_cmd (int argc, char* argv[])
     uint16_t thumb_res_y = 64;
     uint16_t small_res_x = 256;
     uint16_t small_res_y = 256;
+    uint32_t flags = 0;
 
     while(argc > 0) { //read others arguments to set img characteristics
         if (!strcmp(argv[0], "-max_files")) {
@@ -138,6 +140,14 @@ do_create_cmd (int argc, char* argv[])
                     if (small_res_x == 0 || small_res_y == 0) {
                         return ERR_RESOLUTIONS;
                     }
+                } else if (!strcmp(argv[0], "-eager")) {
+                    flags |= IMGST_EAGER_VARIANTS;
+                    --argc;
+                    ++argv;
+                } else if (!strcmp(argv[0], "-exif_thumb")) {
+                    flags |= IMGST_EXIF_THUMBS;
+                    --argc;
+                    ++argv;
                 } else {
                     return ERR_INVALID_ARGUMENT;
                 }
@@ -148,7 +158,8 @@ do_create_cmd (int argc, char* argv[])
     puts("Create");
 
     struct imgst_file myfile = {.header.max_files = max_files, .header.num_files = 0, .header.imgst_version = 0,
-               .header.res_resized = {thumb_res_x, thumb_res_y, small_res_x, small_res_y}
+               .header.res_resized = {thumb_res_x, thumb_res_y, small_res_x, small_res_y},
+               .header.flags = flags
     };
 
     //call to 'do_create' will initialize the others fields of myfile
@@ -182,10 +193,15 @@ int help (int argc, char* argv[])
            "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
            "                                  default value is 256x256\n"
            "                                  maximum value is 512x512\n"
+           "          -eager: make the thumbnail and small images when an image is inserted\n"
+           "                                  (by default they are made when first read)\n"
+           "          -exif_thumb: make the thumbnail images from the thumbnail embedded by the camera\n"
+           "                                  when it is large enough, without decoding the image\n"
            "  read <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
            "      read an image from the imgStore and save it to a file.\n"
            "      default resolution is \"original\".\n"
-           "  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n"
+           "  insert <imgstore_filename> <imgID> <filename> [<imgID> <filename> ...]:\n"
+           "      insert new images in the imgStore (several images are inserted as one batch).\n"
            "  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n"
            "gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.");
 
@@ -308,6 +324,48 @@ int check_args_insert_and_read(int* argc, char** argv[], const char** img_store_
 }
 
 
+/**
+ * reads the images of the (imgID, filename) pairs and inserts them with do_insert_batch
+ * @param img_store_filename
+ * @param nb_pairs
+ * @param pairs imgID then filename, nb_pairs times
+ * @return error code as defined in error.h
+ */
+static int insert_batch(const char* img_store_filename, size_t nb_pairs, char* pairs[])
+{
+    struct insert_item* items = calloc(nb_pairs, sizeof(struct insert_item));
+    if(items == NULL) return ERR_OUT_OF_MEMORY;
+
+    int ret = ERR_NONE;
+    for(size_t k = 0; k < nb_pairs && ret == ERR_NONE; ++k) {
+        items[k].img_id = pairs[2 * k];
+        if(strlen(items[k].img_id) == 0 || strlen(items[k].img_id) > MAX_IMG_ID) {
+            ret = ERR_INVALID_IMGID;
+        } else {
+            ret = read_disk_image((char**) &items[k].buffer, &items[k].size, pairs[2 * k + 1]);
+        }
+    }
+
+    struct imgst_file myfile;
+    if(ret == ERR_NONE && (ret = do_open(img_store_filename, "rb+", &myfile)) == ERR_NONE) {
+        ret = do_insert_batch(items, nb_pairs, &myfile);
+        do_close(&myfile);
+        //the first image that could not be inserted gives the error
+        for(size_t k = 0; k < nb_pairs && ret == ERR_NONE; ++k) {
+            if(items[k].result != ERR_NONE) {
+                fprintf(stderr, "%s: %s\n", items[k].img_id, ERR_MESSAGES[items[k].result]);
+                ret = items[k].result;
+            }
+        }
+    }
+
+    for(size_t k = 0; k < nb_pairs; ++k) {
+        free((char*) items[k].buffer);
+    }
+    free(items);
+    return ret;
+}
+
 /********************************************************************//**
  * Prepares and calls do_insert command.
 ********************************************************************** */
@@ -316,9 +374,15 @@ int do_insert_cmd (int argc, char* argv[])
     const char* img_store_filename = NULL;
     const char* imgID = NULL;
 
-    int ret = check_args_insert_and_read(&argc, &argv, &img_store_filename, &imgID, EXPECTED_NB_ARGS_DO_INSERT, EXPECTED_NB_ARGS_DO_INSERT);
+    int ret = check_args_insert_and_read(&argc, &argv, &img_store_filename, &imgID, EXPECTED_NB_ARGS_DO_INSERT, INT_MAX);
     if(ret != ERR_NONE) return ret;
 
+    //more than one (imgID, filename) pair: argv starts at the first imgID
+    if(argc > 1) {
+        if((argc + 1) % 2 != 0) return ERR_NOT_ENOUGH_ARGUMENTS;
+        return insert_batch(img_store_filename, (size_t) (argc + 1) / 2, argv);
+    }
+
     const char* filename = (++argv)[0]; --argc;
     if(strlen(img_store_filename) == 0) {
         return ERR_INVALID_FILENAME;
@@ -391,7 +455,7 @@ int create_name(const char * img_id, const char * resolution_suffix, char** name
  * @param image_size
  * @return error code as defined in error.h
  */
-int write_disk_image(const char * img_id, const int res, char* image_buffer, uint32_t image_size)
+int write_disk_image(const char * img_id, const int res, const char* image_buffer, uint32_t image_size)
 {
 
     if(img_id == NULL || res < 0 || res >= NB_RES || image_buffer == NULL || image_size == 0) {
@@ -457,24 +521,23 @@ int do_read_cmd (int argc, char* argv[])
         return err_do_open;
     }
 
-    char* buffer = NULL;
+    const char* view = NULL;
     uint32_t img_size = 0;
 
-    int err_do_read = do_read(imgID, res, &buffer, &img_size, &myfile);
+    //the image is written from the mapping of the imgStore, without intermediate copy
+    int err_do_read = do_read_view(imgID, res, &view, &img_size, &myfile);
     if(err_do_read != ERR_NONE) {
         do_close(&myfile);
         return err_do_read;
     }
 
-    int err_write = write_disk_image(imgID, res, buffer, img_size);
+    int err_write = write_disk_image(imgID, res, view, img_size);
     if(err_write != ERR_NONE) {
-        free(buffer);
         do_close(&myfile);
         fprintf(stderr, "Error: can't write image on the disk");
         return err_write;
     }
 
-    free(buffer);
     do_close(&myfile);
 
     return ERR_NONE;
@@ -2,21 +2,65 @@
 #include <stdio.h>
 #include <vips/vips.h>
 #include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h> // for sysconf
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
 #include "mongoose.h"
 #include "imgStore.h"
+#include "image_content.h"
+#include "imgst_cache.h"
+#include "imgst_io.h"
+#include "imgst_resize.h"
+#include "imgst_ring.h"
 #include "util.h"
 
 #define POLLING_TIME_MS 1000 //each poll takes 1000 ms = 1 sec
+#define TRANSFER_POLLING_TIME_MS 5 //shorter polls while file transfers are pending (they are driven by the polls)
+#define ANSWERING_LABEL "imgStore" //label of the connections that answer a request of the imgStore, they take no other one
+#define WAKEUP_ADDR "udp://127.0.0.1:0" //placeholder socket of the connection that polls wakeup_fd
+#define SENDFILE_MIN_SIZE (64 * 1024) //smaller images are read with the ring and copied in the send buffer of the connection
+#define RING_ENTRIES 256
+#define MIN_WORKERS 2
+#define MAX_WORKERS 16
+#define MAX_UPLOAD_PATH 64
+#define RESIZE_THREADS 2 //background resizes of the resolutions missing when read
+#define RETRY_AFTER_S 1 //when the resolution asked is being resized
 #define EXPECTED_NB_ARGS_MAIN 2
+#define ACCEPTED_HTTP_CODE 202
 #define FOUND_HTTP_CODE 302
+#define NOT_MODIFIED_HTTP_CODE 304
 #define ERROR_HTTP_CODE 500
 #define OFFSET_SIZE 40
 #define MAX_RES_LEN 10
+#define MAX_LIMIT_LEN 10
+#define DEFAULT_LIST_PAGE 100 //images in a page of the list when only prefix or cursor is given
+#define MAX_LIST_PAGE 1000
+#define MAX_BOX_RES 4096 //largest width or height of the sizes asked with w and h
+#define IMAGE_CACHE_SIZE (64 * 1024 * 1024) //bytes of the small images (and the ones made for w and h) kept in memory
+#define IMAGE_CACHE_SHARDS 16
+#define MAX_ETAG_LEN (SHA_STRING_LENGTH + 2 * MAX_RES_LEN + 4) //"sha-variant", the variant being a resolution or WxH
+#define MAX_CACHE_HEADERS_LEN (MAX_ETAG_LEN + 96)
+#define MAX_IF_NONE_MATCH_LEN 512 //longer lists of ETags are ignored, the image is sent
+#define IMMUTABLE_MAX_AGE_S 31536000 //one year, for the images whose URL pins their content with v
 
 static const char*  LISTENING_ADDR = "http://localhost:8000";
 static const char* WEB_DIRECTORY = ".";
 static const char* TMP_DIRECTORY = "/tmp";
 
+/**
+ * what a read does when the resolution asked does not exist yet,
+ * chosen by the optional second argument ("wait", "closest" or "later")
+ */
+static enum resize_policy resize_policy = RESIZE_CLOSEST;
+
+/**
+ * names of the resolutions in the ETags
+ */
+static const char* const RES_NAMES[NB_RES] = {"thumb", "small", "orig"};
+
 
 
 
@@ -28,6 +72,117 @@ static const char* TMP_DIRECTORY = "/tmp";
  */
 static int terminal_signal = 0;
 
+/**
+ * image being sent with sendfile from the imgStore file, once the
+ * headers (in the send buffer of the connection) have been sent
+ */
+struct file_transfer {
+    struct mg_connection* connection;
+    int fd; // file descriptor of the imgStore
+    uint64_t offset; // position in the imgStore file of the next byte to send
+    size_t remaining; // number of bytes still to send
+    struct file_transfer* next;
+};
+
+/**
+ * transfers that are not finished, at most one per connection
+ */
+static struct file_transfer* file_transfers = NULL;
+
+/**
+ * image being read with the ring, its response is sent once the read completes
+ */
+struct ring_read {
+    struct mg_connection* connection; // NULL if the connection was closed meanwhile
+    const struct imgst_file* imgstFile;
+    char* buffer;
+    uint64_t offset; // of the image in the imgStore file
+    uint32_t size;
+    uint32_t nb_read; // bytes of buffer read so far, a short read is resumed from there
+    struct imgst_cache_key key; // the image is added to image_cache once read
+    char cache_headers[MAX_CACHE_HEADERS_LEN]; // ETag and Cache-Control of the image
+    struct ring_read* next;
+};
+
+/**
+ * reads that are not completed, at most one per connection
+ */
+static struct ring_read* ring_reads = NULL;
+
+/**
+ * asynchronous reads of the imgStore file, shared by all the connections
+ */
+static struct imgst_ring ring;
+
+/**
+ * small images read from the imgStore, and the ones made for the sizes asked with w and h
+ * (never stored in the imgStore), shared by the workers and the event loop
+ */
+static struct imgst_cache image_cache;
+
+/**
+ * the different requests handled by the workers
+ */
+enum job_kind {
+    JOB_LIST,
+    JOB_READ,
+    JOB_READ_BOX,
+    JOB_DELETE,
+    JOB_INSERT
+};
+
+/**
+ * request given to a worker thread by the event loop, then posted back with its result
+ */
+struct job {
+    enum job_kind kind;
+    unsigned long connection_id; // the connection may be closed before the job is done
+    struct imgst_file* imgstFile;
+    char img_id[MAX_IMG_ID + 1];
+    int res; // read: resolution asked
+    uint32_t width; // read box: size asked
+    uint32_t height;
+    uint32_t upload_size; // insert: size of the image uploaded in TMP_DIRECTORY
+    uint32_t limit; // list: max number of images of the page, 0 for the whole list
+    char prefix[MAX_IMG_ID + 1]; // list: of the ids of the page
+    char cursor[MAX_IMG_ID + 1]; // list: the page starts after this id, empty for the first page
+    char if_none_match[MAX_IF_NONE_MATCH_LEN]; // list, read: ETags of the copies the client has, empty if none
+    char version[SHA_STRING_LENGTH]; // read: SHA of the original pinned by the URL with v, empty if none
+
+    //result
+    int error;
+    char* body; // list: JSON content
+    const struct imgst_cache_entry* entry; // read: the image if it is in image_cache (to release), else NULL
+    struct imgst_cache_key key; // read: how the image is cached
+    int served_res; // read: resolution found, -1 if it is being resized
+    uint64_t img_offset; // read: where the image is in the imgStore file
+    uint32_t img_size;
+    bool not_modified; // list, read: the client has the list or the image already, nothing is read
+    char cache_headers[MAX_CACHE_HEADERS_LEN]; // list, read: ETag and Cache-Control of the response
+
+    struct job* next;
+};
+
+/**
+ * FIFO of jobs shared by threads
+ */
+struct job_queue {
+    struct job* first;
+    struct job* last;
+    bool closed; // no job will be pushed anymore, the workers stop once it is empty
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+static struct job_queue todo_jobs = {NULL, NULL, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static struct job_queue done_jobs = {NULL, NULL, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/**
+ * written by the workers once a job is done and by the kernel once a read of the ring completes,
+ * polled by the event loop that then sends the responses
+ */
+static int wakeup_fd = -1;
+
 /**
  * method reply with html error, and specific error message
  */
@@ -48,24 +203,751 @@ static void terminal_signals_handler(int s)
 
 //-------------------------------------------------------------------------------
 /**
- * do the the do_list request
+ * add job at the end of queue, and wake up a thread waiting for it
+ */
+static void job_queue_push(struct job_queue* queue, struct job* job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->last == NULL) {
+        queue->first = job;
+    } else {
+        queue->last->next = job;
+    }
+    queue->last = job;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * wait for a job in queue and remove it
+ * @return the first job of queue, NULL once the queue is closed and empty
+ */
+static struct job* job_queue_pop(struct job_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while(queue->first == NULL && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    struct job* job = queue->first;
+    if(job != NULL) {
+        queue->first = job->next;
+        if(queue->first == NULL) queue->last = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/**
+ * empty queue without waiting
+ * @return the jobs that were in queue, linked in order
+ */
+static struct job* job_queue_take_all(struct job_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    struct job* jobs = queue->first;
+    queue->first = NULL;
+    queue->last = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return jobs;
+}
+
+/**
+ * wake up the workers and make them stop once the queue is empty
+ */
+static void job_queue_close(struct job_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//-------------------------------------------------------------------------------
+/**
+ * @return the pending transfer of connection, NULL if there is none
+ */
+static struct file_transfer* find_file_transfer(const struct mg_connection* connection)
+{
+    struct file_transfer* transfer = file_transfers;
+    while(transfer != NULL && transfer->connection != connection) {
+        transfer = transfer->next;
+    }
+    return transfer;
+}
+
+/**
+ * forget the pending transfer of connection (if any)
+ */
+static void remove_file_transfer(const struct mg_connection* connection)
+{
+    struct file_transfer** link = &file_transfers;
+    while(*link != NULL && (*link)->connection != connection) {
+        link = &(*link)->next;
+    }
+    if(*link != NULL) {
+        struct file_transfer* transfer = *link;
+        *link = transfer->next;
+        free(transfer);
+    }
+}
+
+/**
+ * send as much of the pending transfer of connection as the socket accepts,
+ * straight from the page cache, then close the connection once everything is sent
+ */
+static void continue_file_transfer(struct mg_connection* connection)
+{
+    struct file_transfer* transfer = find_file_transfer(connection);
+    //the headers must leave the send buffer first
+    if(transfer == NULL || connection->send.len > 0) return;
+
+    while(transfer->remaining > 0) {
+        off_t offset = (off_t) transfer->offset;
+        ssize_t sent = sendfile((int) (size_t) connection->fd, transfer->fd, &offset, transfer->remaining);
+        if(sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return; //socket full, continue on a next poll
+        }
+        if(sent <= 0) {
+            remove_file_transfer(connection);
+            connection->is_closing = 1;
+            return;
+        }
+        transfer->offset += (uint64_t) sent;
+        transfer->remaining -= (size_t) sent;
+    }
+
+    remove_file_transfer(connection);
+    connection->is_draining = 1;
+}
+
+/**
+ * register the transfer of size bytes of the imgStore file from offset,
+ * it is driven by the MG_EV_WRITE and MG_EV_POLL events of connection
  */
-static void handle_list_call(struct imgst_file* imgstFile, struct mg_connection* connection)
+static int start_file_transfer(struct imgst_file* imgstFile, struct mg_connection* connection, uint64_t offset, size_t size)
 {
-    //create json
-    char* json_str = do_list(imgstFile, JSON);
+    struct file_transfer* transfer = calloc(1, sizeof(struct file_transfer));
+    if(transfer == NULL) return ERR_OUT_OF_MEMORY;
 
-    //http respond with content as json
+    transfer->connection = connection;
+    transfer->fd = imgstFile->fd;
+    transfer->offset = offset;
+    transfer->remaining = size;
+    transfer->next = file_transfers;
+    file_transfers = transfer;
+    return ERR_NONE;
+}
+
+//-------------------------------------------------------------------------------
+/**
+ * @return the pending ring read of connection, NULL if there is none
+ */
+static struct ring_read* find_ring_read(const struct mg_connection* connection)
+{
+    struct ring_read* read = ring_reads;
+    while(read != NULL && read->connection != connection) {
+        read = read->next;
+    }
+    return read;
+}
+
+/**
+ * send an image of image_cache, with its cache_headers
+ */
+static void send_cached_image(struct mg_connection* connection, const struct imgst_cache_entry* entry,
+                              const char* cache_headers)
+{
     mg_printf(connection,
               "HTTP/1.1 200 OK\r\n"
-              "Content-Type: application/json\r\n"
-              "Content-Length: %zu\r\n\r\n%s",
-              strlen(json_str), json_str);
+              "Content-Type: image/jpeg\r\n"
+              "%s"
+              "Content-Length: %zu\r\n\r\n",
+              cache_headers, (size_t) entry->size);
+    mg_send(connection, entry->image, entry->size);
+}
+
+/**
+ * queue the read of size bytes of the imgStore file from offset,
+ * the response is sent to connection by complete_ring_reads
+ */
+static int start_ring_read(struct imgst_file* imgstFile, struct mg_connection* connection, uint64_t offset, uint32_t size,
+                           const struct imgst_cache_key* key, const char* cache_headers)
+{
+    struct ring_read* read = calloc(1, sizeof(struct ring_read));
+    if(read == NULL) return ERR_OUT_OF_MEMORY;
+    read->buffer = malloc(size);
+    if(read->buffer == NULL) {
+        free(read);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = imgst_ring_read(&ring, imgstFile, read->buffer, size, offset, (uint64_t) (uintptr_t) read);
+    if(ret != ERR_NONE) {
+        free(read->buffer);
+        free(read);
+        return ret;
+    }
+    read->connection = connection;
+    read->imgstFile = imgstFile;
+    read->offset = offset;
+    read->size = size;
+    read->key = *key;
+    strncpy(read->cache_headers, cache_headers, MAX_CACHE_HEADERS_LEN - 1);
+    read->next = ring_reads;
+    ring_reads = read;
+    return ERR_NONE;
+}
+
+/**
+ * continue a read that stopped short of its size (a signal, the device): queue the rest
+ * of it, or read the rest now if the ring can't take it
+ * @return ERR_IO if the rest can't be read, else ERR_NONE (the rest is queued,
+ *         or read already if read->nb_read == read->size)
+ */
+static int resume_ring_read(struct ring_read* read)
+{
+    uint32_t const nb_left = read->size - read->nb_read;
+    if(imgst_ring_read(&ring, read->imgstFile, read->buffer + read->nb_read, nb_left, read->offset + read->nb_read,
+                       (uint64_t) (uintptr_t) read) == ERR_NONE) {
+        return ERR_NONE;
+    }
+    if(imgst_pread(read->imgstFile, read->buffer + read->nb_read, nb_left, read->offset + read->nb_read) != ERR_NONE) {
+        return ERR_IO;
+    }
+    read->nb_read = read->size;
+    return ERR_NONE;
+}
+
+/**
+ * send the responses of the reads completed by the ring, then close their connections
+ */
+static void complete_ring_reads(void)
+{
+    imgst_ring_submit(&ring);
+
+    struct imgst_ring_completion completions[RING_ENTRIES];
+    size_t nb_completions = 0;
+    while((nb_completions = imgst_ring_reap(&ring, completions, RING_ENTRIES)) > 0) {
+        for(size_t i = 0; i < nb_completions; ++i) {
+            struct ring_read* read = (struct ring_read*) (uintptr_t) completions[i].user_data;
+
+            //the image was stored, only an error or the end of the file (0) leaves it incomplete
+            int const result = completions[i].result;
+            if(result > 0) {
+                read->nb_read += (uint32_t) result;
+                if(read->nb_read < read->size && resume_ring_read(read) == ERR_NONE && read->nb_read < read->size) {
+                    continue; //queued again, completed later
+                }
+            }
+
+            //unlink the read
+            struct ring_read** link = &ring_reads;
+            while(*link != read) link = &(*link)->next;
+            *link = read->next;
+
+            //the next reads of the image are answered from the cache, even if this connection was closed
+            const struct imgst_cache_entry* entry = NULL;
+            if(read->nb_read == read->size) {
+                imgst_cache_put(&image_cache, &read->key, read->buffer, read->size, &entry);
+            } else {
+                free(read->buffer);
+            }
+
+            if(read->connection != NULL) {
+                if(entry != NULL) {
+                    send_cached_image(read->connection, entry, read->cache_headers);
+                } else {
+                    mg_error_msg(read->connection, ERR_IO);
+                }
+                read->connection->is_draining = 1;
+            }
+            imgst_cache_release(&image_cache, entry);
+            free(read);
+        }
+    }
+    //the rests of the short reads
+    imgst_ring_submit(&ring);
+}
+
+/**
+ * the buffer of a read can only be freed once the kernel is done with it,
+ * so a closed connection is just detached from its read
+ */
+static void detach_ring_read(const struct mg_connection* connection)
+{
+    struct ring_read* read = find_ring_read(connection);
+    if(read != NULL) read->connection = NULL;
+}
+
+/**
+ * at shutdown: wait until the kernel is done with the buffers of the ring reads, then free them,
+ * without sending the responses
+ */
+static void free_ring_reads(void)
+{
+    struct imgst_ring_completion completions[RING_ENTRIES];
+    while(imgst_ring_pending(&ring) > 0) {
+        if(imgst_ring_wait(&ring) != ERR_NONE) {
+            //the kernel may still write in the buffers: they are left allocated
+            fprintf(stderr, "unable to wait for the reads of the ring\n");
+            return;
+        }
+        imgst_ring_reap(&ring, completions, RING_ENTRIES);
+    }
+
+    while(ring_reads != NULL) {
+        struct ring_read* next = ring_reads->next;
+        free(ring_reads->buffer);
+        free(ring_reads);
+        ring_reads = next;
+    }
+}
+
+//-------------------------------------------------------------------------------
+/**
+ * start sending the image of img_size bytes at img_offset of the imgStore file:
+ * big images are sent by the kernel from the page cache after the headers,
+ * small ones are read with the ring, the event loop does not wait for the device
+ */
+static void send_image(struct imgst_file* imgstFile, struct mg_connection* connection, uint64_t img_offset, uint32_t img_size,
+                       const struct imgst_cache_key* key, const char* cache_headers)
+{
+    if(img_size >= SENDFILE_MIN_SIZE && start_file_transfer(imgstFile, connection, img_offset, img_size) == ERR_NONE) {
+        mg_printf(connection,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: image/jpeg\r\n"
+                  "%s"
+                  "Content-Length: %zu\r\n\r\n",
+                  cache_headers, (size_t) img_size);
+        return;
+    }
+
+    int err_read = start_ring_read(imgstFile, connection, img_offset, img_size, key, cache_headers);
+    if(err_read != ERR_NONE) {
+        mg_error_msg(connection, err_read);
+    }
+}
+
+/**
+ * read the image uploaded in TMP_DIRECTORY and insert it in the imgStore
+ * @return error code as defined in error.h
+ */
+static int insert_uploaded_image(struct imgst_file* imgstFile, const char* img_id, uint32_t img_size)
+{
+    // build the filepath tmp/img_id
+    char filepath[MAX_UPLOAD_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", TMP_DIRECTORY, img_id);
+
+    //open the image stored in tmp
+    FILE* fp = fopen(filepath, "r");
+    if(fp == NULL) return ERR_FILE_NOT_FOUND;
+
+    char* buffer = calloc(1, img_size);
+    if(buffer == NULL) {
+        fclose(fp);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // read image in allocated buffer
+    size_t nb_read = fread(buffer, img_size, 1, fp);
+    fclose(fp);
+    if(nb_read != 1) {
+        free(buffer);
+        return ERR_IO;
+    }
+
+    //insert image in database
+    int err_do_insert = do_insert(buffer, img_size, img_id, imgstFile);
+
+    free(buffer);
+    return err_do_insert;
+}
+
+/**
+ * @return whether the client has the copy of ETag etag already (If-None-Match of the job)
+ */
+static bool has_etag(const struct job* job, const char* etag)
+{
+    return !strcmp(job->if_none_match, "*") || strstr(job->if_none_match, etag) != NULL;
+}
+
+/**
+ * set the ETag and Cache-Control of the image of the job, and whether the client has it already;
+ * an id can be given to another image once deleted, so the image is only immutable
+ * for the URLs pinning the SHA of its original with v
+ * @param variant name of the resolution (or size) served
+ * @param exact whether it is the one asked, a closer one replaces it once resized
+ */
+static void set_cache_headers(struct job* job, const struct image_version* version, const char* variant, bool exact)
+{
+    char sha[SHA_STRING_LENGTH];
+    sha_to_string(version->SHA, sha);
+    char etag[MAX_ETAG_LEN];
+    snprintf(etag, MAX_ETAG_LEN, "\"%s-%s\"", sha, variant);
+
+    if(exact && !strcmp(job->version, sha)) {
+        snprintf(job->cache_headers, MAX_CACHE_HEADERS_LEN,
+                 "ETag: %s\r\nCache-Control: public, max-age=%d, immutable\r\n", etag, IMMUTABLE_MAX_AGE_S);
+    } else {
+        //the client asks again each time, and gets a 304 while it is unchanged
+        snprintf(job->cache_headers, MAX_CACHE_HEADERS_LEN, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    }
+    job->not_modified = has_etag(job, etag);
+}
+
+/**
+ * list the images for the job, unless the client has the current list already:
+ * the whole list is only serialized again once the imgStore changed, a page is made each time
+ * @return error code as defined in error.h
+ */
+static int list_images(struct imgst_file* imgstFile, struct job* job)
+{
+    char sha[SHA_STRING_LENGTH];
+    char etag[MAX_ETAG_LEN];
+    if(job->limit > 0) {
+        job->body = do_list_page(imgstFile, job->prefix, job->cursor[0] == '\0' ? NULL : job->cursor, job->limit);
+        if(job->body == NULL) return ERR_OUT_OF_MEMORY;
+        //the ETag of a page only spares sending it again
+        unsigned char SHA[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char*) job->body, strlen(job->body), SHA);
+        sha_to_string(SHA, sha);
+        snprintf(etag, MAX_ETAG_LEN, "\"%s\"", sha);
+        job->not_modified = has_etag(job, etag);
+        snprintf(job->cache_headers, MAX_CACHE_HEADERS_LEN, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+        return ERR_NONE;
+    }
+
+    int err_list = do_list_json_cached(imgstFile, sha, NULL);
+    if(err_list != ERR_NONE) return err_list;
+    snprintf(etag, MAX_ETAG_LEN, "\"%s\"", sha);
+
+    job->not_modified = has_etag(job, etag);
+    if(!job->not_modified) {
+        //the list may have changed meanwhile, its ETag is the one of the copy
+        err_list = do_list_json_cached(imgstFile, sha, &job->body);
+        if(err_list != ERR_NONE) return err_list;
+        snprintf(etag, MAX_ETAG_LEN, "\"%s\"", sha);
+    }
+    //the list changes with every insert and delete, the client asks again each time
+    snprintf(job->cache_headers, MAX_CACHE_HEADERS_LEN, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    return ERR_NONE;
+}
+
+/**
+ * find the image of the job, and take it from image_cache if it is there
+ * @return error code as defined in error.h
+ */
+static int read_image(struct imgst_file* imgstFile, struct job* job)
+{
+    struct image_version version;
+    int err_read = do_read_available(job->img_id, job->res, resize_policy, &job->served_res,
+                                     &job->img_offset, &job->img_size, &version, imgstFile);
+    if(err_read != ERR_NONE || job->served_res < 0) return err_read;
+
+    set_cache_headers(job, &version, RES_NAMES[job->served_res], job->served_res == job->res);
+    if(job->not_modified) return ERR_NONE; //nothing to read
+
+    job->key = (struct imgst_cache_key) {
+        version.index, version.generation, job->served_res, 0, 0
+    };
+    //only the small images are cached, the big ones are sent by the kernel from the page cache
+    if(job->img_size < SENDFILE_MIN_SIZE) {
+        job->entry = imgst_cache_get(&image_cache, &job->key);
+    }
+    return ERR_NONE;
+}
+
+/**
+ * make the image of the job fit in its box, or take it from image_cache
+ * @return error code as defined in error.h
+ */
+static int read_box(struct imgst_file* imgstFile, struct job* job)
+{
+    int served_res = RES_ORIG;
+    uint64_t orig_offset = 0;
+    uint32_t orig_size = 0;
+    struct image_version version;
+    int err_read = do_read_available(job->img_id, RES_ORIG, RESIZE_WAIT, &served_res, &orig_offset, &orig_size,
+                                     &version, imgstFile);
+    if(err_read != ERR_NONE) return err_read;
+
+    char box[2 * MAX_RES_LEN + 1];
+    snprintf(box, sizeof(box), "%ux%u", job->width, job->height);
+    set_cache_headers(job, &version, box, true);
+    if(job->not_modified) return ERR_NONE; //nothing to resize
+
+    job->key = (struct imgst_cache_key) {
+        version.index, version.generation, CACHE_RES_BOX, job->width, job->height
+    };
+    job->entry = imgst_cache_get(&image_cache, &job->key);
+    if(job->entry != NULL) return ERR_NONE;
+
+    void* image = NULL;
+    size_t size = 0;
+    int err_resize = resize_box(imgstFile, orig_offset, orig_size, job->width, job->height, &image, &size);
+    if(err_resize != ERR_NONE) return err_resize;
+    return imgst_cache_put(&image_cache, &job->key, image, (uint32_t) size, &job->entry);
+}
+
+/**
+ * imgst_file.on_delete: the images of the slot are not needed anymore
+ */
+static void evict_deleted_image(void* _unused arg, uint32_t index)
+{
+    imgst_cache_invalidate(&image_cache, index);
+}
+
+/**
+ * do the work of a job in a worker thread, the imgStore is shared by all the workers
+ * (its functions do their own locking)
+ */
+static void run_job(struct job* job)
+{
+    struct imgst_file* imgstFile = job->imgstFile;
+
+    switch(job->kind) {
+    case JOB_LIST:
+        job->error = list_images(imgstFile, job);
+        break;
+
+    case JOB_READ:
+        job->error = read_image(imgstFile, job);
+        break;
+
+    case JOB_READ_BOX:
+        job->error = read_box(imgstFile, job);
+        break;
+
+    case JOB_DELETE:
+        job->error = do_delete(job->img_id, imgstFile);
+        break;
+
+    case JOB_INSERT:
+        job->error = insert_uploaded_image(imgstFile, job->img_id, job->upload_size);
+        break;
+    }
+}
+
+/**
+ * make the poll of the event loop return, so that it completes the jobs done
+ */
+static void wake_event_loop(void)
+{
+    uint64_t const one = 1;
+    //the counter only overflows if the event loop is gone, the jobs are then freed at cleanup
+    if(write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "unable to wake the event loop up\n");
+    }
+}
+
+/**
+ * worker thread: run the jobs of the todo queue, and post them back to the event loop
+ */
+static void* worker_main(void* _unused arg)
+{
+    struct job* job = NULL;
+    while((job = job_queue_pop(&todo_jobs)) != NULL) {
+        run_job(job);
+        job_queue_push(&done_jobs, job);
+        wake_event_loop();
+    }
+    return NULL;
+}
+
+/**
+ * @return a new job for the request of connection, NULL if out of memory
+ */
+static struct job* new_job(struct imgst_file* imgstFile, struct mg_connection* connection, enum job_kind kind,
+                           const char* img_id)
+{
+    struct job* job = calloc(1, sizeof(struct job));
+    if(job == NULL) return NULL;
+
+    job->kind = kind;
+    job->connection_id = connection->id;
+    job->imgstFile = imgstFile;
+    if(img_id != NULL) strncpy(job->img_id, img_id, MAX_IMG_ID);
+    return job;
+}
+
+/**
+ * give a job to the workers, its response is sent by complete_jobs
+ */
+static void start_job(struct job* job)
+{
+    job_queue_push(&todo_jobs, job);
+}
+
+/**
+ * give a request to the workers, its response is sent by complete_jobs
+ * @return error code as defined in error.h
+ */
+static int dispatch_job(struct imgst_file* imgstFile, struct mg_connection* connection, enum job_kind kind,
+                        const char* img_id, uint32_t upload_size)
+{
+    struct job* job = new_job(imgstFile, connection, kind, img_id);
+    if(job == NULL) return ERR_OUT_OF_MEMORY;
+
+    job->upload_size = upload_size;
+    start_job(job);
+    return ERR_NONE;
+}
+
+/**
+ * @return the connection with this id, NULL if it was closed
+ */
+static struct mg_connection* find_connection(struct mg_mgr* mgr, unsigned long id)
+{
+    struct mg_connection* connection = mgr->conns;
+    while(connection != NULL && connection->id != id) {
+        connection = connection->next;
+    }
+    return connection;
+}
+
+/**
+ * send the responses of the jobs done by the workers to their connections
+ */
+static void complete_jobs(struct mg_mgr* mgr)
+{
+    struct job* job = job_queue_take_all(&done_jobs);
+    while(job != NULL) {
+        struct job* next = job->next;
+
+        struct mg_connection* connection = find_connection(mgr, job->connection_id);
+        if(connection != NULL) {
+            if(job->error != ERR_NONE) {
+                mg_error_msg(connection, job->error);
+            } else if(job->not_modified) {
+                mg_printf(connection,
+                          "HTTP/1.1 %d Not Modified\r\n"
+                          "%s"
+                          "Content-Length: 0\r\n\r\n", NOT_MODIFIED_HTTP_CODE, job->cache_headers);
+            } else if(job->kind == JOB_LIST) {
+                //http respond with content as json
+                mg_printf(connection,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: application/json\r\n"
+                          "%s"
+                          "Content-Length: %zu\r\n\r\n%s",
+                          job->cache_headers, strlen(job->body), job->body);
+            } else if(job->kind == JOB_READ && job->served_res < 0) {
+                //no image to give until the background resize is done
+                mg_printf(connection,
+                          "HTTP/1.1 %d Accepted\r\n"
+                          "Retry-After: %d\r\n"
+                          "Cache-Control: no-store\r\n"
+                          "Content-Length: 0\r\n\r\n", ACCEPTED_HTTP_CODE, RETRY_AFTER_S);
+            } else if(job->entry != NULL) {
+                send_cached_image(connection, job->entry, job->cache_headers);
+            } else if(job->kind == JOB_READ) {
+                send_image(job->imgstFile, connection, job->img_offset, job->img_size, &job->key, job->cache_headers);
+            } else {
+                //respond with index.html
+                mg_printf(connection,
+                          "HTTP/1.1 302 Found\r\n"
+                          "Location: %s/index.html\r\n\r\n", LISTENING_ADDR);
+            }
+            //with a file transfer or a ring read, the connection is closed once the whole image is sent
+            connection->is_draining = find_file_transfer(connection) == NULL && find_ring_read(connection) == NULL;
+        }
+        imgst_cache_release(&image_cache, job->entry);
+        free(job->body);
+        free(job);
+        job = next;
+    }
+}
+
+/**
+ * event handler of the connection polling wakeup_fd: completes the jobs and the ring reads once it was written
+ */
+static void wakeup_event_handler(struct mg_connection* connection, int ev, void* _unused ev_data, void* _unused data)
+{
+    //wakeup_fd is not a socket, it is read here and mongoose must not read it
+    if(ev != MG_EV_POLL || !connection->is_readable) return;
+    connection->is_readable = 0;
+
+    uint64_t count = 0;
+    if(read((int) (size_t) connection->fd, &count, sizeof(count)) == sizeof(count)) {
+        complete_jobs(connection->mgr);
+        complete_ring_reads();
+    }
+}
 
+/**
+ * add wakeup_fd to the descriptors polled by mgr (mongoose only creates connections
+ * from sockets: the one of a placeholder listener is replaced by a copy of wakeup_fd)
+ * @return error code as defined in error.h
+ */
+static int watch_wakeups(struct mg_mgr* mgr)
+{
+    struct mg_connection* connection = mg_listen(mgr, WAKEUP_ADDR, wakeup_event_handler, NULL);
+    if(connection == NULL) return ERR_IO;
+    //the connection owns the copy, closed by mongoose with it
+    return dup2(wakeup_fd, (int) (size_t) connection->fd) < 0 ? ERR_IO : ERR_NONE;
+}
+
+//-------------------------------------------------------------------------------
+/**
+ * take from the request what the client knows of the list or the image to read:
+ * the ETags of its copies (If-None-Match) and the SHA pinned by the URL (v)
+ */
+static void get_cache_validators(struct mg_http_message* hm, struct job* job)
+{
+    struct mg_str* if_none_match = mg_http_get_header(hm, "If-None-Match");
+    if(if_none_match != NULL && if_none_match->len < MAX_IF_NONE_MATCH_LEN) {
+        memcpy(job->if_none_match, if_none_match->ptr, if_none_match->len);
+    }
+    mg_http_get_var(&hm->query, "v", job->version, SHA_STRING_LENGTH);
+}
+
+/**
+ * take from the request the page of the list asked with limit, prefix and cursor (if any)
+ * @return error code as defined in error.h
+ */
+static int get_list_page(struct mg_http_message* hm, struct job* job)
+{
+    if(hm->query.len == 0) return ERR_NONE; //the whole list
+
+    char limit_char[MAX_LIMIT_LEN];
+    int const limit_len = mg_http_get_var(&hm->query, "limit", limit_char, MAX_LIMIT_LEN);
+    int const prefix_len = mg_http_get_var(&hm->query, "prefix", job->prefix, MAX_IMG_ID + 1);
+    int const cursor_len = mg_http_get_var(&hm->query, "cursor", job->cursor, MAX_IMG_ID + 1);
+    //-1 when a value is too long, < -1 when it is not given
+    if(limit_len == -1 || prefix_len == -1 || cursor_len == -1) return ERR_INVALID_ARGUMENT;
+    if(limit_len < 0 && prefix_len < 0 && cursor_len < 0) return ERR_NONE;
+
+    job->limit = limit_len > 0 ? atouint32(limit_char) : DEFAULT_LIST_PAGE;
+    if(job->limit == 0) return ERR_INVALID_ARGUMENT;
+    job->limit = job->limit > MAX_LIST_PAGE ? MAX_LIST_PAGE : job->limit;
+    return ERR_NONE;
+}
+
+/**
+ * do the the do_list request
+ * @return whether the response is pending (given to a worker)
+ */
+static bool handle_list_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection)
+{
+    struct job* job = new_job(imgstFile, connection, JOB_LIST, NULL);
+    if(job == NULL) {
+        mg_error_msg(connection, ERR_OUT_OF_MEMORY);
+        return false;
+    }
+    int err_page = get_list_page(hm, job);
+    if(err_page != ERR_NONE) {
+        free(job);
+        mg_error_msg(connection, err_page);
+        return false;
+    }
+    get_cache_validators(hm, job);
+    start_job(job);
+    return true;
 }
 
 
-static void handle_delete_call(struct imgst_file* imgstFile, struct mg_http_message* hm,  struct mg_connection* connection)
+static bool handle_delete_call(struct imgst_file* imgstFile, struct mg_http_message* hm,  struct mg_connection* connection)
 {
     char img_id[MAX_IMG_ID];
 
@@ -73,147 +955,149 @@ static void handle_delete_call(struct imgst_file* imgstFile, struct mg_http_mess
     int err_img_id_uri = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
     if(err_img_id_uri <= 0) {
         mg_error_msg(connection, ERR_INVALID_ARGUMENT);
-        return;
+        return false;
     }
 
     //delete image from database
-    int err_do_delete = do_delete(img_id, imgstFile);
-    if(err_do_delete != ERR_NONE) {
-        mg_error_msg(connection, err_do_delete);
-        return;
+    int err_dispatch = dispatch_job(imgstFile, connection, JOB_DELETE, img_id, 0);
+    if(err_dispatch != ERR_NONE) {
+        mg_error_msg(connection, err_dispatch);
+        return false;
     }
+    return true;
+}
 
-    //respond with index.html
-    mg_printf(connection,
-              "HTTP/1.1 302 Found\r\n"
-              "Location: %s/index.html\r\n", LISTENING_ADDR);
 
-}
 
+/**
+ * do the read of an image made to fit in the box given by w and h
+ * @return whether the response is pending (given to a worker)
+ */
+static bool handle_read_box_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection,
+                                 const char* img_id)
+{
+    char width_char[MAX_RES_LEN];
+    char height_char[MAX_RES_LEN];
+    if(mg_http_get_var(&hm->query, "w", width_char, MAX_RES_LEN) <= 0 ||
+       mg_http_get_var(&hm->query, "h", height_char, MAX_RES_LEN) <= 0) {
+        mg_error_msg(connection, ERR_INVALID_ARGUMENT);
+        return false;
+    }
+    uint32_t const width = atouint32(width_char);
+    uint32_t const height = atouint32(height_char);
+    if(width == 0 || height == 0 || width > MAX_BOX_RES || height > MAX_BOX_RES) {
+        mg_error_msg(connection, ERR_RESOLUTIONS);
+        return false;
+    }
 
+    //a worker makes the image (or finds it in image_cache), the event loop sends it
+    struct job* job = new_job(imgstFile, connection, JOB_READ_BOX, img_id);
+    if(job == NULL) {
+        mg_error_msg(connection, ERR_OUT_OF_MEMORY);
+        return false;
+    }
+    job->width = width;
+    job->height = height;
+    get_cache_validators(hm, job);
+    start_job(job);
+    return true;
+}
 
-static void handle_read_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection)
+static bool handle_read_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection)
 {
 
     char res_char[MAX_RES_LEN];
     char img_id[MAX_IMG_ID];
 
-    //read res variable from url
-    int err_res_uri = mg_http_get_var(&hm->query, "res", res_char, MAX_RES_LEN);
-    if(err_res_uri <= 0) {
-        mg_error_msg(connection, ERR_INVALID_ARGUMENT);
-        return;
-    }
-
     //read img_id variable from url
     int err_img_id_uri = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
     if(err_img_id_uri <= 0) {
         mg_error_msg(connection, ERR_INVALID_ARGUMENT);
-        return;
+        return false;
+    }
+
+    //any size asked with w and h instead of a resolution
+    if(mg_http_get_var(&hm->query, "res", res_char, MAX_RES_LEN) <= 0) {
+        return handle_read_box_call(imgstFile, hm, connection, img_id);
     }
 
     //get res index from the res name
     int res = resolution_atoi(res_char);
     if(res == -1) {
         mg_error_msg(connection, ERR_RESOLUTIONS);
-        return;
+        return false;
     }
 
-    char* img_buffer = NULL;
-    u_int32_t img_size = 0;
-
-    //read image with img_id and store it in img_buffer
-    int err_do_read = do_read(img_id, res, &img_buffer, &img_size, imgstFile);
-    if(err_do_read != ERR_NONE) {
-        mg_error_msg(connection, err_do_read);
-        return;
+    //a worker finds (and resizes if needed) the image, the event loop sends it
+    struct job* job = new_job(imgstFile, connection, JOB_READ, img_id);
+    if(job == NULL) {
+        mg_error_msg(connection, ERR_OUT_OF_MEMORY);
+        return false;
     }
-
-    // reply with image jpeg html
-    mg_printf(connection,
-              "HTTP/1.1 200 OK\r\n"
-              "Content-Type: image/jpeg\r\n"
-              "Content-Length: %zu\r\n\r\n",
-              img_size);
-
-    //send the actual image
-    mg_send(connection, img_buffer, img_size);
-
-    free(img_buffer);
+    job->res = res;
+    get_cache_validators(hm, job);
+    start_job(job);
+    return true;
 }
 
-static void handle_insert_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection)
+static bool handle_insert_call(struct imgst_file* imgstFile, struct mg_http_message* hm, struct mg_connection* connection)
 {
     //upload to /tmp until the body of the http_message is empty
     if(hm->body.len != 0) {
-        int err = mg_http_upload(connection, hm, "/tmp");
+        int err = mg_http_upload(connection, hm, TMP_DIRECTORY);
         if(err < 0) {
             mg_error_msg(connection, ERR_FILE_NOT_FOUND);
-            return;
         }
-    } else { //get img_id from uri
-        char img_id[MAX_IMG_ID];
-        int err_img_id_uri = mg_http_get_var(&hm->query, "name", img_id, MAX_IMG_ID);
-        if(err_img_id_uri <= 0) {
-            mg_error_msg(connection, ERR_INVALID_IMGID);
-            return;
-        }
-
-        //get the offset from the uri
-        char* offset = calloc(1, OFFSET_SIZE);
-        int err_img_size_uri =  mg_http_get_var(&hm->query, "offset", offset, OFFSET_SIZE);
-        if(err_img_size_uri <= 0) {
-            mg_http_reply(connection, ERROR_HTTP_CODE, "", "Not found\n");
-            return;
-        }
-
-        //converts the offset char* to an unsigned int
-        u_int32_t img_size = atouint32(offset);
-
-        //allocate memory for the filepath
-        char* filepath = calloc(strlen(TMP_DIRECTORY) + MAX_IMG_ID + 1, sizeof(char));
-        if(filepath == NULL) {
-            mg_error_msg(connection, ERR_OUT_OF_MEMORY);
-            return;
-        }
-
-        // build the filepath tmp/img_id
-        strcpy(filepath,  TMP_DIRECTORY);
-        strcat(filepath, "/");
-        strcat(filepath, img_id);
+        return false;
+    }
 
-        //open the image stored in tmp
-        FILE* fp = fopen(filepath,"r");
-        if(fp == NULL) {
-            mg_error_msg(connection, ERR_FILE_NOT_FOUND);
-            return;
-        }
-        char* buffer = calloc(1, img_size);
-        if(buffer == NULL) {
-            mg_error_msg(connection, ERR_OUT_OF_MEMORY);
-            return;
-        }
+    //get img_id from uri
+    char img_id[MAX_IMG_ID];
+    int err_img_id_uri = mg_http_get_var(&hm->query, "name", img_id, MAX_IMG_ID);
+    if(err_img_id_uri <= 0) {
+        mg_error_msg(connection, ERR_INVALID_IMGID);
+        return false;
+    }
 
-        // read image in allocated buffer
-        fread(buffer, img_size, 1, fp);
-        fclose(fp);
+    //get the offset from the uri
+    char offset[OFFSET_SIZE];
+    int err_img_size_uri =  mg_http_get_var(&hm->query, "offset", offset, OFFSET_SIZE);
+    if(err_img_size_uri <= 0) {
+        mg_http_reply(connection, ERROR_HTTP_CODE, "", "Not found\n");
+        return false;
+    }
 
-        //insert image in database
-        int err_do_insert = do_insert(buffer, img_size, img_id, imgstFile);
-        if(err_do_insert != ERR_NONE) {
-            mg_error_msg(connection, err_do_insert);
-            return;
-        }
+    //converts the offset char* to an unsigned int
+    u_int32_t img_size = atouint32(offset);
 
-        //reply with the index.html page
-        mg_printf(connection,
-                  "HTTP/1.1 302 Found\r\n"
-                  "Location: %s/index.html\r\n", LISTENING_ADDR);
-        free(buffer);
+    //a worker reads the uploaded image and inserts it
+    int err_dispatch = dispatch_job(imgstFile, connection, JOB_INSERT, img_id, img_size);
+    if(err_dispatch != ERR_NONE) {
+        mg_error_msg(connection, err_dispatch);
+        return false;
     }
+    return true;
 }
 
 
+/**
+ * reply with the counters of image_cache, to tune its budget
+ */
+static void handle_stats_call(struct mg_connection* connection)
+{
+    struct imgst_cache_stats stats;
+    imgst_cache_get_stats(&image_cache, &stats);
+    uint64_t const lookups = stats.hits + stats.misses;
+    mg_http_reply(connection, 200, "Content-Type: application/json\r\n",
+                  "{\"hits\": %llu, \"misses\": %llu, \"hit_ratio\": %.4f, "
+                  "\"admitted\": %llu, \"rejected\": %llu, \"evicted\": %llu, "
+                  "\"used\": %zu, \"budget\": %zu}\n",
+                  (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                  lookups == 0 ? 0.0 : (double) stats.hits / (double) lookups,
+                  (unsigned long long) stats.admitted, (unsigned long long) stats.rejected,
+                  (unsigned long long) stats.evicted, stats.used, stats.budget);
+}
+
 /**
  * handle the different URI
  * @param connection
@@ -227,28 +1111,85 @@ static void imgst_event_handler(struct mg_connection* connection, int ev, void *
         struct mg_http_message* hm = (struct mg_http_message *) ev_data;
         struct imgst_file* imgstFile = (struct imgst_file *) data;
 
-        //switch between the handlers for the different url
+        //a request pipelined behind one of the imgStore is dropped, mongoose parses it anyway:
+        //its response would be sent in the middle of the pending one (a job, a ring read or a file transfer)
+        if(!strcmp(connection->label, ANSWERING_LABEL)) return;
+        if(mg_http_match_uri(hm, "/imgStore/*")) {
+            snprintf(connection->label, sizeof(connection->label), "%s", ANSWERING_LABEL);
+        }
+
+        //switch between the handlers for the different url,
+        //a request given to a worker closes its connection once its response is sent
         if (mg_http_match_uri(hm, "/imgStore/list")) {
-            handle_list_call(data, connection);
-            connection->is_draining = 1;
+            connection->is_draining = !handle_list_call(imgstFile, hm, connection);
         } else if(mg_http_match_uri(hm, "/imgStore/read")) {
-            handle_read_call(data, hm, connection);
-            connection->is_draining = 1;
+            connection->is_draining = !handle_read_call(imgstFile, hm, connection);
         } else if(mg_http_match_uri(hm, "/imgStore/delete")) {
-            handle_delete_call(data, hm, connection);
-            connection->is_draining = 1;
+            connection->is_draining = !handle_delete_call(imgstFile, hm, connection);
         } else if(mg_http_match_uri(hm, "/imgStore/insert")) {
-            handle_insert_call(data, hm, connection);
+            connection->is_draining = !handle_insert_call(imgstFile, hm, connection);
+        } else if(mg_http_match_uri(hm, "/imgStore/stats")) {
+            handle_stats_call(connection);
             connection->is_draining = 1;
         } else {
             //replies with static content
             struct mg_http_serve_opts opts = {.root_dir = WEB_DIRECTORY};
             mg_http_serve_dir(connection, ev_data, &opts);
         }
+    } else if(ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+        continue_file_transfer(connection);
+    } else if(ev == MG_EV_CLOSE) {
+        remove_file_transfer(connection);
+        detach_ring_read(connection);
     }
 }
 
 
+//-------------------------------------------------------------------------------
+/**
+ * set up what serves the requests: the cache of the images, the listener of mgr,
+ * the polling of wakeup_fd and the workers, each failure is reported here
+ * @param workers output, of MAX_WORKERS threads
+ * @param nb_started output, number of workers started (to join, even on failure)
+ * @return error code as defined in error.h
+ */
+static int start_server(struct mg_mgr* mgr, struct imgst_file* imgstFile, pthread_t* workers, size_t* nb_started)
+{
+    /* Cache of the images, emptied of the deleted ones */
+    if(imgst_cache_init(&image_cache, IMAGE_CACHE_SIZE, IMAGE_CACHE_SHARDS) != ERR_NONE) {
+        fprintf(stderr, "Error: %s\n", ERR_MESSAGES[ERR_OUT_OF_MEMORY]);
+        return ERR_OUT_OF_MEMORY;
+    }
+    imgstFile->on_delete = evict_deleted_image;
+
+    if(mg_http_listen(mgr, LISTENING_ADDR, imgst_event_handler, imgstFile) == NULL) {
+        fprintf(stderr, "Error starting server on address %s\n", LISTENING_ADDR);
+        return ERR_IO;
+    }
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeup_fd < 0 || watch_wakeups(mgr) != ERR_NONE) {
+        fprintf(stderr, "Error polling the completions of the workers\n");
+        return ERR_IO;
+    }
+    if(imgst_ring_notify(&ring, wakeup_fd) != ERR_NONE) {
+        fprintf(stderr, "io_uring completions cannot be polled, images are read synchronously\n");
+        imgst_ring_close(&ring);
+    }
+
+    /* Workers, one per core */
+    long const nb_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_workers = nb_cores < MIN_WORKERS ? MIN_WORKERS : (size_t) nb_cores;
+    nb_workers = nb_workers > MAX_WORKERS ? MAX_WORKERS : nb_workers;
+    while(*nb_started < nb_workers && pthread_create(&workers[*nb_started], NULL, worker_main, NULL) == 0) {
+        ++*nb_started;
+    }
+    if(*nb_started == 0) {
+        fprintf(stderr, "Error starting the worker threads\n");
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
 //-------------------------------------------------------------------------------
 int main(int argc, char* argv[])
 {
@@ -261,6 +1202,22 @@ int main(int argc, char* argv[])
         return ERR_IMGLIB;
     }
 
+    bool eager_variants = false;
+    for(int i = EXPECTED_NB_ARGS_MAIN; i < argc; ++i) {
+        if(!strcmp(argv[i], "wait")) {
+            resize_policy = RESIZE_WAIT;
+        } else if(!strcmp(argv[i], "closest")) {
+            resize_policy = RESIZE_CLOSEST;
+        } else if(!strcmp(argv[i], "later")) {
+            resize_policy = RESIZE_LATER;
+        } else if(!strcmp(argv[i], "eager")) {
+            eager_variants = true;
+        } else {
+            fprintf(stderr, "%s: options are wait, closest, later (resize policy) and eager\n", ERR_MESSAGES[ERR_INVALID_ARGUMENT]);
+            return EXIT_FAILURE;
+        }
+    }
+
     /* Open the imgStore */
     const char* imgst_filename = argv[1];
     struct imgst_file imgstFile = {0};
@@ -269,28 +1226,70 @@ int main(int argc, char* argv[])
         fprintf(stderr, "Error: %s\n", ERR_MESSAGES[ret]);
         return EXIT_FAILURE;
     }
+    //the variants of the uploaded images are made by the insert, even if the imgStore was not created so
+    imgstFile.eager_variants = imgstFile.eager_variants || eager_variants;
 
-    /* Create server */
-    struct mg_mgr mgr; //event manager
-    mg_mgr_init(&mgr);
-    if(mg_http_listen(&mgr, LISTENING_ADDR, imgst_event_handler, &imgstFile) == NULL) {
-        fprintf(stderr, "Error starting server on address %s\n", LISTENING_ADDR);
-        return EXIT_SUCCESS;
+    /* Background resizes (the reads resize synchronously if they cannot be started) */
+    if(resize_policy != RESIZE_WAIT && imgst_resizer_start(&imgstFile, RESIZE_THREADS) != ERR_NONE) {
+        fprintf(stderr, "background resizes not available, images are resized when read\n");
+    }
+
+    /* Ring for the reads of the images (synchronous reads if io_uring is not available) */
+    imgst_ring_init(&ring, RING_ENTRIES);
+    if(ring.fd < 0) {
+        fprintf(stderr, "io_uring not available, images are read synchronously\n");
     }
 
-    printf("Starting imgStore server on %s\n", LISTENING_ADDR);
-    print_header(&imgstFile.header);
+    /* Create server, stopped by the same cleanup whether it served or failed to start */
+    struct mg_mgr mgr; //event manager
+    mg_mgr_init(&mgr);
+    pthread_t workers[MAX_WORKERS];
+    size_t nb_started = 0;
+    int exit_code = EXIT_SUCCESS;
+    if(start_server(&mgr, &imgstFile, workers, &nb_started) != ERR_NONE) {
+        exit_code = EXIT_FAILURE;
+    } else {
+        printf("Starting imgStore server on %s\n", LISTENING_ADDR);
+        print_header(&imgstFile.header);
 
-    /* infinite event loop */
-    signal(SIGINT, terminal_signals_handler); //accept interrupts signals as CTRL+C
-    signal(SIGTERM, terminal_signals_handler); // accept termination requests
-    //while don't receive an SIGINT or a SIGTERM from the terminal, loop (other signals are ignored)
-    while (terminal_signal == 0) mg_mgr_poll(&mgr, POLLING_TIME_MS);
+        /* infinite event loop */
+        signal(SIGINT, terminal_signals_handler); //accept interrupts signals as CTRL+C
+        signal(SIGTERM, terminal_signals_handler); // accept termination requests
+        //while don't receive an SIGINT or a SIGTERM from the terminal, loop (other signals are ignored)
+        while (terminal_signal == 0) {
+            //the jobs and the ring reads are completed by the poll, as soon as wakeup_fd is written
+            mg_mgr_poll(&mgr, file_transfers != NULL ? TRANSFER_POLLING_TIME_MS : POLLING_TIME_MS);
+            //submits the reads started by the poll, and sends the ones done synchronously
+            complete_ring_reads();
+        }
+    }
 
     /* Cleanup */
+    job_queue_close(&todo_jobs);
+    for(size_t i = 0; i < nb_started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    struct job* job = job_queue_take_all(&done_jobs);
+    while(job != NULL) {
+        struct job* next = job->next;
+        imgst_cache_release(&image_cache, job->entry);
+        free(job->body);
+        free(job);
+        job = next;
+    }
+    //the imgStore file is closed once nothing reads it anymore
+    free_ring_reads();
+    while(file_transfers != NULL) {
+        remove_file_transfer(file_transfers->connection);
+    }
     do_close(&imgstFile);
+    imgst_cache_close(&image_cache);
     mg_mgr_free(&mgr);
+    if(wakeup_fd >= 0) {
+        close(wakeup_fd);
+    }
+    imgst_ring_close(&ring);
     vips_shutdown();
 
-    return EXIT_SUCCESS;
+    return exit_code;
 }
\ No newline at end of file
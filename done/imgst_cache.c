@@ -0,0 +1,396 @@
+/**
+ * @file imgst_cache.c
+ * @brief in-memory cache of the images answered by the server
+ */
+
+#include "imgst_cache.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h> // for memset
+
+#define MIN_BUCKETS 64
+#define EXPECTED_IMAGE_SIZE (16 * 1024) // to size the tables from the budget
+#define WINDOW_PERCENT 1 // part of the budget of a shard for its window
+#define NB_SKETCH_ROWS 4
+#define MIN_SKETCH_WIDTH 1024
+#define SMALLEST_IMAGE_SIZE 1024 // to size the sketch: a counter per row for each image the shard can hold
+#define MAX_FREQUENCY 15
+#define SAMPLE_FACTOR 10 // the counters are halved every SAMPLE_FACTOR * sketch_width lookups, to forget old popularity
+
+/**
+ * @return the shard having the entries of the slot index
+ */
+static struct imgst_cache_shard* shard_of(const struct imgst_cache* cache, uint32_t index)
+{
+    return &cache->shards[index % cache->nb_shards];
+}
+
+/**
+ * @return the hash of key
+ */
+static uint64_t hash_key(const struct imgst_cache_key* key)
+{
+    //FNV-1a on the fields
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t const fields[] = {key->index, key->generation, (uint64_t) key->res, key->width, key->height};
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        hash = (hash ^ fields[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @return the bucket of key in its shard
+ */
+static size_t bucket_of(const struct imgst_cache_shard* shard, const struct imgst_cache_key* key)
+{
+    return (size_t) (hash_key(key) % shard->nb_buckets);
+}
+
+/**
+ * @return the counter of key in the row of the sketch
+ */
+static uint8_t* sketch_counter(const struct imgst_cache_shard* shard, uint64_t hash, size_t row)
+{
+    //double hashing: a different position in each row
+    uint64_t const position = (hash & 0xFFFFFFFFu) + row * ((hash >> 32) | 1);
+    return &shard->sketch[row * shard->sketch_width + (position & (shard->sketch_width - 1))];
+}
+
+/**
+ * @return the estimated number of recent lookups of key (under shard->lock)
+ */
+static uint8_t frequency(const struct imgst_cache_shard* shard, const struct imgst_cache_key* key)
+{
+    uint64_t const hash = hash_key(key);
+    uint8_t min = MAX_FREQUENCY;
+    for(size_t row = 0; row < NB_SKETCH_ROWS; ++row) {
+        uint8_t const count = *sketch_counter(shard, hash, row);
+        min = count < min ? count : min;
+    }
+    return min;
+}
+
+/**
+ * counts a lookup of key (under shard->lock)
+ */
+static void record_lookup(struct imgst_cache_shard* shard, const struct imgst_cache_key* key)
+{
+    uint64_t const hash = hash_key(key);
+    for(size_t row = 0; row < NB_SKETCH_ROWS; ++row) {
+        uint8_t* count = sketch_counter(shard, hash, row);
+        if(*count < MAX_FREQUENCY) ++*count;
+    }
+    if(++shard->nb_increments >= SAMPLE_FACTOR * shard->sketch_width) {
+        for(size_t i = 0; i < NB_SKETCH_ROWS * shard->sketch_width; ++i) {
+            shard->sketch[i] /= 2;
+        }
+        shard->nb_increments /= 2;
+    }
+}
+
+/**
+ * @return whether the two keys are equal
+ */
+static bool same_key(const struct imgst_cache_key* a, const struct imgst_cache_key* b)
+{
+    return a->index == b->index && a->generation == b->generation && a->res == b->res
+           && a->width == b->width && a->height == b->height;
+}
+
+/**
+ * @return the entry of key, NULL if none (under shard->lock)
+ */
+static struct imgst_cache_entry* find_entry(const struct imgst_cache_shard* shard, const struct imgst_cache_key* key)
+{
+    struct imgst_cache_entry* entry = shard->buckets[bucket_of(shard, key)];
+    while(entry != NULL && !same_key(&entry->key, key)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/**
+ * @return the list of the entry
+ */
+static struct imgst_cache_lru* lru_of(struct imgst_cache_shard* shard, const struct imgst_cache_entry* entry)
+{
+    return entry->in_window ? &shard->window : &shard->main;
+}
+
+/**
+ * takes the entry out of its list (under shard->lock)
+ */
+static void unlink_lru(struct imgst_cache_lru* lru, struct imgst_cache_entry* entry)
+{
+    if(entry->newer != NULL) entry->newer->older = entry->older;
+    else lru->newest = entry->older;
+    if(entry->older != NULL) entry->older->newer = entry->newer;
+    else lru->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+    lru->used -= entry->size;
+}
+
+/**
+ * puts the entry at the head of the list (under shard->lock)
+ */
+static void push_newest(struct imgst_cache_lru* lru, struct imgst_cache_entry* entry)
+{
+    entry->older = lru->newest;
+    entry->newer = NULL;
+    if(lru->newest != NULL) lru->newest->newer = entry;
+    lru->newest = entry;
+    if(lru->oldest == NULL) lru->oldest = entry;
+    lru->used += entry->size;
+}
+
+/**
+ * frees an entry and its image
+ */
+static void free_entry(struct imgst_cache_entry* entry)
+{
+    free(entry->image);
+    free(entry);
+}
+
+/**
+ * removes the entry from the shard, it is freed now or by its last release (under shard->lock)
+ */
+static void evict(struct imgst_cache_shard* shard, struct imgst_cache_entry* entry)
+{
+    unlink_lru(lru_of(shard, entry), entry);
+    struct imgst_cache_entry** link = &shard->buckets[bucket_of(shard, &entry->key)];
+    while(*link != entry) link = &(*link)->next;
+    *link = entry->next;
+
+    entry->cached = false;
+    if(entry->nb_refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * moves the entries pushed out of the window to the main part, if they are more
+ * frequent than the ones they would evict there, else evicts them (under shard->lock)
+ */
+static void admit_from_window(struct imgst_cache_shard* shard)
+{
+    while(shard->window.used > shard->window.budget) {
+        struct imgst_cache_entry* candidate = shard->window.oldest;
+        if(candidate->size > shard->main.budget) {
+            evict(shard, candidate);
+            ++shard->stats.rejected;
+            continue;
+        }
+
+        //the candidate must beat every victim it needs the room of
+        uint8_t const candidate_frequency = frequency(shard, &candidate->key);
+        size_t room = shard->main.budget - shard->main.used;
+        bool admitted = true;
+        for(struct imgst_cache_entry* victim = shard->main.oldest; admitted && room < candidate->size; victim = victim->newer) {
+            admitted = candidate_frequency > frequency(shard, &victim->key);
+            room += victim->size;
+        }
+        if(!admitted) {
+            evict(shard, candidate);
+            ++shard->stats.rejected;
+            continue;
+        }
+        while(shard->main.budget - shard->main.used < candidate->size) {
+            evict(shard, shard->main.oldest);
+            ++shard->stats.evicted;
+        }
+        unlink_lru(&shard->window, candidate);
+        candidate->in_window = false;
+        push_newest(&shard->main, candidate);
+        ++shard->stats.admitted;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int imgst_cache_init(struct imgst_cache* cache, size_t budget, size_t nb_shards)
+{
+    if(cache == NULL || nb_shards == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    cache->shards = calloc(nb_shards, sizeof(struct imgst_cache_shard));
+    if(cache->shards == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    cache->nb_shards = nb_shards;
+
+    size_t const shard_budget = budget / nb_shards;
+    size_t const nb_buckets = shard_budget / EXPECTED_IMAGE_SIZE < MIN_BUCKETS ? MIN_BUCKETS : shard_budget / EXPECTED_IMAGE_SIZE;
+    size_t sketch_width = MIN_SKETCH_WIDTH;
+    while(sketch_width < shard_budget / SMALLEST_IMAGE_SIZE) sketch_width *= 2;
+    for(size_t i = 0; i < nb_shards; ++i) {
+        struct imgst_cache_shard* shard = &cache->shards[i];
+        shard->window.budget = shard_budget * WINDOW_PERCENT / 100;
+        shard->main.budget = shard_budget - shard->window.budget;
+        shard->stats.budget = shard_budget;
+        shard->nb_buckets = nb_buckets;
+        shard->buckets = calloc(nb_buckets, sizeof(struct imgst_cache_entry*));
+        shard->sketch_width = sketch_width;
+        shard->sketch = calloc(NB_SKETCH_ROWS * sketch_width, sizeof(uint8_t));
+        pthread_mutex_init(&shard->lock, NULL);
+        if(shard->buckets == NULL || shard->sketch == NULL) {
+            cache->nb_shards = i + 1;
+            imgst_cache_close(cache);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    return ERR_NONE;
+}
+
+/** @copybrief */
+void imgst_cache_close(struct imgst_cache* cache)
+{
+    if(cache == NULL || cache->shards == NULL) {
+        return;
+    }
+    for(size_t i = 0; i < cache->nb_shards; ++i) {
+        struct imgst_cache_shard* shard = &cache->shards[i];
+        while(shard->window.oldest != NULL) {
+            evict(shard, shard->window.oldest);
+        }
+        while(shard->main.oldest != NULL) {
+            evict(shard, shard->main.oldest);
+        }
+        free(shard->buckets);
+        free(shard->sketch);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    cache->shards = NULL;
+    cache->nb_shards = 0;
+}
+
+/** @copybrief */
+const struct imgst_cache_entry* imgst_cache_get(struct imgst_cache* cache, const struct imgst_cache_key* key)
+{
+    if(cache == NULL || key == NULL) {
+        return NULL;
+    }
+    struct imgst_cache_shard* shard = shard_of(cache, key->index);
+    pthread_mutex_lock(&shard->lock);
+    //misses are counted too: an image asked often deserves its place once it is read
+    record_lookup(shard, key);
+    struct imgst_cache_entry* entry = find_entry(shard, key);
+    if(entry != NULL) {
+        struct imgst_cache_lru* lru = lru_of(shard, entry);
+        unlink_lru(lru, entry);
+        push_newest(lru, entry);
+        ++entry->nb_refs;
+        ++shard->stats.hits;
+    } else {
+        ++shard->stats.misses;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+/** @copybrief */
+int imgst_cache_put(struct imgst_cache* cache, const struct imgst_cache_key* key, char* image, uint32_t size,
+                    const struct imgst_cache_entry** entry)
+{
+    if(cache == NULL || key == NULL || entry == NULL || (image == NULL && size != 0)) {
+        free(image);
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_cache_entry* added = calloc(1, sizeof(struct imgst_cache_entry));
+    if(added == NULL) {
+        free(image);
+        return ERR_OUT_OF_MEMORY;
+    }
+    added->key = *key;
+    added->image = image;
+    added->size = size;
+    added->nb_refs = 1;
+
+    struct imgst_cache_shard* shard = shard_of(cache, key->index);
+    pthread_mutex_lock(&shard->lock);
+    struct imgst_cache_entry* existing = find_entry(shard, key);
+    if(existing != NULL) {
+        //made or read meanwhile by another request
+        ++existing->nb_refs;
+        pthread_mutex_unlock(&shard->lock);
+        free_entry(added);
+        *entry = existing;
+        return ERR_NONE;
+    }
+
+    //every new image enters the window, the admission decides once it is pushed out
+    size_t const bucket = bucket_of(shard, key);
+    added->next = shard->buckets[bucket];
+    shard->buckets[bucket] = added;
+    added->cached = true;
+    added->in_window = true;
+    push_newest(&shard->window, added);
+    admit_from_window(shard);
+
+    pthread_mutex_unlock(&shard->lock);
+    *entry = added;
+    return ERR_NONE;
+}
+
+/** @copybrief */
+void imgst_cache_release(struct imgst_cache* cache, const struct imgst_cache_entry* entry)
+{
+    if(cache == NULL || entry == NULL) {
+        return;
+    }
+    struct imgst_cache_shard* shard = shard_of(cache, entry->key.index);
+    pthread_mutex_lock(&shard->lock);
+    //the cache owns its entries, the const only keeps their users from changing them
+    struct imgst_cache_entry* owned = (struct imgst_cache_entry*) entry;
+    bool const last = --owned->nb_refs == 0 && !owned->cached;
+    pthread_mutex_unlock(&shard->lock);
+    if(last) {
+        free_entry(owned);
+    }
+}
+
+/** @copybrief */
+void imgst_cache_invalidate(struct imgst_cache* cache, uint32_t index)
+{
+    if(cache == NULL || cache->shards == NULL) {
+        return;
+    }
+    struct imgst_cache_shard* shard = shard_of(cache, index);
+    pthread_mutex_lock(&shard->lock);
+    struct imgst_cache_lru* const lrus[] = {&shard->window, &shard->main};
+    for(size_t i = 0; i < sizeof(lrus) / sizeof(lrus[0]); ++i) {
+        struct imgst_cache_entry* entry = lrus[i]->oldest;
+        while(entry != NULL) {
+            struct imgst_cache_entry* newer = entry->newer;
+            if(entry->key.index == index) {
+                evict(shard, entry);
+            }
+            entry = newer;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/** @copybrief */
+void imgst_cache_get_stats(struct imgst_cache* cache, struct imgst_cache_stats* stats)
+{
+    if(cache == NULL || stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(struct imgst_cache_stats));
+    for(size_t i = 0; i < cache->nb_shards; ++i) {
+        struct imgst_cache_shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->admitted += shard->stats.admitted;
+        stats->rejected += shard->stats.rejected;
+        stats->evicted += shard->stats.evicted;
+        stats->used += shard->window.used + shard->main.used;
+        stats->budget += shard->stats.budget;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * @file imgst_cache.h
+ * @brief in-memory cache of the images answered by the server.
+ *
+ * It keeps the small images read from the imgStore file (the thumbnails
+ * and small resolutions of a gallery) and the ones made for the sizes
+ * asked by the clients, which are never stored in the file, within a
+ * budget of bytes: the least recently used ones are evicted first.
+ *
+ * An image is identified by the slot and the generation of its image
+ * (see struct image_version), so an image deleted, or replaced in the
+ * same slot, can never be answered from the cache; imgst_cache_invalidate
+ * frees its entries as soon as it is deleted.
+ *
+ * Each shard admits its images W-TinyLFU style: a new image enters a small
+ * window (1% of the budget) evicting the least recently used ones; the one
+ * pushed out of the window only enters the main part if it was asked more
+ * often (according to a count-min sketch of the recent lookups) than the
+ * least recently used image it would evict there. So a scan of images asked
+ * once (a crawler, an export) stays in the window and does not flush the
+ * popular ones.
+ *
+ * The cache is split in shards (by slot) having a lock and a budget of
+ * their own, so that concurrent readers seldom wait for each other. The
+ * entries are refcounted: one given by imgst_cache_get or imgst_cache_put
+ * stays valid, even if evicted meanwhile, until imgst_cache_release.
+ */
+
+#define CACHE_RES_BOX (-1) // res of the images made for a size asked by the client
+
+/**
+ * @brief what an image of the cache is
+ */
+struct imgst_cache_key {
+    uint32_t index; // slot of the image
+    uint32_t generation; // of the image in its slot
+    int res; // resolution, CACHE_RES_BOX for a size asked by the client
+    uint32_t width; // box it was made to fit in (CACHE_RES_BOX only, else 0)
+    uint32_t height;
+};
+
+/**
+ * @brief an image of the cache, in the LRU list and in a bucket of its shard
+ */
+struct imgst_cache_entry {
+    struct imgst_cache_key key;
+    char* image;
+    uint32_t size;
+    uint32_t nb_refs; // given by get/put and not released yet
+    bool cached; // false once evicted, the last release frees it
+    bool in_window; // else in the main part
+    struct imgst_cache_entry* newer; // LRU list
+    struct imgst_cache_entry* older;
+    struct imgst_cache_entry* next; // bucket
+};
+
+/**
+ * @brief entries from the most to the least recently used
+ */
+struct imgst_cache_lru {
+    size_t budget;
+    size_t used; // bytes of the images in the list
+    struct imgst_cache_entry* newest;
+    struct imgst_cache_entry* oldest;
+};
+
+/**
+ * @brief hit ratio and admissions of the cache, to tune its budget
+ */
+struct imgst_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted; // pushed out of the window into the main part
+    uint64_t rejected; // pushed out of the window and evicted, less frequent than the images of the main part
+    uint64_t evicted; // evicted from the main part by a more frequent image
+    size_t used; // bytes of the images in the cache
+    size_t budget;
+};
+
+/**
+ * @brief part of the cache, having the entries of some of the slots
+ */
+struct imgst_cache_shard {
+    pthread_mutex_t lock;
+    struct imgst_cache_entry** buckets;
+    size_t nb_buckets;
+    struct imgst_cache_lru window; // where the new entries enter
+    struct imgst_cache_lru main; // entries admitted by their frequency
+
+    //count-min sketch of the frequencies of the keys looked up (NB_SKETCH_ROWS rows of sketch_width counters)
+    uint8_t* sketch;
+    size_t sketch_width; // a power of two
+    size_t nb_increments; // since the counters were last halved
+
+    struct imgst_cache_stats stats;
+};
+
+/**
+ * @brief images kept within a budget of bytes
+ */
+struct imgst_cache {
+    struct imgst_cache_shard* shards;
+    size_t nb_shards;
+};
+
+/**
+ * @brief sets up an empty cache
+ *
+ * @param cache to initialise
+ * @param budget maximum number of bytes of images kept (split among the shards)
+ * @param nb_shards number of shards
+ * @return Some error code. 0 if no error.
+ */
+int imgst_cache_init(struct imgst_cache* cache, size_t budget, size_t nb_shards);
+
+/**
+ * @brief frees the cache and all its images, no entry may be referenced anymore
+ *
+ * @param cache
+ */
+void imgst_cache_close(struct imgst_cache* cache);
+
+/**
+ * @brief looks an image up, and makes it the most recently used on a hit
+ *
+ * @param cache
+ * @param key
+ * @return the entry (to release), NULL on a miss
+ */
+const struct imgst_cache_entry* imgst_cache_get(struct imgst_cache* cache, const struct imgst_cache_key* key);
+
+/**
+ * @brief adds an image, evicting the least recently used ones to stay within the budget
+ *
+ * If the key is already in the cache, its entry is given and the image is freed.
+ * An image larger than the budget of its shard is not kept, but still given.
+ *
+ * @param cache
+ * @param key
+ * @param image allocated with malloc, owned by the cache from now on (even on failure)
+ * @param size size of the image
+ * @param entry output, the entry of the image (to release)
+ * @return Some error code. 0 if no error.
+ */
+int imgst_cache_put(struct imgst_cache* cache, const struct imgst_cache_key* key, char* image, uint32_t size,
+                    const struct imgst_cache_entry** entry);
+
+/**
+ * @brief gives back an entry of imgst_cache_get or imgst_cache_put
+ *
+ * @param cache
+ * @param entry (no-op if NULL)
+ */
+void imgst_cache_release(struct imgst_cache* cache, const struct imgst_cache_entry* entry);
+
+/**
+ * @brief evicts all the images of a slot, whose image was deleted
+ *
+ * @param cache
+ * @param index slot
+ */
+void imgst_cache_invalidate(struct imgst_cache* cache, uint32_t index);
+
+/**
+ * @brief sums the counters of the shards
+ *
+ * @param cache
+ * @param stats output
+ */
+void imgst_cache_get_stats(struct imgst_cache* cache, struct imgst_cache_stats* stats);
@@ -4,6 +4,10 @@
  */
 
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_resize.h"
+#include "imgst_wal.h"
 
 #include <string.h> // for strncpy
 #include <stdio.h>
@@ -27,33 +31,76 @@ int do_create(const char *imgst_filename, struct imgst_file* DBFILE)
     if(DBFILE->file == NULL) {
         return ERR_IO;
     }
+    DBFILE->fd = fileno(DBFILE->file);
+    DBFILE->end_offset = 0;
+    DBFILE->mapping = NULL;
+    //a new imgStore is written directly, a log left by an older one must not be replayed on it
+    DBFILE->wal = NULL;
+    DBFILE->resizer = NULL;
+    DBFILE->on_delete = NULL;
+    DBFILE->on_delete_arg = NULL;
+    imgst_wal_remove(imgst_filename);
 
     // Sets header fields
     strncpy(DBFILE->header.imgst_name, CAT_TXT, MAX_IMGST_NAME);
     DBFILE->header.imgst_name[MAX_IMGST_NAME] = '\0';
     DBFILE->header.imgst_version = 0;
     DBFILE->header.num_files = 0;
-
-    //writes header to DBFILE stream
-    size_t const exp_nb_elem_w = NB_HEADER_PER_FILE + DBFILE->header.max_files;
-    size_t nb_elem_written = fwrite(&(DBFILE->header), sizeof(struct imgst_header), NB_HEADER_PER_FILE, DBFILE->file);
+    DBFILE->eager_variants = (DBFILE->header.flags & IMGST_EAGER_VARIANTS) != 0;
 
     DBFILE->metadata = calloc(DBFILE->header.max_files, sizeof (struct img_metadata));
     if(DBFILE->metadata == NULL) {
         fprintf(stderr, "ERROR: can't calloc");
+        fclose(DBFILE->file);
+        DBFILE->file = NULL;
         return ERR_OUT_OF_MEMORY;
     }
-    //write metadata to DBFILE stream
-    nb_elem_written += fwrite(DBFILE->metadata, sizeof(struct img_metadata), DBFILE->header.max_files, DBFILE->file);
+    //the imgStore is empty, but its indexes must exist for the next insertions
+    int err_index = imgst_index_build(DBFILE);
+    if(err_index != ERR_NONE) {
+        fclose(DBFILE->file);
+        DBFILE->file = NULL;
+        free(DBFILE->metadata);
+        DBFILE->metadata = NULL;
+        return err_index;
+    }
+
+    //writes header then metadata to DBFILE
+    size_t const exp_nb_elem_w = NB_HEADER_PER_FILE + DBFILE->header.max_files;
+    size_t nb_elem_written = 0;
+    if(write_header(DBFILE) == ERR_NONE) {
+        nb_elem_written += NB_HEADER_PER_FILE;
+        if(imgst_pwrite(DBFILE, DBFILE->metadata, DBFILE->header.max_files * sizeof(struct img_metadata),
+                        sizeof(struct imgst_header)) == ERR_NONE) {
+            nb_elem_written += DBFILE->header.max_files;
+        }
+    }
 
     //throw error if not enough element were written
     if (nb_elem_written != exp_nb_elem_w) {
         fprintf(stderr, "Unable to completely write the database on the disk,\n"
                 "only %zu elements wrote among %zu\n", nb_elem_written, exp_nb_elem_w);
+        imgst_index_free(DBFILE);
         fclose(DBFILE->file);
+        DBFILE->file = NULL;
+        free(DBFILE->metadata);
+        DBFILE->metadata = NULL;
         return ERR_IO;
     }
 
+    int err_resizer = imgst_resizer_open(DBFILE);
+    if(err_resizer != ERR_NONE) {
+        imgst_index_free(DBFILE);
+        fclose(DBFILE->file);
+        DBFILE->file = NULL;
+        free(DBFILE->metadata);
+        DBFILE->metadata = NULL;
+        return err_resizer;
+    }
+    pthread_rwlock_init(&DBFILE->lock, NULL);
+    pthread_mutex_init(&DBFILE->mapping_lock, NULL);
+    pthread_mutex_init(&DBFILE->list_cache.lock, NULL);
+    DBFILE->list_cache.json = NULL;
     printf("%zu item(s) written\n", nb_elem_written);
     return ERR_NONE;
 }
@@ -1,21 +1,15 @@
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_wal.h"
 
 /**
- * delete a given image in the database
- * @param img_id
- * @param imgstFile
+ * invalidates the metadata of the image, its metadata and header writes
+ * are made in the transaction opened by do_delete
+ * @param index output, slot of the deleted image
  * @return err_code as def in error.h
  */
-int do_delete(const char * img_id, struct imgst_file* imgstFile)
+static int delete_image(const char * img_id, struct imgst_file* imgstFile, uint32_t* index)
 {
-    if(img_id == NULL || imgstFile == NULL) {
-        fprintf(stderr, "at leat one of do_create arguments is NULL");
-        return ERR_INVALID_ARGUMENT;
-    }
-
-    if(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) {
-        return ERR_INVALID_IMGID;
-    }
     if(imgstFile->metadata == NULL) {
         fprintf(stderr, "ERROR: metadata pointer");
         return ERR_INVALID_ARGUMENT;
@@ -24,45 +18,72 @@ int do_delete(const char * img_id, struct imgst_file* imgstFile)
         return ERR_FILE_NOT_FOUND;
     }
 
-    for (int i = 0; i < imgstFile->header.max_files; i++) {
-        //the metadata must have the same ids, they must be of the same length and have their valid bit set to 1
-        if (strncmp(img_id, imgstFile->metadata[i].img_id, strlen(img_id)) == 0 &&
-            imgstFile->metadata[i].is_valid == NON_EMPTY) {
-            //reset the file pointer to the start of the file
-            rewind(imgstFile->file);
+    //the metadata must have the same id and have its valid bit set to 1
+    uint32_t i = 0;
+    int err_find = imgst_index_find_id(imgstFile, img_id, &i);
+    if (err_find != ERR_NONE) {
+        // return file not found if there was no match in the ids
+        return err_find;
+    }
+    *index = i;
+
+    //modify the header and the metadata to be not valid, given back by do_delete if they can't be written
+    imgstFile->header.num_files--;
+    imgstFile->header.imgst_version++;
+    imgst_index_remove(imgstFile, i);
+    imgstFile->metadata[i].is_valid = EMPTY;
 
-            //modify the header
-            imgstFile->header.num_files--;
-            imgstFile->header.imgst_version++;
+    //write the header to the file
+    if (write_header(imgstFile) != ERR_NONE) {
+        fprintf(stderr, "Error while deleting image, when write back the updated header");
+        return ERR_IO;
+    }
 
-            //write the header to the stream
-            if (fwrite(&imgstFile->header, sizeof(struct imgst_header), NB_HEADER_PER_FILE, imgstFile->file) !=
-                NB_HEADER_PER_FILE) {
-                fprintf(stderr, "Error while deleting image, when write back the updated header");
-                return ERR_IO;
-            }
+    //write metadata to the file
+    if (write_metadata(imgstFile, i) != ERR_NONE) {
+        fprintf(stderr, "Error while deleting image, when write back metadata of deleted file");
+        return ERR_IO;
+    }
 
-            //change the file pointer of the stream to where the image metadata starts
-            if (fseek(imgstFile->file, i * sizeof(struct img_metadata) + sizeof(struct imgst_header), SEEK_SET) !=
-                ERR_NONE) {
-                fprintf(stderr, "Error during fseek to correct metadata location");
-                return ERR_IO;
-            }
+    return ERR_NONE;
+}
 
-            //modify the metadata to be not valid
-            imgstFile->metadata[i].is_valid = EMPTY;
+/**
+ * delete a given image in the database
+ * @param img_id
+ * @param imgstFile
+ * @return err_code as def in error.h
+ */
+int do_delete(const char * img_id, struct imgst_file* imgstFile)
+{
+    if(img_id == NULL || imgstFile == NULL) {
+        fprintf(stderr, "at leat one of do_create arguments is NULL");
+        return ERR_INVALID_ARGUMENT;
+    }
 
-            //write metadata to the stream
-            size_t const nb_metadata_to_write = 1;
-            if (fwrite(&(imgstFile->metadata[i]), sizeof(struct img_metadata), nb_metadata_to_write,
-                       imgstFile->file) != nb_metadata_to_write) {
-                fprintf(stderr, "Error while deleting image, when write back metadata of deleted file");
-                return ERR_IO;
-            }
+    if(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
 
-            return ERR_NONE;
-        }
+    //the header and the metadata are logged together, the deletion is durable once it returns
+    pthread_rwlock_wrlock(&imgstFile->lock);
+    uint64_t lsn = 0;
+    uint32_t index = INDEX_NIL;
+    uint32_t const num_files = imgstFile->header.num_files;
+    uint32_t const version = imgstFile->header.imgst_version;
+    imgst_wal_begin(imgstFile);
+    int ret = imgst_wal_end(imgstFile, delete_image(img_id, imgstFile, &index), &lsn);
+    if(ret != ERR_NONE && index != INDEX_NIL) {
+        //its writes are dropped with the transaction, the image stays (as in do_insert)
+        imgstFile->metadata[index].is_valid = NON_EMPTY;
+        imgst_index_add(imgstFile, index);
+        imgstFile->header.num_files = num_files;
+        imgstFile->header.imgst_version = version;
+    }
+    pthread_rwlock_unlock(&imgstFile->lock);
+    if(ret == ERR_NONE && imgstFile->on_delete != NULL) {
+        imgstFile->on_delete(imgstFile->on_delete_arg, index);
     }
-    // return file not found if there was no match in the ids
-    return ERR_FILE_NOT_FOUND;
+    //waits without the lock, so that the commits of concurrent mutations are synced together
+    return ret != ERR_NONE ? ret : imgst_wal_sync(imgstFile, lsn);
 }
\ No newline at end of file
@@ -1,9 +1,21 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h> // for fdatasync
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
+
+/**
+ * a stored image (of any resolution) in the imgStore file
+ */
+struct segment {
+    uint64_t offset;
+    uint32_t size;
+};
 
 /**
  *
@@ -19,48 +31,57 @@ int gc_useful_data_copy(struct imgst_file* origin_imgstFile, struct imgst_file*
     int ret; //used to store the returned value of functions
     size_t max_size = 0;
 
-    for(size_t i = 0; i < origin_imgstFile->header.max_files; ++i) {
-        size_t img_size = origin_imgstFile->metadata[i].size[RES_ORIG];
+    for(uint32_t i = imgst_index_next_valid(origin_imgstFile, 0); i != INDEX_NIL; i = imgst_index_next_valid(origin_imgstFile, i + 1)) {
+        size_t img_size = origin_imgstFile->columns.size[i][RES_ORIG];
         max_size = max_size < img_size ? img_size : max_size;
     }
 
     char* buffer = calloc(1, max_size);
     if(buffer == NULL) return ERR_IO;
     size_t nb_valid_images = 0; //used as index for the array of metadata of the temp imgstFile
-    fseek(temp_imgstFile->file, sizeof(struct img_metadata) * origin_imgstFile->header.max_files + sizeof(struct imgst_header), SEEK_SET);
-
-    for(size_t i = 0; i < origin_imgstFile->header.max_files; ++i) {
-        if(origin_imgstFile->metadata[i].is_valid) {
-            //read img and store it in the buffer
-            fseek(origin_imgstFile->file, origin_imgstFile->metadata[i].offset[RES_ORIG], SEEK_SET);
-            fread(buffer, origin_imgstFile->metadata[i].size[RES_ORIG], 1, origin_imgstFile->file);
-            //insert this image in the temp imgstFile
-            do_insert(buffer,
-                      origin_imgstFile->metadata[i].size[RES_ORIG],
-                      origin_imgstFile->metadata[i].img_id,
-                      temp_imgstFile);
-            //insert the other resolutions of this image if they are already created (ie stored in origin imgstFile)
-            for(size_t res = RES_THUMB; res <= RES_SMALL; ++res) {
-                if(origin_imgstFile->metadata[i].size[res] != 0) {
-                    fseek(origin_imgstFile->file, origin_imgstFile->metadata[i].offset[res], SEEK_SET);
-                    fseek(temp_imgstFile->file, NO_OFFSET, SEEK_END);
-                    fread(buffer, origin_imgstFile->metadata[i].size[res], 1, origin_imgstFile->file);
-                    temp_imgstFile->metadata[nb_valid_images].size[res] = origin_imgstFile->metadata[i].size[res];
-                    temp_imgstFile->metadata[nb_valid_images].offset[res] = ftell(temp_imgstFile->file);
-                    fwrite(buffer, origin_imgstFile->metadata[i].size[res], 1, temp_imgstFile->file);
-
-                }
+
+    for(uint32_t i = imgst_index_next_valid(origin_imgstFile, 0); i != INDEX_NIL; i = imgst_index_next_valid(origin_imgstFile, i + 1)) {
+        //read img and store it in the buffer
+        imgst_pread(origin_imgstFile, buffer, origin_imgstFile->metadata[i].size[RES_ORIG], origin_imgstFile->metadata[i].offset[RES_ORIG]);
+        //insert this image in the temp imgstFile
+        do_insert(buffer,
+                  origin_imgstFile->metadata[i].size[RES_ORIG],
+                  origin_imgstFile->metadata[i].img_id,
+                  temp_imgstFile);
+        //insert the other resolutions of this image if they are already created (ie stored in origin imgstFile)
+        for(size_t res = RES_THUMB; res <= RES_SMALL; ++res) {
+            if(origin_imgstFile->metadata[i].size[res] != 0) {
+                imgst_pread(origin_imgstFile, buffer, origin_imgstFile->metadata[i].size[res], origin_imgstFile->metadata[i].offset[res]);
+                temp_imgstFile->metadata[nb_valid_images].size[res] = origin_imgstFile->metadata[i].size[res];
+                imgst_append(temp_imgstFile, buffer, origin_imgstFile->metadata[i].size[res],
+                             &temp_imgstFile->metadata[nb_valid_images].offset[res]);
             }
-            ++nb_valid_images;
         }
-    }
-    //need to rewrite metadata since have added smaller res
-    for(size_t i = 0; i < temp_imgstFile->header.max_files; ++i) {
-        if((ret = write_metadata(temp_imgstFile, i)) != ERR_NONE) return ret;
+        ++nb_valid_images;
     }
     free(buffer);
-    return ERR_NONE;
+
+    //need to rewrite metadata since have added smaller res (the others are still EMPTY, as written by do_create),
+    //in one record that is durable (and in the file) before the caller syncs the file and renames it
+    uint64_t lsn = 0;
+    imgst_wal_begin(temp_imgstFile);
+    ret = ERR_NONE;
+    for(size_t i = 0; i < nb_valid_images && ret == ERR_NONE; ++i) {
+        ret = write_metadata(temp_imgstFile, i);
+    }
+    ret = imgst_wal_end(temp_imgstFile, ret, &lsn);
+    return ret != ERR_NONE ? ret : imgst_wal_sync(temp_imgstFile, lsn);
 }
+/**
+ * order segments by increasing offset (for qsort)
+ */
+static int compare_segments(const void* a, const void* b)
+{
+    uint64_t const offset_a = ((const struct segment*) a)->offset;
+    uint64_t const offset_b = ((const struct segment*) b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
 /**
  * determine if this imgstFile need a garbage collection (ie is there holes in its file)
  * @param imgstFile
@@ -69,32 +90,39 @@ int gc_useful_data_copy(struct imgst_file* origin_imgstFile, struct imgst_file*
 bool needGC(struct imgst_file* imgstFile)
 {
     if(imgstFile == NULL || imgstFile->metadata == NULL || imgstFile->file == NULL) return false;
-    fseek(imgstFile->file, NO_OFFSET, SEEK_END);
-    long end_offset = ftell(imgstFile->file);
-    long curr_offset = sizeof(struct imgst_header) + imgstFile->header.max_files * sizeof(struct img_metadata);
-
-    while(curr_offset < end_offset) {
-        bool found_next = false;
-        size_t i = 0;
-        while(i < imgstFile->header.max_files && !found_next) {
-            int res = RES_THUMB;
-            while(res <= RES_ORIG) {
-                if( imgstFile->metadata[i].is_valid &&
-                    imgstFile->metadata[i].size[res] != 0 &&
-                    imgstFile->metadata[i].offset[res] == curr_offset) {
-
-                    curr_offset += imgstFile->metadata[i].size[res];
-                    found_next = true;
-                }
-                ++res;
+    uint64_t end_offset = imgstFile->end_offset;
+    uint64_t curr_offset = sizeof(struct imgst_header) + imgstFile->header.max_files * sizeof(struct img_metadata);
+
+    //collect every stored image from the dense columns of the valid metadata
+    size_t nb_segments = 0;
+    for(uint32_t i = imgst_index_next_valid(imgstFile, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgstFile, i + 1)) {
+        nb_segments += NB_RES;
+    }
+    struct segment* segments = calloc(nb_segments + 1, sizeof(struct segment));
+    if(segments == NULL) return true; //can't tell, collecting is always safe
+
+    nb_segments = 0;
+    for(uint32_t i = imgst_index_next_valid(imgstFile, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgstFile, i + 1)) {
+        for(int res = RES_THUMB; res <= RES_ORIG; ++res) {
+            if(imgstFile->columns.size[i][res] != 0) {
+                segments[nb_segments++] = (struct segment) {
+                    imgstFile->columns.offset[i][res], imgstFile->columns.size[i][res]
+                };
             }
-            ++i;
-        }
-        if(!found_next) {
-            return true;
         }
     }
-    return false;
+    qsort(segments, nb_segments, sizeof(struct segment), compare_segments);
+
+    //walk the file from the end of the metadata, every byte must belong to a stored image
+    size_t s = 0;
+    while(s < nb_segments && segments[s].offset <= curr_offset) {
+        //a segment starting before curr_offset is shared by duplicated contents
+        uint64_t const segment_end = segments[s].offset + segments[s].size;
+        curr_offset = segment_end > curr_offset ? segment_end : curr_offset;
+        ++s;
+    }
+    free(segments);
+    return curr_offset < end_offset;
 }
 
 /**
@@ -132,6 +160,8 @@ int do_gbcollect(const char* imgst_name, const char* temp_name)
     struct imgst_file temp_imgstFile = {.header = origin_imgstFile.header};
     //other fields will be init in do_create
     if((ret = do_create(temp_name, &temp_imgstFile)) != ERR_NONE) return ret;
+    //the variants already made are copied, they must not be made again
+    temp_imgstFile.eager_variants = false;
 
     //if there is no "holes" in the origin file, no gc to do
     if(!needGC(&origin_imgstFile)) {
@@ -147,6 +177,11 @@ int do_gbcollect(const char* imgst_name, const char* temp_name)
      *          gc finished, delete origin file, keep only the temp that we will rename with the name of the origin's one */
 
     if(ret == ERR_NONE) {
+        //the compacted file (with the logged writes of the origin) must be durable before it replaces the origin
+        if (fdatasync(temp_imgstFile.fd) != 0) {
+            close_gc(&origin_imgstFile, &temp_imgstFile);
+            return ERR_IO;
+        }
         if ((ret = remove(imgst_name)) != ERR_NONE) {
             close_gc(&origin_imgstFile, &temp_imgstFile);
             return ret;
@@ -155,6 +190,7 @@ int do_gbcollect(const char* imgst_name, const char* temp_name)
             close_gc(&origin_imgstFile, &temp_imgstFile);
             return ret;
         }
+        imgst_wal_remove(imgst_name);
     }
     close_gc(&origin_imgstFile, &temp_imgstFile);
     return ERR_NONE;
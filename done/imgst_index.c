@@ -0,0 +1,458 @@
+/**
+ * @file imgst_index.c
+ * @brief in-memory indexes over the metadata of an imgst_file
+ */
+
+#include "imgst_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define BITS_PER_WORD 64
+#define NB_WORDS(nb_bits) (((nb_bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * 64 bits FNV-1a hash of a nul terminated image id
+ */
+static uint64_t hash_img_id(const char* img_id)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i <= MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * a SHA-256 is already uniformly distributed, its first bytes are a good enough hash
+ */
+static uint64_t hash_sha(const unsigned char* SHA)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+//----------------------------------------------------------------------------------------------------------
+/**
+ * allocates an empty index able to chain max_files slots
+ * @param index to initialise
+ * @param max_files number of slots of the metadata array
+ * @return error code as defined in error.h
+ */
+static int slot_index_init(struct slot_index* index, uint32_t max_files)
+{
+    //smallest power of two >= max_files, so that the load factor stays <= 1
+    uint32_t nb_buckets = 1;
+    while (nb_buckets < max_files) {
+        nb_buckets <<= 1;
+    }
+
+    index->heads = malloc(nb_buckets * sizeof(uint32_t));
+    index->next = malloc(max_files * sizeof(uint32_t));
+    if (index->heads == NULL || index->next == NULL) {
+        free(index->heads);
+        free(index->next);
+        index->heads = NULL;
+        index->next = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    //every byte at 0xFF makes every entry INDEX_NIL
+    memset(index->heads, 0xFF, nb_buckets * sizeof(uint32_t));
+    memset(index->next, 0xFF, max_files * sizeof(uint32_t));
+    index->nb_buckets = nb_buckets;
+    return ERR_NONE;
+}
+
+/**
+ * frees the arrays of the index
+ */
+static void slot_index_free(struct slot_index* index)
+{
+    free(index->heads);
+    free(index->next);
+    index->heads = NULL;
+    index->next = NULL;
+    index->nb_buckets = 0;
+}
+
+/**
+ * adds slot at the head of the chain of the bucket of hash
+ */
+static void slot_index_link(struct slot_index* index, uint64_t hash, uint32_t slot)
+{
+    uint32_t* head = &index->heads[hash & (index->nb_buckets - 1)];
+    index->next[slot] = *head;
+    *head = slot;
+}
+
+/**
+ * removes slot from the chain of the bucket of hash (does nothing if it is not there)
+ */
+static void slot_index_unlink(struct slot_index* index, uint64_t hash, uint32_t slot)
+{
+    uint32_t* link = &index->heads[hash & (index->nb_buckets - 1)];
+    while (*link != INDEX_NIL && *link != slot) {
+        link = &index->next[*link];
+    }
+    if (*link == slot) {
+        *link = index->next[slot];
+        index->next[slot] = INDEX_NIL;
+    }
+}
+
+/**
+ * sets the valid bit of slot (NON_EMPTY metadata)
+ */
+static void valid_set(struct metadata_columns* columns, uint32_t slot)
+{
+    columns->valid[slot / BITS_PER_WORD] |= UINT64_C(1) << (slot % BITS_PER_WORD);
+}
+
+/**
+ * clears the valid bit of slot (EMPTY metadata), which makes it the first free candidate of its word
+ */
+static void valid_clear(struct metadata_columns* columns, uint32_t slot)
+{
+    columns->valid[slot / BITS_PER_WORD] &= ~(UINT64_C(1) << (slot % BITS_PER_WORD));
+    if (slot / BITS_PER_WORD < columns->free_hint) {
+        columns->free_hint = slot / BITS_PER_WORD;
+    }
+}
+
+/**
+ * frees the arrays of the columns
+ */
+static void columns_free(struct metadata_columns* columns)
+{
+    free(columns->valid);
+    free(columns->id_hash);
+    free(columns->offset);
+    free(columns->size);
+    free(columns->generation);
+    columns->valid = NULL;
+    columns->id_hash = NULL;
+    columns->offset = NULL;
+    columns->size = NULL;
+    columns->generation = NULL;
+}
+
+/**
+ * allocates the columns for max_files (all metadata EMPTY)
+ * @return error code as defined in error.h
+ */
+static int columns_init(struct metadata_columns* columns, uint32_t max_files)
+{
+    //bits past max_files stay at 0, imgst_index_find_free masks them
+    columns->valid = calloc(NB_WORDS(max_files), sizeof(uint64_t));
+    columns->id_hash = calloc(max_files, sizeof(uint64_t));
+    columns->offset = calloc(max_files, sizeof(*columns->offset));
+    columns->size = calloc(max_files, sizeof(*columns->size));
+    columns->generation = calloc(max_files, sizeof(uint32_t));
+    columns->free_hint = 0;
+    columns->last_generation = 0;
+    if (columns->valid == NULL || columns->id_hash == NULL || columns->offset == NULL || columns->size == NULL
+        || columns->generation == NULL) {
+        columns_free(columns);
+        return ERR_OUT_OF_MEMORY;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @return the position in the id order of the first valid image whose id is >= img_id
+ *         (> img_id if after), nb_slots if there is none
+ */
+static uint32_t id_order_search(const struct imgst_file* imgst_file, const char* img_id, bool after)
+{
+    const struct id_order* order = &imgst_file->id_order;
+    uint32_t low = 0;
+    uint32_t high = order->nb_slots;
+    while (low < high) {
+        uint32_t const middle = low + (high - low) / 2;
+        int const cmp = strncmp(imgst_file->metadata[order->slots[middle]].img_id, img_id, MAX_IMG_ID + 1);
+        if (cmp < 0 || (after && cmp == 0)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * qsort comparator of the metadata of the valid images, by img_id
+ */
+static int compare_ids(const void* a, const void* b)
+{
+    const struct img_metadata* const* first = a;
+    const struct img_metadata* const* second = b;
+    return strncmp((*first)->img_id, (*second)->img_id, MAX_IMG_ID + 1);
+}
+
+/**
+ * sorts the slots of the valid images by id, once at the end of imgst_index_build
+ * @return error code as defined in error.h
+ */
+static int id_order_build(struct imgst_file* imgst_file)
+{
+    uint32_t const max_files = imgst_file->header.max_files;
+    //the ids are sorted once through pointers to their metadata, then kept sorted by add and remove
+    const struct img_metadata** sorted = calloc(max_files, sizeof(struct img_metadata*));
+    uint32_t* slots = calloc(max_files, sizeof(uint32_t));
+    if (sorted == NULL || slots == NULL) {
+        free(sorted);
+        free(slots);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    uint32_t nb_slots = 0;
+    for (uint32_t i = imgst_index_next_valid(imgst_file, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgst_file, i + 1)) {
+        sorted[nb_slots++] = &imgst_file->metadata[i];
+    }
+    qsort(sorted, nb_slots, sizeof(struct img_metadata*), compare_ids);
+    for (uint32_t k = 0; k < nb_slots; ++k) {
+        slots[k] = (uint32_t) (sorted[k] - imgst_file->metadata);
+    }
+    free(sorted);
+
+    imgst_file->id_order.slots = slots;
+    imgst_file->id_order.nb_slots = nb_slots;
+    return ERR_NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int imgst_index_build(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    //start from empty indexes, so that a failure only frees what was allocated here
+    imgst_file->id_index = (struct slot_index) {0};
+    imgst_file->sha_index = (struct slot_index) {0};
+    imgst_file->columns = (struct metadata_columns) {0};
+    imgst_file->id_order = (struct id_order) {0};
+
+    uint32_t const max_files = imgst_file->header.max_files;
+    int ret = slot_index_init(&imgst_file->id_index, max_files);
+    if (ret == ERR_NONE) {
+        ret = slot_index_init(&imgst_file->sha_index, max_files);
+    }
+    if (ret == ERR_NONE) {
+        ret = columns_init(&imgst_file->columns, max_files);
+    }
+    if (ret != ERR_NONE) {
+        imgst_index_free(imgst_file);
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < max_files; ++i) {
+        imgst_index_update(imgst_file, i);
+        if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
+            imgst_index_add(imgst_file, i);
+        }
+    }
+    //sorted once rather than kept sorted image by image
+    ret = id_order_build(imgst_file);
+    if (ret != ERR_NONE) {
+        imgst_index_free(imgst_file);
+    }
+    return ret;
+}
+
+/** @copybrief */
+void imgst_index_free(struct imgst_file* imgst_file)
+{
+    if (imgst_file != NULL) {
+        slot_index_free(&imgst_file->id_index);
+        slot_index_free(&imgst_file->sha_index);
+        columns_free(&imgst_file->columns);
+        free(imgst_file->id_order.slots);
+        imgst_file->id_order = (struct id_order) {0};
+    }
+}
+
+/** @copybrief */
+void imgst_index_update(struct imgst_file* imgst_file, uint32_t index)
+{
+    if (imgst_file == NULL || imgst_file->columns.size == NULL || index >= imgst_file->header.max_files) {
+        return;
+    }
+    for (int res = RES_THUMB; res < NB_RES; ++res) {
+        imgst_file->columns.offset[index][res] = imgst_file->metadata[index].offset[res];
+        imgst_file->columns.size[index][res] = imgst_file->metadata[index].size[res];
+    }
+}
+
+/** @copybrief */
+void imgst_index_add(struct imgst_file* imgst_file, uint32_t index)
+{
+    uint64_t const id_hash = hash_img_id(imgst_file->metadata[index].img_id);
+    imgst_file->columns.id_hash[index] = id_hash;
+    slot_index_link(&imgst_file->id_index, id_hash, index);
+    slot_index_link(&imgst_file->sha_index, hash_sha(imgst_file->metadata[index].SHA), index);
+    valid_set(&imgst_file->columns, index);
+    imgst_file->columns.generation[index] = ++imgst_file->columns.last_generation;
+
+    struct id_order* order = &imgst_file->id_order;
+    if (order->slots != NULL) {
+        uint32_t const position = id_order_search(imgst_file, imgst_file->metadata[index].img_id, false);
+        memmove(&order->slots[position + 1], &order->slots[position], (order->nb_slots - position) * sizeof(uint32_t));
+        order->slots[position] = index;
+        ++order->nb_slots;
+    }
+}
+
+/** @copybrief */
+void imgst_index_remove(struct imgst_file* imgst_file, uint32_t index)
+{
+    slot_index_unlink(&imgst_file->id_index, imgst_file->columns.id_hash[index], index);
+    slot_index_unlink(&imgst_file->sha_index, hash_sha(imgst_file->metadata[index].SHA), index);
+    valid_clear(&imgst_file->columns, index);
+
+    //the ids of the valid images are unique, the id of the slot leads to its position
+    struct id_order* order = &imgst_file->id_order;
+    uint32_t const position = order->slots == NULL ? order->nb_slots :
+                              id_order_search(imgst_file, imgst_file->metadata[index].img_id, false);
+    if (position < order->nb_slots && order->slots[position] == index) {
+        --order->nb_slots;
+        memmove(&order->slots[position], &order->slots[position + 1], (order->nb_slots - position) * sizeof(uint32_t));
+    }
+}
+
+/** @copybrief */
+bool imgst_index_is_valid(const struct imgst_file* imgst_file, uint32_t index)
+{
+    return (imgst_file->columns.valid[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
+}
+
+/** @copybrief */
+uint32_t imgst_index_next_valid(const struct imgst_file* imgst_file, uint32_t from)
+{
+    if (imgst_file == NULL || imgst_file->columns.valid == NULL || from >= imgst_file->header.max_files) {
+        return INDEX_NIL;
+    }
+
+    uint32_t const nb_words = NB_WORDS(imgst_file->header.max_files);
+    uint32_t word = from / BITS_PER_WORD;
+    //ignore the slots before from in its word
+    uint64_t bits = imgst_file->columns.valid[word] & (~UINT64_C(0) << (from % BITS_PER_WORD));
+    while (bits == 0) {
+        if (++word == nb_words) {
+            return INDEX_NIL;
+        }
+        bits = imgst_file->columns.valid[word];
+    }
+    return word * BITS_PER_WORD + (uint32_t) __builtin_ctzll(bits);
+}
+
+/** @copybrief */
+int imgst_index_find_id(const struct imgst_file* imgst_file, const char* img_id, uint32_t* index)
+{
+    if (imgst_file == NULL || imgst_file->id_index.heads == NULL || img_id == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    //compare the hashes first, the id itself is only read on a (likely) match
+    uint64_t const id_hash = hash_img_id(img_id);
+    const struct slot_index* id_index = &imgst_file->id_index;
+    uint32_t slot = id_index->heads[id_hash & (id_index->nb_buckets - 1)];
+    while (slot != INDEX_NIL) {
+        if (imgst_file->columns.id_hash[slot] == id_hash && imgst_index_is_valid(imgst_file, slot) &&
+            !strncmp(img_id, imgst_file->metadata[slot].img_id, MAX_IMG_ID + 1)) {
+            *index = slot;
+            return ERR_NONE;
+        }
+        slot = id_index->next[slot];
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+/** @copybrief */
+int imgst_index_find_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, uint32_t skip, uint32_t* index)
+{
+    if (imgst_file == NULL || imgst_file->sha_index.heads == NULL || SHA == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct slot_index* sha_index = &imgst_file->sha_index;
+    uint32_t slot = sha_index->heads[hash_sha(SHA) & (sha_index->nb_buckets - 1)];
+    while (slot != INDEX_NIL) {
+        if (slot != skip && imgst_index_is_valid(imgst_file, slot) &&
+            !memcmp(SHA, imgst_file->metadata[slot].SHA, SHA256_DIGEST_LENGTH)) {
+            *index = slot;
+            return ERR_NONE;
+        }
+        slot = sha_index->next[slot];
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+/** @copybrief */
+bool imgst_index_page(const struct imgst_file* imgst_file, const char* prefix, const char* after, uint32_t limit,
+                      uint32_t* slots, uint32_t* nb_slots)
+{
+    *nb_slots = 0;
+    if (imgst_file == NULL || imgst_file->id_order.slots == NULL || prefix == NULL || slots == NULL) {
+        return false;
+    }
+
+    //the ids with the prefix are contiguous in the order, from the first one >= prefix
+    const struct id_order* order = &imgst_file->id_order;
+    uint32_t position = id_order_search(imgst_file, prefix, false);
+    if (after != NULL) {
+        uint32_t const after_position = id_order_search(imgst_file, after, true);
+        position = after_position > position ? after_position : position;
+    }
+
+    size_t const prefix_len = strlen(prefix);
+    while (position < order->nb_slots &&
+           !strncmp(imgst_file->metadata[order->slots[position]].img_id, prefix, prefix_len)) {
+        if (*nb_slots == limit) {
+            return true;
+        }
+        slots[(*nb_slots)++] = order->slots[position++];
+    }
+    return false;
+}
+
+/** @copybrief */
+int imgst_index_find_free(struct imgst_file* imgst_file, uint32_t* index)
+{
+    if (imgst_file == NULL || imgst_file->columns.valid == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t const max_files = imgst_file->header.max_files;
+    uint32_t const nb_words = NB_WORDS(max_files);
+    struct metadata_columns* columns = &imgst_file->columns;
+
+    //the words before free_hint are known to be full, skip them
+    uint32_t word = columns->free_hint;
+    uint64_t free_bits = 0;
+    while (word < nb_words && free_bits == 0) {
+        free_bits = ~columns->valid[word];
+        if (word == nb_words - 1 && max_files % BITS_PER_WORD != 0) {
+            //the bits past max_files are not metadata
+            free_bits &= (UINT64_C(1) << (max_files % BITS_PER_WORD)) - 1;
+        }
+        if (free_bits == 0) {
+            ++word;
+        }
+    }
+    columns->free_hint = word;
+
+    if (word == nb_words) {
+        return ERR_FULL_IMGSTORE;
+    }
+    //lowest set bit = first free slot of the word
+    *index = word * BITS_PER_WORD + (uint32_t) __builtin_ctzll(free_bits);
+    return ERR_NONE;
+}
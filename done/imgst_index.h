@@ -0,0 +1,116 @@
+#pragma once
+#include <stdbool.h>
+#include "imgStore.h"
+
+/**
+ * @file imgst_index.h
+ * @brief in-memory indexes over the metadata array of an imgst_file.
+ *
+ * They are rebuilt from the metadata each time the imgStore is opened
+ * and must be kept up to date by every function changing the is_valid
+ * field of a metadata (imgst_index_add/imgst_index_remove) or its offsets
+ * and sizes (imgst_index_update, done by write_metadata).
+ */
+
+/**
+ * @brief allocates and fills the indexes from the valid metadata of imgst_file
+ *
+ * @param imgst_file with its header and metadata already loaded
+ * @return Some error code. 0 if no error.
+ */
+int imgst_index_build(struct imgst_file* imgst_file);
+
+/**
+ * @brief frees the indexes of imgst_file (can be called on never built indexes)
+ *
+ * @param imgst_file
+ */
+void imgst_index_free(struct imgst_file* imgst_file);
+
+/**
+ * @brief copies the offsets and sizes of the metadata at index into the columns
+ *
+ * @param imgst_file
+ * @param index of the metadata in the array
+ */
+void imgst_index_update(struct imgst_file* imgst_file, uint32_t index);
+
+/**
+ * @brief registers the (valid) metadata at index in all the indexes
+ *
+ * @param imgst_file
+ * @param index of the metadata in the array
+ */
+void imgst_index_add(struct imgst_file* imgst_file, uint32_t index);
+
+/**
+ * @brief unregisters the metadata at index from all the indexes
+ *
+ * @param imgst_file
+ * @param index of the metadata in the array
+ */
+void imgst_index_remove(struct imgst_file* imgst_file, uint32_t index);
+
+/**
+ * @brief tells, from the validity bitmap, whether the metadata at index is NON_EMPTY
+ *
+ * @param imgst_file
+ * @param index of the metadata in the array (must be < max_files)
+ * @return true if the metadata is valid
+ */
+bool imgst_index_is_valid(const struct imgst_file* imgst_file, uint32_t index);
+
+/**
+ * @brief iterates over the valid metadata, skipping 64 EMPTY ones at a time
+ *        Example usage:
+ *            for (uint32_t i = imgst_index_next_valid(f, 0); i != INDEX_NIL; i = imgst_index_next_valid(f, i + 1))
+ *
+ * @param imgst_file
+ * @param from index where the search starts (included)
+ * @return the index of the first valid metadata >= from, INDEX_NIL if there is none
+ */
+uint32_t imgst_index_next_valid(const struct imgst_file* imgst_file, uint32_t from);
+
+/**
+ * @brief finds the valid image having the given id
+ *
+ * @param imgst_file
+ * @param img_id id of the image we are looking for
+ * @param index output, position of the image in the metadata array
+ * @return ERR_FILE_NOT_FOUND if no valid image has this id else ERR_NONE
+ */
+int imgst_index_find_id(const struct imgst_file* imgst_file, const char* img_id, uint32_t* index);
+
+/**
+ * @brief finds a valid image having the given content
+ *
+ * @param imgst_file
+ * @param SHA hash code of the content we are looking for
+ * @param skip index of a metadata to ignore (typically the one being inserted), INDEX_NIL for none
+ * @param index output, position in the metadata array of an image storing this content
+ * @return ERR_FILE_NOT_FOUND if no other valid image has this content else ERR_NONE
+ */
+int imgst_index_find_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, uint32_t skip, uint32_t* index);
+
+/**
+ * @brief gives a page of the valid images, in the order of their ids
+ *
+ * @param imgst_file
+ * @param prefix only the ids starting with it are given ("" for all of them)
+ * @param after id the page starts after (the last one of the previous page), NULL for the first page
+ * @param limit max number of images in the page
+ * @param slots output, positions in the metadata array of the images of the page (limit entries)
+ * @param nb_slots output, number of images in the page
+ * @return whether other images with the prefix come after the page
+ */
+bool imgst_index_page(const struct imgst_file* imgst_file, const char* prefix, const char* after, uint32_t limit,
+                      uint32_t* slots, uint32_t* nb_slots);
+
+/**
+ * @brief finds the first EMPTY metadata, where a new image can be stored
+ *
+ * @param imgst_file
+ * @param index output, position of the free metadata in the array
+ * @return ERR_FULL_IMGSTORE if every metadata is used else ERR_NONE
+ */
+int imgst_index_find_free(struct imgst_file* imgst_file, uint32_t* index);
@@ -1,95 +1,403 @@
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h> // for sysconf
 #include "imgStore.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
 
-#define NO_OFFSET 0
+/**
+ * gives a metadata back, its image will not be stored
+ */
+static void release_slot(struct imgst_file* imgst_file, uint32_t i)
+{
+    imgst_index_remove(imgst_file, i);
+    imgst_file->metadata[i].is_valid = EMPTY;
+}
 
-/** @copybrief */
-int do_insert(const char* buffer, size_t img_size, const char* img_id, struct imgst_file* imgst_file)
+/**
+ * appends the image (unless it is a duplicate) and its variants, then writes
+ * the metadata i, already in the indexes, and the header
+ * @return err_code as def in error.h
+ */
+static int store_image(const char* buffer, size_t img_size, struct imgst_file* imgst_file, uint32_t i,
+                       uint32_t width, uint32_t height, const struct variant* variants)
 {
-    if(img_size == 0 || img_id == NULL || buffer == NULL || imgst_file == NULL || imgst_file->metadata == NULL) {
-        return ERR_INVALID_ARGUMENT;
+    // If no duplicate found insert image at the end of the file
+    if(imgst_file->metadata[i].offset[RES_ORIG] == 0) { //offset == 0 is an indicator of the absence of a duplicate
+        //write new image to end of file, its offset is where the end of the file was
+        if (imgst_append(imgst_file, buffer, img_size, &imgst_file->metadata[i].offset[RES_ORIG]) != ERR_NONE) {
+            fprintf(stderr, "ERROR: fail to write image");
+            return ERR_IO;
+        }
+    }
+
+    //the variants made beforehand, unless the duplicate already has them
+    for(int res = 0; variants != NULL && res < NB_VARIANTS; ++res) {
+        if(imgst_file->metadata[i].size[res] == 0) {
+            if(imgst_append(imgst_file, variants[res].image, variants[res].size, &imgst_file->metadata[i].offset[res]) != ERR_NONE) {
+                fprintf(stderr, "ERROR: fail to write resized image");
+                return ERR_IO;
+            }
+            imgst_file->metadata[i].size[res] = variants[res].size;
+        }
+    }
+
+    //update metadata and header parameters
+    imgst_file->metadata[i].res_orig[0] = width;
+    imgst_file->metadata[i].res_orig[1] = height;
+
+
+    int err_write_metadata = write_metadata(imgst_file, i);
+    if(err_write_metadata != ERR_NONE) {
+        return err_write_metadata;
+    }
+    //update the header and write it on the file
+    imgst_file->header.num_files += 1;
+    imgst_file->header.imgst_version += 1;
+    int err_write_header = write_header(imgst_file);
+
+    if(err_write_header != ERR_NONE) {
+        return err_write_header;
     }
 
+    return ERR_NONE;
+}
+
+/**
+ * stores the image in the first free metadata, its metadata and header
+ * writes are made in the transaction opened by do_insert
+ * @param SHA hash of the image, computed before taking the lock
+ * @param width width of the image, computed before taking the lock
+ * @param height height of the image, computed before taking the lock
+ * @param variants made before taking the lock, NULL if they are made when read
+ * @param index output, the metadata given to the image once it is in the indexes (left as is before)
+ * @return err_code as def in error.h
+ */
+static int insert_image(const char* buffer, size_t img_size, const char* img_id, struct imgst_file* imgst_file,
+                        const unsigned char* SHA, uint32_t width, uint32_t height, const struct variant* variants,
+                        uint32_t* index)
+{
     if(imgst_file->header.num_files >= imgst_file->header.max_files) {
         fprintf(stderr, "The database is full, it has reached %u files capacity", imgst_file->header.max_files);
         return ERR_FULL_IMGSTORE;
     }
 
-    size_t i = 0;
-    bool found_space = false;
-
-    // check for space to insert new file
-    while(i < imgst_file->header.max_files && !found_space) {
+    // find space to insert new file
+    uint32_t i = 0;
+    int err_free = imgst_index_find_free(imgst_file, &i);
+    if(err_free != ERR_NONE) {
+        return err_free;
+    }
 
-        //once file is found start initialising the metadata
-        if(!imgst_file->metadata[i].is_valid) {
-            found_space = true;
-            SHA256(buffer, img_size, imgst_file->metadata[i].SHA);
-            strncpy(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID);
-            imgst_file->metadata[i].size[RES_ORIG] = img_size;
-            imgst_file->metadata[i].is_valid = NON_EMPTY;
+    //start initialising the metadata
+    memcpy(imgst_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH);
+    strncpy(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID);
+    imgst_file->metadata[i].size[RES_ORIG] = img_size;
+    imgst_file->metadata[i].is_valid = NON_EMPTY;
 
-            for(int res = RES_THUMB; res <= RES_SMALL; ++res) {
-                imgst_file->metadata[i].offset[res] = 0;
-                imgst_file->metadata[i].size[res] = 0;
-            }
-        }
-        i++;
+    for(int res = RES_THUMB; res <= RES_SMALL; ++res) {
+        imgst_file->metadata[i].offset[res] = 0;
+        imgst_file->metadata[i].size[res] = 0;
     }
-    i--;
 
     // Dedup content of newly semi initialised metadata i
     int err_dedup = do_name_and_content_dedup(imgst_file, i);
     if(err_dedup != ERR_NONE) {
+        //give the slot back, the image will not be stored
+        imgst_file->metadata[i].is_valid = EMPTY;
         return err_dedup;
     }
+    imgst_index_add(imgst_file, i);
+    *index = i;
 
-    // If no duplicate found insert image at the end of the file
-    if(imgst_file->metadata[i].offset[RES_ORIG] == 0) { //offset == 0 is an indicator of the absence of a duplicate
-        //set the writing pointer to the end of the file
-        if (fseek(imgst_file->file, NO_OFFSET, SEEK_END) != ERR_NONE) {
-            fprintf(stderr, "Error: can't set head reader at the end of the file");
-            return ERR_IO;
-        }
-
-        //get offset by getting where is the end of the file
-        imgst_file->metadata[i].offset[RES_ORIG] = ftell(imgst_file->file);
+    return store_image(buffer, img_size, imgst_file, i, width, height, variants);
+}
 
-        //write new resized image to end of file
-        int nb_image_to_write = 1;
-        if (fwrite(buffer, img_size, nb_image_to_write, imgst_file->file) != nb_image_to_write) {
-            fprintf(stderr, "ERROR: fail to write resized image");
-            return ERR_IO;
-        }
+/** @copybrief */
+int do_insert(const char* buffer, size_t img_size, const char* img_id, struct imgst_file* imgst_file)
+{
+    if(img_size == 0 || img_id == NULL || buffer == NULL || imgst_file == NULL || imgst_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
     }
 
-    //returns the height and width of image loaded in buffer
+    //hashing and decoding the image do not need the imgStore, other threads can use it meanwhile
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) buffer, img_size, SHA);
     uint32_t height = 0;
     uint32_t width = 0;
-    int err_get_res = get_resolution(&height, &width, buffer, img_size);
+    //so are the variants when they are made at insertion, from the same decode as the resolution
+    struct variant variants[NB_VARIANTS];
+    bool const wanted[NB_VARIANTS] = {true, true};
+    int err_get_res = imgst_file->eager_variants ?
+                      resize_variants(imgst_file, buffer, img_size, wanted, variants, &width, &height) :
+                      get_resolution(&height, &width, buffer, img_size);
     if (err_get_res != ERR_NONE) {
         return err_get_res;
     }
-    //update metadata and header parameters
-    imgst_file->metadata[i].res_orig[0] = width;
-    imgst_file->metadata[i].res_orig[1] = height;
 
+    //the metadata and the header are logged together, the insertion is durable once it returns
+    pthread_rwlock_wrlock(&imgst_file->lock);
+    uint64_t lsn = 0;
+    uint32_t index = INDEX_NIL;
+    uint32_t const num_files = imgst_file->header.num_files;
+    uint32_t const version = imgst_file->header.imgst_version;
+    imgst_wal_begin(imgst_file);
+    int ret = imgst_wal_end(imgst_file, insert_image(buffer, img_size, img_id, imgst_file, SHA, width, height,
+                            imgst_file->eager_variants ? variants : NULL, &index), &lsn);
+    if(ret != ERR_NONE && index != INDEX_NIL) {
+        //its writes are dropped with the transaction, the memory must agree with the file
+        release_slot(imgst_file, index);
+        imgst_file->header.num_files = num_files;
+        imgst_file->header.imgst_version = version;
+    }
+    pthread_rwlock_unlock(&imgst_file->lock);
+    if(imgst_file->eager_variants) {
+        free_variants(variants);
+    }
+    //waits without the lock, so that the commits of concurrent mutations are synced together
+    return ret != ERR_NONE ? ret : imgst_wal_sync(imgst_file, lsn);
+}
+//----------------------------------------------------------------------------------------------------------
+#define MAX_HASH_THREADS 8
 
-    int err_write_metadata = write_metadata(imgst_file, i);
-    if(err_write_metadata != ERR_NONE) {
-        return err_write_metadata;
+/**
+ * share of the images of a batch to hash (and measure, and resize) by one thread
+ */
+struct hash_work {
+    struct imgst_file* imgst_file;
+    struct insert_item* items;
+    size_t nb_items;
+    size_t first; // index of the first image of this thread
+    size_t step; // number of threads, the images of a thread are step apart
+    unsigned char (*SHA)[SHA256_DIGEST_LENGTH];
+    uint32_t (*res_orig)[2];
+    struct variant (*variants)[NB_VARIANTS]; // NULL if the variants are made when read
+};
+
+/**
+ * computes the SHA and the resolution of the images of a thread
+ */
+static void* hash_items(void* arg)
+{
+    struct hash_work* work = arg;
+    for(size_t k = work->first; k < work->nb_items; k += work->step) {
+        struct insert_item* item = &work->items[k];
+        if(item->result == ERR_NONE) {
+            SHA256((const unsigned char*) item->buffer, item->size, work->SHA[k]);
+            bool const wanted[NB_VARIANTS] = {true, true};
+            item->result = work->variants != NULL ?
+                           resize_variants(work->imgst_file, item->buffer, item->size, wanted, work->variants[k],
+                                           &work->res_orig[k][0], &work->res_orig[k][1]) :
+                           get_resolution(&work->res_orig[k][1], &work->res_orig[k][0], item->buffer, item->size);
+        }
     }
-    //update the header and write it on the file
-    imgst_file->header.num_files += 1;
-    imgst_file->header.imgst_version += 1;
-    int err_write_header = write_header(imgst_file);
+    return NULL;
+}
 
-    if(err_write_header != ERR_NONE) {
-        return err_write_header;
+/**
+ * hashes all the images of the batch, with up to one thread per core
+ */
+static void hash_batch(struct imgst_file* imgst_file, struct insert_item* items, size_t nb_items,
+                       unsigned char (*SHA)[SHA256_DIGEST_LENGTH], uint32_t (*res_orig)[2],
+                       struct variant (*variants)[NB_VARIANTS])
+{
+    long const nb_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_threads = nb_cores > 0 ? (size_t) nb_cores : 1;
+    nb_threads = nb_threads > MAX_HASH_THREADS ? MAX_HASH_THREADS : nb_threads;
+    nb_threads = nb_threads > nb_items ? nb_items : nb_threads;
+
+    struct hash_work works[MAX_HASH_THREADS];
+    pthread_t threads[MAX_HASH_THREADS];
+    bool started[MAX_HASH_THREADS] = {false};
+    for(size_t t = 0; t < nb_threads; ++t) {
+        works[t] = (struct hash_work) {
+            .imgst_file = imgst_file, .items = items, .nb_items = nb_items, .first = t, .step = nb_threads,
+            .SHA = SHA, .res_orig = res_orig, .variants = variants
+        };
+        //the calling thread does the first share
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, hash_items, &works[t]) == 0;
+    }
+    for(size_t t = 0; t < nb_threads; ++t) {
+        if(started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            hash_items(&works[t]);
+        }
     }
+}
 
-    return ERR_NONE;
-}
\ No newline at end of file
+/**
+ * orders the slots of a batch
+ */
+static int compare_slots(const void* a, const void* b)
+{
+    uint32_t const slot_a = *(const uint32_t*) a;
+    uint32_t const slot_b = *(const uint32_t*) b;
+    return (slot_a > slot_b) - (slot_a < slot_b);
+}
+
+/**
+ * writes the metadata of the (sorted) slots, one write per run of consecutive slots,
+ * then the header
+ * @return err_code as def in error.h
+ */
+static int write_batch_metadata(struct imgst_file* imgst_file, const uint32_t* slots, size_t nb_slots)
+{
+    size_t run = 0;
+    while(run < nb_slots) {
+        size_t end = run + 1;
+        while(end < nb_slots && slots[end] == slots[end - 1] + 1) {
+            ++end;
+        }
+        int err_write_metadata = write_metadata_range(imgst_file, slots[run], end - run);
+        if(err_write_metadata != ERR_NONE) {
+            return err_write_metadata;
+        }
+        run = end;
+    }
+
+    imgst_file->header.num_files += nb_slots;
+    imgst_file->header.imgst_version += nb_slots;
+    return write_header(imgst_file);
+}
+
+/** @copybrief */
+int do_insert_batch(struct insert_item* items, size_t nb_items, struct imgst_file* imgst_file)
+{
+    if((items == NULL && nb_items != 0) || imgst_file == NULL || imgst_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(nb_items == 0) {
+        return ERR_NONE;
+    }
+
+    for(size_t k = 0; k < nb_items; ++k) {
+        struct insert_item* item = &items[k];
+        bool const valid = item->buffer != NULL && item->size != 0 && item->img_id != NULL &&
+                           strlen(item->img_id) != 0 && strlen(item->img_id) <= MAX_IMG_ID;
+        item->result = valid ? ERR_NONE : ERR_INVALID_ARGUMENT;
+    }
+
+    unsigned char (*SHA)[SHA256_DIGEST_LENGTH] = calloc(nb_items, sizeof(*SHA));
+    uint32_t (*res_orig)[2] = calloc(nb_items, sizeof(*res_orig));
+    uint32_t* slots = calloc(nb_items, sizeof(uint32_t));
+    struct iovec* blobs = calloc(nb_items * NB_RES, sizeof(struct iovec));
+    struct variant (*variants)[NB_VARIANTS] = imgst_file->eager_variants ? calloc(nb_items, sizeof(*variants)) : NULL;
+    if(SHA == NULL || res_orig == NULL || slots == NULL || blobs == NULL || (imgst_file->eager_variants && variants == NULL)) {
+        free(SHA);
+        free(res_orig);
+        free(slots);
+        free(blobs);
+        free(variants);
+        return ERR_OUT_OF_MEMORY;
+    }
+    hash_batch(imgst_file, items, nb_items, SHA, res_orig, variants);
+
+    pthread_rwlock_wrlock(&imgst_file->lock);
+    //one after the other, so that an image is deduplicated against the previous ones of the batch
+    size_t nb_slots = 0;
+    size_t nb_blobs = 0;
+    uint64_t const blobs_offset = imgst_file->end_offset;
+    uint64_t next_offset = blobs_offset;
+    for(size_t k = 0; k < nb_items; ++k) {
+        struct insert_item* item = &items[k];
+        if(item->result != ERR_NONE) {
+            continue;
+        }
+        if(imgst_file->header.num_files + nb_slots >= imgst_file->header.max_files) {
+            item->result = ERR_FULL_IMGSTORE;
+            continue;
+        }
+        uint32_t i = 0;
+        item->result = imgst_index_find_free(imgst_file, &i);
+        if(item->result != ERR_NONE) {
+            continue;
+        }
+
+        struct img_metadata* metadata = &imgst_file->metadata[i];
+        memset(metadata, 0, sizeof(struct img_metadata));
+        memcpy(metadata->SHA, SHA[k], SHA256_DIGEST_LENGTH);
+        strncpy(metadata->img_id, item->img_id, MAX_IMG_ID);
+        metadata->size[RES_ORIG] = item->size;
+        metadata->res_orig[0] = res_orig[k][0];
+        metadata->res_orig[1] = res_orig[k][1];
+        metadata->is_valid = NON_EMPTY;
+
+        item->result = do_name_and_content_dedup(imgst_file, i);
+        if(item->result != ERR_NONE) {
+            metadata->is_valid = EMPTY;
+            continue;
+        }
+        imgst_index_add(imgst_file, i);
+
+        //a new content gets the next place after the end of the file
+        if(metadata->offset[RES_ORIG] == 0) {
+            metadata->offset[RES_ORIG] = next_offset;
+            next_offset += item->size;
+            blobs[nb_blobs++] = (struct iovec) {
+                .iov_base = (void*) item->buffer, .iov_len = item->size
+            };
+        }
+        //and so do its variants, unless the duplicate already has them
+        for(int res = 0; variants != NULL && res < NB_VARIANTS; ++res) {
+            if(metadata->size[res] == 0) {
+                metadata->offset[res] = next_offset;
+                metadata->size[res] = variants[k][res].size;
+                next_offset += variants[k][res].size;
+                blobs[nb_blobs++] = (struct iovec) {
+                    .iov_base = variants[k][res].image, .iov_len = variants[k][res].size
+                };
+            }
+        }
+        slots[nb_slots++] = (uint32_t) i;
+    }
+
+    int ret = imgst_pwritev(imgst_file, blobs, nb_blobs, blobs_offset);
+    if(ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: fail to write the images of the batch");
+        for(size_t s = 0; s < nb_slots; ++s) {
+            release_slot(imgst_file, slots[s]);
+        }
+    }
+    uint64_t lsn = 0;
+    if(ret == ERR_NONE && nb_slots > 0) {
+        //the metadata and the header of the whole batch are logged together
+        qsort(slots, nb_slots, sizeof(uint32_t), compare_slots);
+        uint32_t const num_files = imgst_file->header.num_files;
+        uint32_t const version = imgst_file->header.imgst_version;
+        imgst_wal_begin(imgst_file);
+        ret = imgst_wal_end(imgst_file, write_batch_metadata(imgst_file, slots, nb_slots), &lsn);
+        if(ret != ERR_NONE) {
+            //its writes are dropped with the transaction, the memory must agree with the file
+            for(size_t s = 0; s < nb_slots; ++s) {
+                release_slot(imgst_file, slots[s]);
+            }
+            imgst_file->header.num_files = num_files;
+            imgst_file->header.imgst_version = version;
+        }
+    }
+    pthread_rwlock_unlock(&imgst_file->lock);
+    if(ret == ERR_NONE) {
+        ret = imgst_wal_sync(imgst_file, lsn);
+    }
+
+    if(ret != ERR_NONE) {
+        for(size_t k = 0; k < nb_items; ++k) {
+            items[k].result = items[k].result == ERR_NONE ? ret : items[k].result;
+        }
+    }
+    for(size_t k = 0; variants != NULL && k < nb_items; ++k) {
+        free_variants(variants[k]);
+    }
+    free(SHA);
+    free(res_orig);
+    free(slots);
+    free(blobs);
+    free(variants);
+    return ret;
+}
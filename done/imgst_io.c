@@ -0,0 +1,198 @@
+/**
+ * @file imgst_io.c
+ * @brief positional I/O on the file descriptor of an imgst_file
+ */
+
+#include "imgst_io.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // for pread, pwrite, sysconf
+#include <sys/mman.h> // for mmap
+
+#define MIN_MAPPING_SIZE (1 << 20)
+#define MAX_IOV_PER_CALL 1024 // IOV_MAX of Linux, hidden by -std=c11
+
+/** @copybrief */
+int imgst_pread(const struct imgst_file* imgst_file, void* buffer, size_t size, uint64_t offset)
+{
+    if (imgst_file == NULL || (buffer == NULL && size != 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char* position = buffer;
+    while (size > 0) {
+        ssize_t const nb_read = pread(imgst_file->fd, position, size, (off_t) offset);
+        if (nb_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb_read <= 0) { //0 = end of file before the end of the request
+            return ERR_IO;
+        }
+        position += nb_read;
+        offset += (uint64_t) nb_read;
+        size -= (size_t) nb_read;
+    }
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_pwrite(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t offset)
+{
+    if (imgst_file == NULL || (buffer == NULL && size != 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const char* position = buffer;
+    while (size > 0) {
+        ssize_t const nb_written = pwrite(imgst_file->fd, position, size, (off_t) offset);
+        if (nb_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb_written <= 0) {
+            return ERR_IO;
+        }
+        position += nb_written;
+        offset += (uint64_t) nb_written;
+        size -= (size_t) nb_written;
+
+        //keep track of the end of the file for the next appends
+        if (offset > imgst_file->end_offset) {
+            imgst_file->end_offset = offset;
+        }
+    }
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_pwritev(struct imgst_file* imgst_file, const struct iovec* iov, size_t nb_iov, uint64_t offset)
+{
+    if (imgst_file == NULL || (iov == NULL && nb_iov != 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (nb_iov == 0) {
+        return ERR_NONE;
+    }
+
+    //a short write leaves a buffer partly written, so the caller's array is not modified
+    struct iovec* remaining = malloc(nb_iov * sizeof(struct iovec));
+    if (remaining == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(remaining, iov, nb_iov * sizeof(struct iovec));
+
+    size_t first = 0;
+    int ret = ERR_NONE;
+    while (ret == ERR_NONE && first < nb_iov) {
+        int const count = nb_iov - first < MAX_IOV_PER_CALL ? (int) (nb_iov - first) : MAX_IOV_PER_CALL;
+        ssize_t nb_written = pwritev(imgst_file->fd, remaining + first, count, (off_t) offset);
+        if (nb_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb_written < 0 || (nb_written == 0 && remaining[first].iov_len != 0)) {
+            ret = ERR_IO;
+            break;
+        }
+        offset += (uint64_t) nb_written;
+
+        //skip the buffers entirely written, then the written part of the next one
+        while (first < nb_iov && (size_t) nb_written >= remaining[first].iov_len) {
+            nb_written -= (ssize_t) remaining[first].iov_len;
+            ++first;
+        }
+        if (first < nb_iov) {
+            remaining[first].iov_base = (char*) remaining[first].iov_base + nb_written;
+            remaining[first].iov_len -= (size_t) nb_written;
+        }
+    }
+    free(remaining);
+
+    if (offset > imgst_file->end_offset) {
+        imgst_file->end_offset = offset;
+    }
+    return ret;
+}
+
+/** @copybrief */
+int imgst_append(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t* offset)
+{
+    if (imgst_file == NULL || offset == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint64_t const end_offset = imgst_file->end_offset;
+    int const ret = imgst_pwrite(imgst_file, buffer, size, end_offset);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    *offset = end_offset;
+    return ERR_NONE;
+}
+
+/**
+ * maps the file with some room for the images that will be appended,
+ * so that it is not remapped at each insertion
+ * @return error code as defined in error.h
+ */
+static int imgst_map(struct imgst_file* imgst_file, uint64_t min_size)
+{
+    uint64_t size = imgst_file->end_offset + imgst_file->end_offset / 2;
+    size = size < min_size ? min_size : size;
+    size = size < MIN_MAPPING_SIZE ? MIN_MAPPING_SIZE : size;
+    //whole pages, the bytes past the end of the file are never accessed until they are written
+    uint64_t const page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) / page_size * page_size;
+
+    struct imgst_mapping* mapping = malloc(sizeof(struct imgst_mapping));
+    if (mapping == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    void* address = mmap(NULL, size, PROT_READ, MAP_SHARED, imgst_file->fd, 0);
+    if (address == MAP_FAILED) {
+        free(mapping);
+        return ERR_IO;
+    }
+    mapping->address = address;
+    mapping->size = size;
+    mapping->previous = imgst_file->mapping;
+    imgst_file->mapping = mapping;
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_view(struct imgst_file* imgst_file, uint64_t offset, size_t size, const char** view)
+{
+    if (imgst_file == NULL || view == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (offset + size > imgst_file->end_offset) {
+        return ERR_IO;
+    }
+
+    //several readers may need a larger mapping at the same time
+    pthread_mutex_lock(&imgst_file->mapping_lock);
+    int ret = ERR_NONE;
+    if (imgst_file->mapping == NULL || offset + size > imgst_file->mapping->size) {
+        ret = imgst_map(imgst_file, offset + size);
+    }
+    if (ret == ERR_NONE) {
+        *view = imgst_file->mapping->address + offset;
+    }
+    pthread_mutex_unlock(&imgst_file->mapping_lock);
+    return ret;
+}
+
+/** @copybrief */
+void imgst_unmap(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL) {
+        return;
+    }
+    while (imgst_file->mapping != NULL) {
+        struct imgst_mapping* previous = imgst_file->mapping->previous;
+        munmap((void*) imgst_file->mapping->address, imgst_file->mapping->size);
+        free(imgst_file->mapping);
+        imgst_file->mapping = previous;
+    }
+}
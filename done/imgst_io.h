@@ -0,0 +1,79 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h> // for struct iovec
+#include "imgStore.h"
+
+/**
+ * @file imgst_io.h
+ * @brief positional I/O on the file descriptor of an imgst_file.
+ *
+ * None of these functions uses (nor moves) a shared file position, so
+ * reads can be issued by several threads at the same time. Short reads
+ * and writes, and interruptions by signals, are retried until the whole
+ * request is done.
+ */
+
+/**
+ * @brief reads exactly size bytes of the imgStore file, starting at offset
+ *
+ * @param imgst_file
+ * @param buffer where the bytes are stored
+ * @param size number of bytes to read
+ * @param offset position in the file of the first byte
+ * @return ERR_IO if the file is too short or on failure, else ERR_NONE
+ */
+int imgst_pread(const struct imgst_file* imgst_file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief writes exactly size bytes in the imgStore file, starting at offset
+ *
+ * @param imgst_file
+ * @param buffer bytes to write
+ * @param size number of bytes to write
+ * @param offset position in the file of the first byte
+ * @return ERR_IO on failure, else ERR_NONE
+ */
+int imgst_pwrite(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief writes the buffers of iov one after the other in the imgStore file, starting at offset,
+ *        with as few system calls as possible
+ *
+ * @param imgst_file
+ * @param iov buffers to write
+ * @param nb_iov number of buffers
+ * @param offset position in the file of the first byte
+ * @return ERR_IO on failure, else ERR_NONE
+ */
+int imgst_pwritev(struct imgst_file* imgst_file, const struct iovec* iov, size_t nb_iov, uint64_t offset);
+
+/**
+ * @brief writes size bytes at the end of the imgStore file
+ *
+ * @param imgst_file
+ * @param buffer bytes to write
+ * @param size number of bytes to write
+ * @param offset output, position in the file where the bytes were written
+ * @return ERR_IO on failure, else ERR_NONE
+ */
+int imgst_append(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t* offset);
+
+/**
+ * @brief gives a pointer to size bytes of the imgStore file, starting at offset,
+ *        through a read-only mapping of the file (created or enlarged if needed)
+ *
+ * @param imgst_file
+ * @param offset position in the file of the first byte
+ * @param size number of bytes that will be accessed
+ * @param view output, pointer to the byte at offset, valid until imgst_unmap
+ * @return ERR_IO if the bytes are not in the file or on failure, else ERR_NONE
+ */
+int imgst_view(struct imgst_file* imgst_file, uint64_t offset, size_t size, const char** view);
+
+/**
+ * @brief removes every mapping of the imgStore file, which invalidates all the views
+ *
+ * @param imgst_file
+ */
+void imgst_unmap(struct imgst_file* imgst_file);
@@ -3,8 +3,11 @@
  */
 
 #include "imgStore.h"
+#include "imgst_index.h"
 #include "error.h"
 #include <stdbool.h>
+#include <stdlib.h> // for calloc
+#include <string.h> // for memcpy
 #include <json-c/json.h>
 
 #define FORMAT_ERR_STR "unimplemented do_list output mode"
@@ -23,62 +26,166 @@ char* do_list_stdout(const struct imgst_file* imgst_file)
         printf("<< empty imgStore >>\n");
     } else {
         //print metadata of all images (only valid ones)
-        for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
-            if (imgst_file->metadata[i].is_valid != EMPTY) {
-                print_metadata(&imgst_file->metadata[i]);
-            }
+        for (uint32_t i = imgst_index_next_valid(imgst_file, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgst_file, i + 1)) {
+            print_metadata(&imgst_file->metadata[i]);
         }
     }
     return NULL; //always return NULL
 }
 
+/**
+ * serializes object once, then frees it
+ * @param len output (if not NULL), length of the string
+ * @return the JSON string of object (to free), NULL if out of memory
+ */
+static char* serialize(struct json_object* object, size_t* len)
+{
+    size_t json_len = 0;
+    //the string belongs to object and is freed with it
+    const char* json = json_object_to_json_string_length(object, JSON_C_TO_STRING_SPACED, &json_len);
+    char* output_string = json == NULL ? NULL : calloc(1, json_len + 1);
+    if(output_string != NULL) {
+        memcpy(output_string, json, json_len);
+    }
+    if(len != NULL) {
+        *len = json_len;
+    }
+    json_object_put(object);
+    return output_string;
+}
+
 /**
  * helper method to do_list in case of json format
+ * @param len output, length of the list
+ * @return the list of the valid images (to free), NULL if out of memory
  */
-char* do_list_json(const struct imgst_file* imgst_file)
+static char* do_list_json(const struct imgst_file* imgst_file, size_t* len)
 {
     if (imgst_file == NULL || imgst_file->metadata == NULL ) {
         return NULL;
     }
 
     struct json_object* array = json_object_new_array();
-    for(size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        if(imgst_file->metadata[i].is_valid) {
-            struct json_object*  img_id = json_object_new_string(imgst_file->metadata[i].img_id);
-            json_object_array_add(array, img_id);
-        }
+    if(array == NULL) return NULL;
+    for(uint32_t i = imgst_index_next_valid(imgst_file, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgst_file, i + 1)) {
+        struct json_object*  img_id = json_object_new_string(imgst_file->metadata[i].img_id);
+        json_object_array_add(array, img_id);
     }
     struct json_object* top_level = json_object_new_object();
-    if(json_object_object_add(top_level, "Images", array) != 0) return "ERROR: impossible to build json_object from database";
+    if(top_level == NULL || json_object_object_add(top_level, "Images", array) != 0) {
+        json_object_put(array);
+        json_object_put(top_level);
+        return NULL;
+    }
 
-    //can't simply return the string, will become garbage after top_level object will have been
-    //collected as soon as we quit this function
-    size_t len = strlen(json_object_to_json_string(top_level));
+    return serialize(top_level, len);
+}
+
+/** @copybrief */
+char* do_list_page(struct imgst_file* imgst_file, const char* prefix, const char* cursor, uint32_t limit)
+{
+    if(imgst_file == NULL || prefix == NULL || limit == 0) return NULL;
+    uint32_t* slots = calloc(limit, sizeof(uint32_t));
+    struct json_object* array = json_object_new_array();
+    struct json_object* top_level = json_object_new_object();
+    if(slots == NULL || array == NULL || top_level == NULL) {
+        free(slots);
+        json_object_put(array);
+        json_object_put(top_level);
+        return NULL;
+    }
 
-    char* output_string = calloc(1, len + 1);
+    pthread_rwlock_rdlock(&imgst_file->lock);
+    uint32_t nb_slots = 0;
+    bool const more = imgst_index_page(imgst_file, prefix, cursor, limit, slots, &nb_slots);
+    for(uint32_t k = 0; k < nb_slots; ++k) {
+        json_object_array_add(array, json_object_new_string(imgst_file->metadata[slots[k]].img_id));
+    }
+    //the next page starts after the last id of this one, even if it is deleted meanwhile
+    struct json_object* next = more ? json_object_new_string(imgst_file->metadata[slots[nb_slots - 1]].img_id) : NULL;
+    pthread_rwlock_unlock(&imgst_file->lock);
+    free(slots);
 
-    strncpy(output_string, json_object_to_json_string(top_level), len);
-    return output_string;
+    json_object_object_add(top_level, "Images", array);
+    json_object_object_add(top_level, "next", next);
+    return serialize(top_level, NULL);
+}
+
+/**
+ * @return a copy of the list (to free), NULL if out of memory
+ */
+static char* copy_list(const struct imgst_list_cache* cache)
+{
+    char* copy = calloc(1, cache->len + 1);
+    if(copy != NULL) {
+        memcpy(copy, cache->json, cache->len);
+    }
+    return copy;
+}
+
+/** @copybrief */
+int do_list_json_cached(struct imgst_file* imgst_file, char* sha, char** json)
+{
+    if(imgst_file == NULL || sha == NULL) return ERR_INVALID_ARGUMENT;
+
+    struct imgst_list_cache* cache = &imgst_file->list_cache;
+    int ret = ERR_NONE;
+    pthread_rwlock_rdlock(&imgst_file->lock);
+    pthread_mutex_lock(&cache->lock);
+
+    //the version changes with every insert and delete
+    if(cache->json == NULL || cache->version != imgst_file->header.imgst_version) {
+        size_t len = 0;
+        char* list = do_list_json(imgst_file, &len);
+        if(list == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            free(cache->json);
+            cache->json = list;
+            cache->len = len;
+            cache->version = imgst_file->header.imgst_version;
+            unsigned char SHA[SHA256_DIGEST_LENGTH];
+            SHA256((const unsigned char*) list, len, SHA);
+            sha_to_string(SHA, cache->sha);
+        }
+    }
+
+    if(ret == ERR_NONE) {
+        strncpy(sha, cache->sha, SHA_STRING_LENGTH);
+        if(json != NULL) {
+            *json = copy_list(cache);
+            ret = *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_rwlock_unlock(&imgst_file->lock);
+    return ret;
 }
 
 /** @copybrief */
-char* do_list(const struct imgst_file* imgst_file, enum do_list_mode format)
+char* do_list(struct imgst_file* imgst_file, enum do_list_mode format)
 {
     if(imgst_file == NULL) return NULL;
 
+    if(format == JSON) {
+        char sha[SHA_STRING_LENGTH];
+        char* json = NULL;
+        return do_list_json_cached(imgst_file, sha, &json) == ERR_NONE ? json : NULL;
+    }
+
     char* s = NULL;
+    pthread_rwlock_rdlock(&imgst_file->lock);
 
     switch(format) {
     case STDOUT: s =  do_list_stdout(imgst_file); break;
-    case JSON  : s =  do_list_json(imgst_file);   break;
     default    : {
         size_t len = strlen(FORMAT_ERR_STR);
         s = calloc(1, len + 1);
-        if (s == NULL) return NULL;
+        if (s == NULL) break;
         strncpy(s, FORMAT_ERR_STR, len);
         s[len] = '\0';
     }
     }
+    pthread_rwlock_unlock(&imgst_file->lock);
     return s;
 }
-
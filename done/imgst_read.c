@@ -1,6 +1,86 @@
 #include <stdlib.h>
+#include <string.h> // for memcpy
 #include "imgStore.h"
-#include "image_content.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_resize.h"
+
+/**
+ * helper method of the readers: finds the image and copies the positions
+ * of all its resolutions, under the shared lock
+ * @param img_id
+ * @param imgst_file
+ * @param index output, slot of the image
+ * @param offset output, positions of the resolutions of the image in the file
+ * @param size output, sizes of the resolutions (0 if it does not exist yet)
+ * @param version output (if not NULL), generation and content of the image in its slot
+ * @return error code as defined in error.h
+ */
+static int find_locations(const char* img_id, struct imgst_file* imgst_file,
+                          uint32_t* index, uint64_t offset[NB_RES], uint32_t size[NB_RES], struct image_version* version)
+{
+    pthread_rwlock_rdlock(&imgst_file->lock);
+    if(imgst_file->header.num_files == 0) {
+        pthread_rwlock_unlock(&imgst_file->lock);
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    // find the valid image with image id equal img_id
+    int err_find = imgst_index_find_id(imgst_file, img_id, index);
+    if(err_find == ERR_NONE) {
+        for(int res = 0; res < NB_RES; ++res) {
+            offset[res] = imgst_file->columns.offset[*index][res];
+            size[res] = imgst_file->columns.size[*index][res];
+        }
+        if(version != NULL) {
+            version->index = *index;
+            version->generation = imgst_file->columns.generation[*index];
+            memcpy(version->SHA, imgst_file->metadata[*index].SHA, SHA256_DIGEST_LENGTH);
+        }
+    }
+    pthread_rwlock_unlock(&imgst_file->lock);
+    return err_find;
+}
+
+/**
+ * helper method of do_read and do_read_view: finds the image and creates its
+ * resolution if it does not exist yet
+ *
+ * The image is looked up under the shared lock; a missing resolution is
+ * created by imgst_resize, once for all the readers missing it.
+ * @param img_id
+ * @param resolution
+ * @param imgst_file
+ * @param offset output, position of the image in the file
+ * @param size output, size of the image
+ * @return error code as defined in error.h
+ */
+static int find_and_resize(const char* img_id, const int resolution, struct imgst_file* imgst_file,
+                           uint64_t* offset, uint32_t* size)
+{
+    for(;;) {
+        uint32_t i = 0;
+        uint64_t offsets[NB_RES];
+        uint32_t sizes[NB_RES];
+        int err_find = find_locations(img_id, imgst_file, &i, offsets, sizes, NULL);
+        if(err_find != ERR_NONE) {
+            return err_find;
+        }
+
+        // if image already exists in resolution requested there is nothing to do
+        if(sizes[resolution] != 0 && offsets[resolution] != 0) {
+            *offset = offsets[resolution];
+            *size = sizes[resolution];
+            return ERR_NONE;
+        }
+
+        // else create it, then look it up again
+        int err_resize = imgst_resize(imgst_file, img_id, resolution, i, offsets[RES_ORIG], sizes[RES_ORIG]);
+        if(err_resize != ERR_NONE) {
+            return err_resize;
+        }
+    }
+}
 
 /** @copybrief */
 int do_read(const char* img_id, const int resolution, char** image_buffer, uint32_t* image_size, struct imgst_file* imgst_file)
@@ -12,51 +92,114 @@ int do_read(const char* img_id, const int resolution, char** image_buffer, uint3
         return ERR_INVALID_ARGUMENT;
     }
 
-    if(imgst_file->header.num_files == 0) return ERR_FILE_NOT_FOUND;
+    uint64_t offset = 0;
+    int err_find = find_and_resize(img_id, resolution, imgst_file, &offset, image_size);
+    if(err_find != ERR_NONE) {
+        return err_find;
+    }
 
-    // Loop to find valid image with image id equal img_id
-    for (int i = 0; i < imgst_file->header.max_files; i++) {
-        if(imgst_file->metadata[i].is_valid && !strncmp(img_id, imgst_file->metadata[i].img_id, MAX_IMG_ID+1)) {
+    // create pointer in memory to store buffer (entirely overwritten by the read)
+    char* img_buffer = malloc(*image_size);
 
-            // if image does not already exist in resolution requested then resize
-            if (imgst_file->metadata[i].size[resolution] == 0 || imgst_file->metadata[i].offset[resolution] == 0) {
-                int err_resize = lazily_resize(resolution, imgst_file, i);
+    if (img_buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-                if (err_resize != ERR_NONE) {
-                    fprintf(stderr, "ERROR: failed during resizing \n");
-                    return err_resize;
-                }
-            }
+    // reading the image into the img_buffer from imgst_file (images never move, no lock needed)
+    if (imgst_pread(imgst_file, img_buffer, *image_size, offset) != ERR_NONE) {
+        free(img_buffer);
+        fprintf(stderr, "ERROR: fail to read from file to img_buffer");
+        return ERR_IO;
+    }
 
-            *image_size = imgst_file->metadata[i].size[resolution];
+    // affecting the changes
+    *image_buffer = img_buffer;
+    return ERR_NONE;
+}
 
-            // create pointer in memory to store buffer
-            char* img_buffer = calloc(1, *image_size);
+/** @copybrief */
+int do_read_location(const char* img_id, const int resolution, uint64_t* image_offset, uint32_t* image_size, struct imgst_file* imgst_file)
+{
+    if(img_id == NULL || resolution < 0 || resolution >= NB_RES
+       || imgst_file == NULL || imgst_file->metadata == NULL
+       || image_offset == NULL || image_size == NULL) {
+        fprintf(stderr, "ERROR: invalid argument given to do_read_location");
+        return ERR_INVALID_ARGUMENT;
+    }
 
-            if (img_buffer == NULL) {
-                return ERR_OUT_OF_MEMORY;
-            }
+    return find_and_resize(img_id, resolution, imgst_file, image_offset, image_size);
+}
 
-            //moving to the position of the metadata
-            if (fseek(imgst_file->file, imgst_file->metadata[i].offset[resolution], SEEK_SET) !=
-                ERR_NONE) {
-                free(img_buffer);
-                fprintf(stderr, "Error: can't set head reader at the location of the image we want to read");
-                return ERR_IO;
-            }
+/** @copybrief */
+int do_read_view(const char* img_id, const int resolution, const char** image_view, uint32_t* image_size, struct imgst_file* imgst_file)
+{
+    if(image_view == NULL) {
+        fprintf(stderr, "ERROR: invalid argument given to do_read_view");
+        return ERR_INVALID_ARGUMENT;
+    }
 
-            int nb_image_to_read = 1;
-            // writing into the img_buffer from imgst_file
-            if (fread(img_buffer, *image_size, nb_image_to_read, imgst_file->file) != nb_image_to_read) {
-                free(img_buffer);
-                fprintf(stderr, "ERROR: fail to read from file to img_buffer");
-                return ERR_IO;
-            }
+    uint64_t offset = 0;
+    int err_location = do_read_location(img_id, resolution, &offset, image_size, imgst_file);
+    if(err_location != ERR_NONE) {
+        return err_location;
+    }
+
+    // no allocation nor copy: point into the mapping of the file
+    pthread_rwlock_rdlock(&imgst_file->lock);
+    int err_view = imgst_view(imgst_file, offset, *image_size, image_view);
+    pthread_rwlock_unlock(&imgst_file->lock);
+    if(err_view != ERR_NONE) {
+        fprintf(stderr, "ERROR: fail to map the image");
+        return err_view;
+    }
+    return ERR_NONE;
+}
 
-            // affecting the changes
-            *image_buffer = img_buffer;
+/** @copybrief */
+int do_read_available(const char* img_id, const int resolution, enum resize_policy policy, int* served_res,
+                      uint64_t* image_offset, uint32_t* image_size, struct image_version* version,
+                      struct imgst_file* imgst_file)
+{
+    if(img_id == NULL || resolution < 0 || resolution >= NB_RES
+       || imgst_file == NULL || imgst_file->metadata == NULL
+       || served_res == NULL || image_offset == NULL || image_size == NULL) {
+        fprintf(stderr, "ERROR: invalid argument given to do_read_available");
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t i = 0;
+    uint64_t offsets[NB_RES];
+    uint32_t sizes[NB_RES];
+    int err_find = find_locations(img_id, imgst_file, &i, offsets, sizes, version);
+    if(err_find != ERR_NONE) {
+        return err_find;
+    }
+
+    *served_res = resolution;
+    if(sizes[resolution] == 0 || offsets[resolution] == 0) {
+        if(policy == RESIZE_WAIT) {
+            return find_and_resize(img_id, resolution, imgst_file, image_offset, image_size);
+        }
+        int err_queue = imgst_resize_later(imgst_file, img_id, resolution, i, offsets[RES_ORIG], sizes[RES_ORIG]);
+        if(err_queue != ERR_NONE) {
+            return err_queue;
+        }
+
+        // the resolutions go from the smallest to the original, which always exists
+        *served_res = -1;
+        for(int res = resolution + 1; policy == RESIZE_CLOSEST && *served_res == -1 && res < NB_RES; ++res) {
+            if(sizes[res] != 0 && offsets[res] != 0) {
+                *served_res = res;
+            }
+        }
+        if(*served_res == -1) {
+            *image_offset = 0;
+            *image_size = 0;
             return ERR_NONE;
         }
     }
-    return ERR_FILE_NOT_FOUND;
-}
\ No newline at end of file
+
+    *image_offset = offsets[*served_res];
+    *image_size = sizes[*served_res];
+    return ERR_NONE;
+}
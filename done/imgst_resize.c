@@ -0,0 +1,320 @@
+/**
+ * @file imgst_resize.c
+ * @brief single-flight creation of the missing resolutions of the images
+ */
+
+#include "imgst_resize.h"
+#include "image_content.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
+
+#include <stdlib.h>
+#include <string.h> // for strncpy
+
+/**
+ * stores the variants made, unless the image was replaced meanwhile,
+ * skipping the ones stored by someone else
+ * @return error code as defined in error.h
+ */
+static int store_if_unchanged(struct imgst_file* imgst_file, const char* img_id, uint32_t index, uint64_t orig_offset,
+                              const struct variant variants[NB_VARIANTS])
+{
+    uint32_t i = 0;
+    int err_find = imgst_index_find_id(imgst_file, img_id, &i);
+    if(err_find != ERR_NONE) {
+        return err_find;
+    }
+    if(i != index || imgst_file->columns.offset[i][RES_ORIG] != orig_offset) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    bool stored = false;
+    for(int res = 0; res < NB_VARIANTS; ++res) {
+        if(variants[res].image == NULL || imgst_file->columns.size[i][res] != 0) {
+            continue;
+        }
+        if(imgst_append(imgst_file, variants[res].image, variants[res].size, &imgst_file->metadata[i].offset[res]) != ERR_NONE) {
+            fprintf(stderr, "ERROR: can't write resized");
+            return ERR_IO;
+        }
+        imgst_file->metadata[i].size[res] = variants[res].size;
+        stored = true;
+    }
+    //all the variants in one metadata write
+    return stored ? write_metadata(imgst_file, i) : ERR_NONE;
+}
+
+/**
+ * resizes the image without any lock, then stores it holding imgst_file->lock alone;
+ * the other missing variants are made from the same decode of the original,
+ * unless the thumbnail is taken from the EXIF data and nothing has to be decoded
+ * @return error code as defined in error.h
+ */
+static int resize_and_store(struct imgst_file* imgst_file, const char* img_id, int res,
+                            uint32_t index, uint64_t orig_offset, uint32_t orig_size)
+{
+    bool wanted[NB_VARIANTS] = {false};
+    pthread_rwlock_rdlock(&imgst_file->lock);
+    bool const same_image = index < imgst_file->header.max_files &&
+                            imgst_file->columns.offset[index][RES_ORIG] == orig_offset;
+    //the small image would decode the original the embedded thumbnail spares, it is left to its own request
+    bool const exif_thumb = res == RES_THUMB && (imgst_file->header.flags & IMGST_EXIF_THUMBS);
+    for(int other = 0; other < NB_VARIANTS; ++other) {
+        wanted[other] = other == res || (same_image && !exif_thumb && imgst_file->columns.size[index][other] == 0);
+    }
+    pthread_rwlock_unlock(&imgst_file->lock);
+
+    struct variant variants[NB_VARIANTS];
+    int ret = resize_image(imgst_file, orig_offset, orig_size, wanted, variants);
+    if(ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: failed during resizing \n");
+        return ret;
+    }
+
+    //logged while the imgStore is ours, waited for once it is released (as do_insert)
+    uint64_t lsn = 0;
+    pthread_rwlock_wrlock(&imgst_file->lock);
+    imgst_wal_begin(imgst_file);
+    ret = imgst_wal_end(imgst_file, store_if_unchanged(imgst_file, img_id, index, orig_offset, variants), &lsn);
+    pthread_rwlock_unlock(&imgst_file->lock);
+    free_variants(variants);
+    return ret != ERR_NONE ? ret : imgst_wal_sync(imgst_file, lsn);
+}
+
+/**
+ * @return the flight of the resolution res of the image at index, NULL if none (under resizer->lock)
+ */
+static struct resize_flight* find_flight(const struct imgst_resizer* resizer, uint32_t index, int res, uint64_t orig_offset)
+{
+    for(struct resize_flight* flight = resizer->flights; flight != NULL; flight = flight->next) {
+        if(flight->index == index && flight->res == res && flight->orig_offset == orig_offset) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return whether a job of the resolution res of the image at index is queued (under resizer->lock)
+ */
+static bool is_queued(const struct imgst_resizer* resizer, uint32_t index, int res, uint64_t orig_offset)
+{
+    for(const struct resize_job* job = resizer->first_job; job != NULL; job = job->next) {
+        if(job->index == index && job->res == res && job->orig_offset == orig_offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * background thread: does the queued resizes until the resizer stops
+ */
+static void* resizer_main(void* arg)
+{
+    struct imgst_file* imgst_file = arg;
+    struct imgst_resizer* resizer = imgst_file->resizer;
+
+    pthread_mutex_lock(&resizer->lock);
+    for(;;) {
+        while(resizer->first_job == NULL && !resizer->stopping) {
+            pthread_cond_wait(&resizer->job_ready, &resizer->lock);
+        }
+        if(resizer->stopping) {
+            break;
+        }
+        struct resize_job* job = resizer->first_job;
+        resizer->first_job = job->next;
+        if(resizer->first_job == NULL) {
+            resizer->last_job = NULL;
+        }
+        pthread_mutex_unlock(&resizer->lock);
+
+        //the reader asking for it meanwhile joins this flight
+        int const ret = imgst_resize(imgst_file, job->img_id, job->res, job->index, job->orig_offset, job->orig_size);
+        if(ret != ERR_NONE && ret != ERR_FILE_NOT_FOUND) {
+            fprintf(stderr, "ERROR: background resize of %s failed: %s\n", job->img_id, ERR_MESSAGES[ret]);
+        }
+        free(job);
+
+        pthread_mutex_lock(&resizer->lock);
+    }
+    pthread_mutex_unlock(&resizer->lock);
+    return NULL;
+}
+
+/**
+ * takes the flight out of the list of the resizer (under resizer->lock)
+ */
+static void unlink_flight(struct imgst_resizer* resizer, const struct resize_flight* flight)
+{
+    for(struct resize_flight** link = &resizer->flights; *link != NULL; link = &(*link)->next) {
+        if(*link == flight) {
+            *link = flight->next;
+            return;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int imgst_resizer_open(struct imgst_file* imgst_file)
+{
+    if(imgst_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_resizer* resizer = calloc(1, sizeof(struct imgst_resizer));
+    if(resizer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&resizer->lock, NULL);
+    pthread_cond_init(&resizer->flight_done, NULL);
+    pthread_cond_init(&resizer->job_ready, NULL);
+    imgst_file->resizer = resizer;
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_resizer_start(struct imgst_file* imgst_file, size_t nb_threads)
+{
+    if(imgst_file == NULL || imgst_file->resizer == NULL || nb_threads == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_resizer* resizer = imgst_file->resizer;
+    if(resizer->threads != NULL) {
+        return ERR_INVALID_ARGUMENT; //already started
+    }
+    resizer->threads = calloc(nb_threads, sizeof(pthread_t));
+    if(resizer->threads == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    while(resizer->nb_threads < nb_threads &&
+          pthread_create(&resizer->threads[resizer->nb_threads], NULL, resizer_main, imgst_file) == 0) {
+        ++resizer->nb_threads;
+    }
+    return resizer->nb_threads > 0 ? ERR_NONE : ERR_IO;
+}
+
+/** @copybrief */
+void imgst_resizer_close(struct imgst_file* imgst_file)
+{
+    if(imgst_file == NULL || imgst_file->resizer == NULL) {
+        return;
+    }
+    struct imgst_resizer* resizer = imgst_file->resizer;
+
+    pthread_mutex_lock(&resizer->lock);
+    resizer->stopping = true;
+    pthread_cond_broadcast(&resizer->job_ready);
+    pthread_mutex_unlock(&resizer->lock);
+    for(size_t i = 0; i < resizer->nb_threads; ++i) {
+        pthread_join(resizer->threads[i], NULL);
+    }
+    free(resizer->threads);
+
+    //the queued resizes are dropped, the readers will ask for them again
+    while(resizer->first_job != NULL) {
+        struct resize_job* next = resizer->first_job->next;
+        free(resizer->first_job);
+        resizer->first_job = next;
+    }
+    pthread_mutex_destroy(&resizer->lock);
+    pthread_cond_destroy(&resizer->flight_done);
+    pthread_cond_destroy(&resizer->job_ready);
+    free(resizer);
+    imgst_file->resizer = NULL;
+}
+
+/** @copybrief */
+int imgst_resize(struct imgst_file* imgst_file, const char* img_id, int res,
+                 uint32_t index, uint64_t orig_offset, uint32_t orig_size)
+{
+    if(imgst_file == NULL || img_id == NULL || (res != RES_THUMB && res != RES_SMALL)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_resizer* resizer = imgst_file->resizer;
+    if(resizer == NULL) {
+        return resize_and_store(imgst_file, img_id, res, index, orig_offset, orig_size);
+    }
+
+    pthread_mutex_lock(&resizer->lock);
+    struct resize_flight* flight = find_flight(resizer, index, res, orig_offset);
+    if(flight != NULL) {
+        //someone is already resizing it, its result is ours
+        ++flight->nb_waiters;
+        while(!flight->done) {
+            pthread_cond_wait(&resizer->flight_done, &resizer->lock);
+        }
+        int const result = flight->result;
+        if(--flight->nb_waiters == 0) {
+            free(flight);
+        }
+        pthread_mutex_unlock(&resizer->lock);
+        return result;
+    }
+
+    flight = calloc(1, sizeof(struct resize_flight));
+    if(flight == NULL) {
+        pthread_mutex_unlock(&resizer->lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+    flight->index = index;
+    flight->res = res;
+    flight->orig_offset = orig_offset;
+    flight->next = resizer->flights;
+    resizer->flights = flight;
+    pthread_mutex_unlock(&resizer->lock);
+
+    int const result = resize_and_store(imgst_file, img_id, res, index, orig_offset, orig_size);
+
+    pthread_mutex_lock(&resizer->lock);
+    unlink_flight(resizer, flight);
+    flight->result = result;
+    flight->done = true;
+    if(flight->nb_waiters == 0) {
+        free(flight);
+    } else {
+        pthread_cond_broadcast(&resizer->flight_done);
+    }
+    pthread_mutex_unlock(&resizer->lock);
+    return result;
+}
+
+/** @copybrief */
+int imgst_resize_later(struct imgst_file* imgst_file, const char* img_id, int res,
+                       uint32_t index, uint64_t orig_offset, uint32_t orig_size)
+{
+    if(imgst_file == NULL || img_id == NULL || (res != RES_THUMB && res != RES_SMALL)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_resizer* resizer = imgst_file->resizer;
+    if(resizer == NULL || resizer->nb_threads == 0) {
+        return imgst_resize(imgst_file, img_id, res, index, orig_offset, orig_size);
+    }
+
+    pthread_mutex_lock(&resizer->lock);
+    if(find_flight(resizer, index, res, orig_offset) != NULL || is_queued(resizer, index, res, orig_offset)) {
+        pthread_mutex_unlock(&resizer->lock);
+        return ERR_NONE;
+    }
+    struct resize_job* job = calloc(1, sizeof(struct resize_job));
+    if(job == NULL) {
+        pthread_mutex_unlock(&resizer->lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+    strncpy(job->img_id, img_id, MAX_IMG_ID);
+    job->res = res;
+    job->index = index;
+    job->orig_offset = orig_offset;
+    job->orig_size = orig_size;
+    if(resizer->last_job == NULL) {
+        resizer->first_job = job;
+    } else {
+        resizer->last_job->next = job;
+    }
+    resizer->last_job = job;
+    pthread_cond_signal(&resizer->job_ready);
+    pthread_mutex_unlock(&resizer->lock);
+    return ERR_NONE;
+}
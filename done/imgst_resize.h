@@ -0,0 +1,114 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "imgStore.h"
+
+/**
+ * @file imgst_resize.h
+ * @brief creation of the missing resolutions of the images, shared by concurrent readers.
+ *
+ * When several readers miss the same resolution of the same image at the
+ * same time (typically the thumbnails of a freshly listed image), only the
+ * first one decodes, resizes and appends it; the others wait for its
+ * result instead of storing copies nobody would ever reference.
+ *
+ * Readers that do not want to wait can also leave the resize to
+ * background threads (imgst_resizer_start, imgst_resize_later).
+ */
+
+/**
+ * @brief a resize being done for one resolution of the image of one slot
+ */
+struct resize_flight {
+    uint32_t index; // slot of the image
+    int res;
+    uint64_t orig_offset; // tells a replaced image in the same slot apart
+    int result; // set by the resizer once done
+    bool done;
+    uint32_t nb_waiters; // readers waiting for result, the last one frees the flight
+    struct resize_flight* next;
+};
+
+/**
+ * @brief a resize left to the background threads
+ */
+struct resize_job {
+    char img_id[MAX_IMG_ID + 1];
+    int res;
+    uint32_t index;
+    uint64_t orig_offset;
+    uint32_t orig_size;
+    struct resize_job* next;
+};
+
+/**
+ * @brief the resizes in flight of an imgst_file, and its background threads
+ */
+struct imgst_resizer {
+    pthread_mutex_t lock;
+    pthread_cond_t flight_done;
+    struct resize_flight* flights;
+
+    //background resizes, FIFO
+    pthread_cond_t job_ready;
+    struct resize_job* first_job;
+    struct resize_job* last_job;
+    bool stopping;
+    pthread_t* threads;
+    size_t nb_threads;
+};
+
+/**
+ * @brief sets up the resizer of imgst_file
+ *
+ * @param imgst_file
+ * @return Some error code. 0 if no error.
+ */
+int imgst_resizer_open(struct imgst_file* imgst_file);
+
+/**
+ * @brief starts the background threads of the resizer of imgst_file
+ *
+ * @param imgst_file
+ * @param nb_threads number of threads to start
+ * @return Some error code. 0 if no error (at least one thread started).
+ */
+int imgst_resizer_start(struct imgst_file* imgst_file, size_t nb_threads);
+
+/**
+ * @brief releases the resizer of imgst_file: stops its background threads (their queued
+ *        resizes are dropped), no other resize may be in flight (no-op without resizer)
+ *
+ * @param imgst_file
+ */
+void imgst_resizer_close(struct imgst_file* imgst_file);
+
+/**
+ * @brief creates the resolution res of the image img_id, found at index with its
+ *        original at orig_offset, or waits for the reader already creating it
+ *
+ * Must be called without holding imgst_file->lock: the resizing is done
+ * without it, only storing the result takes it.
+ *
+ * @param imgst_file
+ * @param img_id of the image
+ * @param res the missing resolution
+ * @param index slot of the image
+ * @param orig_offset position of the original image in the file
+ * @param orig_size size of the original image
+ * @return ERR_NONE once the resolution is stored, ERR_FILE_NOT_FOUND if the image was deleted meanwhile
+ */
+int imgst_resize(struct imgst_file* imgst_file, const char* img_id, int res,
+                 uint32_t index, uint64_t orig_offset, uint32_t orig_size);
+
+/**
+ * @brief queues the creation of the resolution res of the image img_id for the background
+ *        threads, unless it is already queued or in flight (same parameters as imgst_resize)
+ *
+ * Without background thread, the resolution is created right away.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgst_resize_later(struct imgst_file* imgst_file, const char* img_id, int res,
+                       uint32_t index, uint64_t orig_offset, uint32_t orig_size);
@@ -0,0 +1,278 @@
+/**
+ * @file imgst_ring.c
+ * @brief asynchronous reads of the imgStore file with io_uring
+ *
+ * The ring is driven by the raw system calls (no liburing), the memory
+ * ordering of the shared indexes follows io_uring(7).
+ */
+
+#include "imgst_ring.h"
+#include "imgst_io.h"
+
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> // for syscall, close
+#include <sys/mman.h> // for mmap
+#include <sys/syscall.h> // for __NR_io_uring_*
+
+#define MIN_DONE_CAPACITY 16
+
+/**
+ * wraps the io_uring_setup system call
+ */
+static int ring_setup(uint32_t nb_entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, nb_entries, params);
+}
+
+/**
+ * wraps the io_uring_enter system call
+ */
+static int ring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * wraps the io_uring_register system call
+ */
+static int ring_register(int fd, uint32_t opcode, const void* arg, uint32_t nb_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nb_args);
+}
+
+/**
+ * unmaps the queues and closes the ring, the ring is in synchronous mode afterwards
+ */
+static void ring_unmap(struct imgst_ring* ring)
+{
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring != NULL) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->sq_ring = NULL;
+    ring->cq_ring = NULL;
+    ring->sqes = NULL;
+    ring->fd = -1;
+}
+
+/**
+ * maps one of the areas shared with the kernel
+ * @return the address of the area, NULL on failure
+ */
+static void* ring_map(int fd, size_t size, off_t area)
+{
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, area);
+    return address == MAP_FAILED ? NULL : address;
+}
+
+/**
+ * does the read right away and queues its completion
+ * @return error code as defined in error.h
+ */
+static int read_now(struct imgst_ring* ring, const struct imgst_file* imgst_file,
+                    void* buffer, uint32_t size, uint64_t offset, uint64_t user_data)
+{
+    if (ring->nb_done == ring->done_capacity) {
+        size_t const capacity = ring->done_capacity == 0 ? MIN_DONE_CAPACITY : 2 * ring->done_capacity;
+        struct imgst_ring_completion* done = realloc(ring->done, capacity * sizeof(struct imgst_ring_completion));
+        if (done == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        ring->done = done;
+        ring->done_capacity = capacity;
+    }
+
+    int const ret = imgst_pread(imgst_file, buffer, size, offset);
+    ring->done[ring->nb_done].user_data = user_data;
+    ring->done[ring->nb_done].result = ret == ERR_NONE ? (int) size : -1;
+    ++ring->nb_done;
+    return ERR_NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int imgst_ring_init(struct imgst_ring* ring, uint32_t nb_entries)
+{
+    if (ring == NULL || nb_entries == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(ring, 0, sizeof(struct imgst_ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = ring_setup(nb_entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return ERR_NONE; //synchronous mode
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = ring_map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring_map(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        ring_unmap(ring);
+        return ERR_NONE; //synchronous mode
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (uint32_t*) (sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (uint32_t*) (cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*) (cq + params.cq_off.ring_mask);
+    ring->cq_entries = params.cq_entries;
+    ring->cqes = cq + params.cq_off.cqes;
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_ring_notify(struct imgst_ring* ring, int event_fd)
+{
+    if (ring == NULL || event_fd < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (ring->fd < 0) {
+        return ERR_NONE;
+    }
+    return ring_register(ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0 ? ERR_IO : ERR_NONE;
+}
+
+/** @copybrief */
+void imgst_ring_close(struct imgst_ring* ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+    ring_unmap(ring);
+    free(ring->done);
+    ring->done = NULL;
+    ring->nb_done = 0;
+    ring->done_capacity = 0;
+    ring->nb_in_flight = 0;
+    ring->nb_to_submit = 0;
+}
+
+/** @copybrief */
+int imgst_ring_read(struct imgst_ring* ring, const struct imgst_file* imgst_file,
+                    void* buffer, uint32_t size, uint64_t offset, uint64_t user_data)
+{
+    if (ring == NULL || imgst_file == NULL || (buffer == NULL && size != 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (ring->fd < 0) {
+        return read_now(ring, imgst_file, buffer, size, offset, user_data);
+    }
+
+    //a full submission queue is flushed first
+    uint32_t tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        imgst_ring_submit(ring);
+        tail = *ring->sq_tail;
+    }
+    //never have more reads in the kernel than room for their completions
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries ||
+        ring->nb_in_flight + ring->nb_to_submit >= ring->cq_entries) {
+        return read_now(ring, imgst_file, buffer, size, offset, user_data);
+    }
+
+    uint32_t const index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) ring->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = imgst_file->fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = size;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    //the kernel must see the entry before the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->nb_to_submit;
+    return ERR_NONE;
+}
+
+/** @copybrief */
+int imgst_ring_submit(struct imgst_ring* ring)
+{
+    if (ring == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    while (ring->fd >= 0 && ring->nb_to_submit > 0) {
+        int const nb_submitted = ring_enter(ring->fd, ring->nb_to_submit, 0, 0);
+        if (nb_submitted < 0) {
+            return ERR_IO;
+        }
+        ring->nb_to_submit -= (uint32_t) nb_submitted;
+        ring->nb_in_flight += (uint32_t) nb_submitted;
+    }
+    return ERR_NONE;
+}
+
+/** @copybrief */
+size_t imgst_ring_reap(struct imgst_ring* ring, struct imgst_ring_completion* completions, size_t max_completions)
+{
+    if (ring == NULL || completions == NULL) {
+        return 0;
+    }
+
+    //the synchronous reads first, they are already done
+    size_t nb_reaped = ring->nb_done < max_completions ? ring->nb_done : max_completions;
+    memcpy(completions, ring->done, nb_reaped * sizeof(struct imgst_ring_completion));
+    memmove(ring->done, ring->done + nb_reaped, (ring->nb_done - nb_reaped) * sizeof(struct imgst_ring_completion));
+    ring->nb_done -= nb_reaped;
+
+    if (ring->fd < 0) {
+        return nb_reaped;
+    }
+    uint32_t head = *ring->cq_head;
+    uint32_t const tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && nb_reaped < max_completions) {
+        const struct io_uring_cqe* cqe = (const struct io_uring_cqe*) ring->cqes + (head & ring->cq_mask);
+        completions[nb_reaped].user_data = cqe->user_data;
+        completions[nb_reaped].result = cqe->res;
+        ++nb_reaped;
+        ++head;
+        --ring->nb_in_flight;
+    }
+    //gives the entries back to the kernel
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return nb_reaped;
+}
+
+/** @copybrief */
+size_t imgst_ring_pending(const struct imgst_ring* ring)
+{
+    return ring == NULL ? 0 : ring->nb_done + ring->nb_in_flight + ring->nb_to_submit;
+}
+
+/** @copybrief */
+int imgst_ring_wait(struct imgst_ring* ring)
+{
+    if (ring == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (imgst_ring_submit(ring) != ERR_NONE) {
+        return ERR_IO;
+    }
+    //nothing to wait for if a completion is ready, or if no read is in the kernel
+    if (ring->fd < 0 || ring->nb_done > 0 || ring->nb_in_flight == 0) {
+        return ERR_NONE;
+    }
+    int ret = 0;
+    do {
+        ret = ring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? ERR_IO : ERR_NONE;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "imgStore.h"
+
+/**
+ * @file imgst_ring.h
+ * @brief asynchronous reads of the imgStore file with io_uring.
+ *
+ * An event loop submits the reads of many requests at once and reaps
+ * their completions later, without blocking in the kernel while the
+ * device works. When io_uring is not available (old kernel, seccomp, ...)
+ * every read is done synchronously by imgst_pread at submission and its
+ * completion is simply queued, so that the caller has a single code path.
+ */
+
+/**
+ * @brief result of a read, identified by the user_data given at submission
+ */
+struct imgst_ring_completion {
+    uint64_t user_data;
+    int result; // number of bytes read, or -errno on failure
+};
+
+/**
+ * @brief an io_uring instance (fd == -1 in synchronous mode)
+ */
+struct imgst_ring {
+    int fd;
+    uint32_t nb_in_flight; // submitted to the kernel and not reaped yet
+
+    //submission queue, shared with the kernel
+    void* sq_ring;
+    size_t sq_ring_size;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t sq_entries;
+    void* sqes;
+    size_t sqes_size;
+    uint32_t nb_to_submit; // filled entries not given to io_uring_enter yet
+
+    //completion queue, shared with the kernel
+    void* cq_ring;
+    size_t cq_ring_size;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    void* cqes;
+
+    //reads done synchronously, waiting to be reaped
+    struct imgst_ring_completion* done;
+    size_t nb_done;
+    size_t done_capacity;
+};
+
+/**
+ * @brief sets up the ring, falls back to synchronous reads if io_uring cannot be used
+ *
+ * @param ring to initialise
+ * @param nb_entries size of the submission queue
+ * @return ERR_NONE, also in synchronous mode
+ */
+int imgst_ring_init(struct imgst_ring* ring, uint32_t nb_entries);
+
+/**
+ * @brief makes the kernel write event_fd (an eventfd) each time a read completes,
+ * so that an event loop can poll it instead of the ring; the reads done
+ * synchronously are not signalled, they are ready to be reaped once submitted
+ *
+ * @param ring
+ * @param event_fd the eventfd to write
+ * @return ERR_IO if it cannot be registered, else ERR_NONE (also in synchronous mode)
+ */
+int imgst_ring_notify(struct imgst_ring* ring, int event_fd);
+
+/**
+ * @brief releases the ring, the reads still in flight are forgotten
+ *
+ * @param ring
+ */
+void imgst_ring_close(struct imgst_ring* ring);
+
+/**
+ * @brief queues the read of size bytes of the imgStore file, starting at offset
+ *
+ * @param ring
+ * @param imgst_file
+ * @param buffer where the bytes are stored, must stay valid until the completion is reaped
+ * @param size number of bytes to read
+ * @param offset position in the file of the first byte
+ * @param user_data given back with the completion
+ * @return some error code, ERR_NONE if the read was queued
+ */
+int imgst_ring_read(struct imgst_ring* ring, const struct imgst_file* imgst_file,
+                    void* buffer, uint32_t size, uint64_t offset, uint64_t user_data);
+
+/**
+ * @brief gives the queued reads to the kernel, without waiting for them
+ *
+ * @param ring
+ * @return ERR_IO on failure, else ERR_NONE
+ */
+int imgst_ring_submit(struct imgst_ring* ring);
+
+/**
+ * @brief collects the finished reads, without waiting
+ *
+ * @param ring
+ * @param completions output array
+ * @param max_completions size of the output array
+ * @return number of completions stored
+ */
+size_t imgst_ring_reap(struct imgst_ring* ring, struct imgst_ring_completion* completions, size_t max_completions);
+
+/**
+ * @brief gives the queued reads to the kernel, and waits until one of the reads can be reaped
+ *
+ * @param ring
+ * @return ERR_IO on failure (the reads in flight may still be running), else ERR_NONE
+ */
+int imgst_ring_wait(struct imgst_ring* ring);
+
+/**
+ * @brief number of reads queued and not reaped yet
+ *
+ * @param ring
+ */
+size_t imgst_ring_pending(const struct imgst_ring* ring);
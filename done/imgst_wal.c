@@ -0,0 +1,533 @@
+/**
+ * @file imgst_wal.c
+ * @brief write-ahead log of the header and metadata writes of an imgStore
+ */
+
+#include "imgst_wal.h"
+#include "imgst_io.h"
+
+#include <errno.h>
+#include <fcntl.h> // for open
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // for pwrite, fdatasync, ftruncate, unlink
+#include <sys/stat.h> // for fstat
+
+#define WAL_MAGIC 0x4c415749 // "IWAL"
+#define WAL_CHECKPOINT_SIZE (4 << 20) // the log is emptied when it grows past 4MB
+#define MIN_TRANSACTION_CAPACITY 1024
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * a record in the log file, followed by nb_writes (wal_write_header, bytes) pairs
+ */
+struct wal_record_header {
+    uint32_t magic;
+    uint32_t nb_writes;
+    uint64_t lsn; // log sequence number, +1 from one record to the next
+    uint64_t payload_size; // bytes following this header
+    uint64_t checksum; // of the header (with checksum = 0) and the payload
+};
+
+struct wal_write_header {
+    uint64_t offset; // position in the imgStore file
+    uint64_t size;
+};
+
+/**
+ * 64 bits FNV-1a hash of a record, detects the torn ones
+ */
+static uint64_t record_checksum(const char* record, size_t size)
+{
+    struct wal_record_header header;
+    memcpy(&header, record, sizeof(header));
+    header.checksum = 0;
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char const byte = i < sizeof(header) ? ((const unsigned char*) &header)[i] : (unsigned char) record[i];
+        hash ^= byte;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * writes exactly size bytes at offset of fd
+ * @return error code as defined in error.h
+ */
+static int write_all(int fd, const char* buffer, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t const nb_written = pwrite(fd, buffer, size, (off_t) offset);
+        if (nb_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb_written <= 0) {
+            return ERR_IO;
+        }
+        buffer += nb_written;
+        offset += (uint64_t) nb_written;
+        size -= (size_t) nb_written;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * copies the part of a write falling in [region_offset, region_offset + region_size) of the file
+ * into region, the in-memory copy of these bytes
+ */
+static void copy_overlap(void* region, uint64_t region_offset, size_t region_size,
+                         const char* bytes, uint64_t offset, uint64_t size)
+{
+    uint64_t const start = offset > region_offset ? offset : region_offset;
+    uint64_t const end = offset + size < region_offset + region_size ? offset + size : region_offset + region_size;
+    if (start < end) {
+        memcpy((char*) region + (start - region_offset), bytes + (start - offset), end - start);
+    }
+}
+
+/**
+ * does the writes of a (valid) record, in memory and/or in the imgStore file
+ * @return error code as defined in error.h
+ */
+static int apply_record(struct imgst_file* imgst_file, const char* record, bool to_memory, bool to_file)
+{
+    struct wal_record_header header;
+    memcpy(&header, record, sizeof(header));
+
+    size_t const metadata_size = imgst_file->header.max_files * sizeof(struct img_metadata);
+    const char* position = record + sizeof(header);
+    for (uint32_t i = 0; i < header.nb_writes; ++i) {
+        struct wal_write_header write;
+        memcpy(&write, position, sizeof(write));
+        position += sizeof(write);
+
+        if (to_memory) {
+            //only the header and the metadata are logged
+            copy_overlap(&imgst_file->header, 0, sizeof(struct imgst_header), position, write.offset, write.size);
+            copy_overlap(imgst_file->metadata, sizeof(struct imgst_header), metadata_size, position, write.offset, write.size);
+        }
+        //not imgst_pwrite: the leader of a group commit writes without the lock of the imgStore
+        if (to_file && write_all(imgst_file->fd, position, write.size, write.offset) != ERR_NONE) {
+            return ERR_IO;
+        }
+        position += write.size;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * checks that the bytes at record (size of them left in the log) start with
+ * a complete record, with a correct checksum, and that its writes fit in it
+ * @return the size of the record, 0 if it is torn or invalid
+ */
+static size_t check_record(const char* record, size_t size)
+{
+    struct wal_record_header header;
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, record, sizeof(header));
+    if (header.magic != WAL_MAGIC || header.payload_size > size - sizeof(header)) {
+        return 0;
+    }
+    size_t const record_size = sizeof(header) + header.payload_size;
+    if (record_checksum(record, record_size) != header.checksum) {
+        return 0;
+    }
+
+    //the writes must exactly fill the payload
+    size_t remaining = header.payload_size;
+    const char* position = record + sizeof(header);
+    for (uint32_t i = 0; i < header.nb_writes; ++i) {
+        struct wal_write_header write;
+        if (remaining < sizeof(write)) {
+            return 0;
+        }
+        memcpy(&write, position, sizeof(write));
+        if (write.size > remaining - sizeof(write)) {
+            return 0;
+        }
+        position += sizeof(write) + write.size;
+        remaining -= sizeof(write) + write.size;
+    }
+    return remaining == 0 ? record_size : 0;
+}
+
+/**
+ * applies the records of the log at fd, up to the first torn one
+ * @param last_lsn output, lsn of the last applied record (0 if none)
+ * @param log_size_out output, size of the log file
+ * @return error code as defined in error.h
+ */
+static int replay(struct imgst_file* imgst_file, int fd, bool writable, uint64_t* last_lsn, uint64_t* log_size_out)
+{
+    *last_lsn = 0;
+    struct stat log_stat;
+    if (fstat(fd, &log_stat) != 0) {
+        return ERR_IO;
+    }
+    size_t const log_size = (size_t) log_stat.st_size;
+    *log_size_out = log_size;
+    if (log_size == 0) {
+        return ERR_NONE;
+    }
+
+    char* log = malloc(log_size);
+    if (log == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_read = 0;
+    while (nb_read < log_size) {
+        ssize_t const ret = pread(fd, log + nb_read, log_size - nb_read, (off_t) nb_read);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            free(log);
+            return ERR_IO;
+        }
+        nb_read += (size_t) ret;
+    }
+
+    size_t position = 0;
+    size_t record_size = 0;
+    int ret = ERR_NONE;
+    while (ret == ERR_NONE && (record_size = check_record(log + position, log_size - position)) > 0) {
+        struct wal_record_header header;
+        memcpy(&header, log + position, sizeof(header));
+        //a record not following the previous one is a leftover of an older log
+        if (*last_lsn != 0 && header.lsn != *last_lsn + 1) {
+            break;
+        }
+        ret = apply_record(imgst_file, log + position, true, writable);
+        *last_lsn = header.lsn;
+        position += record_size;
+    }
+    free(log);
+    return ret;
+}
+
+/**
+ * empties the log, its records must all be in the imgStore file
+ * @return error code as defined in error.h
+ */
+static int checkpoint(struct imgst_file* imgst_file)
+{
+    struct imgst_wal* wal = imgst_file->wal;
+    if (fdatasync(imgst_file->fd) != 0 || ftruncate(wal->fd, 0) != 0) {
+        return ERR_IO;
+    }
+    wal->log_size = 0;
+    return ERR_NONE;
+}
+
+/**
+ * writes the transaction in the log (not synced yet) and queues it for the imgStore file
+ * @param lsn output, lsn of the record
+ * @return error code as defined in error.h
+ */
+static int log_transaction(struct imgst_file* imgst_file, uint64_t* lsn)
+{
+    struct imgst_wal* wal = imgst_file->wal;
+    struct wal_record* record = calloc(1, sizeof(struct wal_record));
+    if (record == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    struct wal_record_header header = {
+        .magic = WAL_MAGIC,
+        .nb_writes = wal->nb_writes,
+        .lsn = wal->next_lsn,
+        .payload_size = wal->transaction_size - sizeof(struct wal_record_header),
+        .checksum = 0
+    };
+    memcpy(wal->transaction, &header, sizeof(header));
+    header.checksum = record_checksum(wal->transaction, wal->transaction_size);
+    memcpy(wal->transaction, &header, sizeof(header));
+
+    if (write_all(wal->fd, wal->transaction, wal->transaction_size, wal->log_size) != ERR_NONE) {
+        pthread_mutex_unlock(&wal->lock);
+        free(record);
+        return ERR_IO;
+    }
+    wal->log_size += wal->transaction_size;
+    ++wal->next_lsn;
+
+    //the record takes the buffer of the transaction
+    record->lsn = header.lsn;
+    record->end_offset = imgst_file->end_offset;
+    record->data = wal->transaction;
+    record->size = wal->transaction_size;
+    wal->transaction = NULL;
+    wal->transaction_capacity = 0;
+    if (wal->pending_last == NULL) {
+        wal->pending = record;
+    } else {
+        wal->pending_last->next = record;
+    }
+    wal->pending_last = record;
+    *lsn = header.lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return ERR_NONE;
+}
+
+/**
+ * waits until the record lsn is durable, syncing the log if no one else does,
+ * then writes the durable records in the imgStore file
+ * @return error code as defined in error.h
+ */
+static int wait_durable(struct imgst_file* imgst_file, uint64_t lsn)
+{
+    struct imgst_wal* wal = imgst_file->wal;
+    int ret = ERR_NONE;
+
+    pthread_mutex_lock(&wal->lock);
+    while (ret == ERR_NONE && wal->synced_lsn <= lsn) {
+        if (wal->syncing) {
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+
+        //leader: syncs everything logged so far
+        wal->syncing = true;
+        uint64_t const target_lsn = wal->next_lsn;
+        uint64_t const end_offset = wal->pending_last != NULL ? wal->pending_last->end_offset : wal->synced_end_offset;
+        pthread_mutex_unlock(&wal->lock);
+
+        //the images must be durable before the records referencing them
+        if (end_offset > wal->synced_end_offset && fdatasync(imgst_file->fd) != 0) {
+            ret = ERR_IO;
+        }
+        if (ret == ERR_NONE && fdatasync(wal->fd) != 0) {
+            ret = ERR_IO;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        if (ret == ERR_NONE) {
+            wal->synced_lsn = target_lsn;
+            if (end_offset > wal->synced_end_offset) {
+                wal->synced_end_offset = end_offset;
+            }
+            //the writes of the durable records can now reach the imgStore file, in order
+            while (ret == ERR_NONE && wal->pending != NULL && wal->pending->lsn < target_lsn) {
+                struct wal_record* record = wal->pending;
+                ret = apply_record(imgst_file, record->data, false, true);
+                wal->pending = record->next;
+                if (wal->pending == NULL) {
+                    wal->pending_last = NULL;
+                }
+                free(record->data);
+                free(record);
+            }
+            if (ret == ERR_NONE && wal->pending == NULL && wal->log_size > WAL_CHECKPOINT_SIZE) {
+                ret = checkpoint(imgst_file);
+            }
+        }
+        wal->syncing = false;
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+/**
+ * @return the name of the log of the imgStore imgst_filename (to free), NULL if out of memory
+ */
+static char* wal_filename(const char* imgst_filename)
+{
+    char* filename = calloc(strlen(imgst_filename) + strlen(WAL_SUFFIX) + 1, sizeof(char));
+    if (filename != NULL) {
+        strcpy(filename, imgst_filename);
+        strcat(filename, WAL_SUFFIX);
+    }
+    return filename;
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int imgst_wal_open(struct imgst_file* imgst_file, const char* imgst_filename, bool writable)
+{
+    if (imgst_file == NULL || imgst_filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    imgst_file->wal = NULL;
+
+    char* filename = wal_filename(imgst_filename);
+    if (filename == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int const fd = writable ? open(filename, O_RDWR | O_CREAT, 0644) : open(filename, O_RDONLY);
+    if (fd < 0) {
+        free(filename);
+        //no log to replay for a read-only imgStore
+        return !writable && errno == ENOENT ? ERR_NONE : ERR_IO;
+    }
+
+    uint64_t last_lsn = 0;
+    uint64_t log_size = 0;
+    int ret = replay(imgst_file, fd, writable, &last_lsn, &log_size);
+    if (ret != ERR_NONE || !writable) {
+        close(fd);
+        free(filename);
+        return ret;
+    }
+
+    struct imgst_wal* wal = calloc(1, sizeof(struct imgst_wal));
+    if (wal == NULL) {
+        close(fd);
+        free(filename);
+        return ERR_OUT_OF_MEMORY;
+    }
+    wal->fd = fd;
+    wal->filename = filename;
+    wal->next_lsn = last_lsn + 1;
+    wal->synced_lsn = wal->next_lsn;
+    wal->synced_end_offset = imgst_file->end_offset;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    imgst_file->wal = wal;
+
+    //the replayed records are in the imgStore file now, the torn one (if any) is dropped
+    if (log_size > 0 && (ret = checkpoint(imgst_file)) != ERR_NONE) {
+        imgst_wal_close(imgst_file);
+    }
+    return ret;
+}
+
+/** @copybrief */
+void imgst_wal_close(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->wal == NULL) {
+        return;
+    }
+    struct imgst_wal* wal = imgst_file->wal;
+
+    //records whose commit failed are still consistent with the metadata in memory
+    if (wal->pending != NULL) {
+        wait_durable(imgst_file, wal->pending_last->lsn);
+    }
+    //once the imgStore file is synced, the log is of no use
+    if (wal->pending == NULL && fdatasync(imgst_file->fd) == 0) {
+        unlink(wal->filename);
+    }
+
+    while (wal->pending != NULL) {
+        struct wal_record* record = wal->pending;
+        wal->pending = record->next;
+        free(record->data);
+        free(record);
+    }
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->transaction);
+    free(wal->filename);
+    free(wal);
+    imgst_file->wal = NULL;
+}
+
+/** @copybrief */
+void imgst_wal_remove(const char* imgst_filename)
+{
+    char* filename = imgst_filename == NULL ? NULL : wal_filename(imgst_filename);
+    if (filename != NULL) {
+        unlink(filename);
+        free(filename);
+    }
+}
+
+/** @copybrief */
+void imgst_wal_begin(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->wal == NULL) {
+        return;
+    }
+    //room for the header of the record, filled when it is logged
+    imgst_file->wal->in_transaction = true;
+    imgst_file->wal->transaction_size = sizeof(struct wal_record_header);
+    imgst_file->wal->nb_writes = 0;
+}
+
+/** @copybrief */
+int imgst_wal_end(struct imgst_file* imgst_file, int ret, uint64_t* lsn)
+{
+    if (lsn != NULL) {
+        *lsn = 0;
+    }
+    if (imgst_file == NULL || imgst_file->wal == NULL || !imgst_file->wal->in_transaction) {
+        return ret;
+    }
+    imgst_file->wal->in_transaction = false;
+    if (ret != ERR_NONE || imgst_file->wal->nb_writes == 0) {
+        return ret;
+    }
+
+    uint64_t record_lsn = 0;
+    ret = log_transaction(imgst_file, &record_lsn);
+    if (ret == ERR_NONE && lsn != NULL) {
+        *lsn = record_lsn;
+    }
+    return ret;
+}
+
+/** @copybrief */
+int imgst_wal_sync(struct imgst_file* imgst_file, uint64_t lsn)
+{
+    if (imgst_file == NULL || imgst_file->wal == NULL || lsn == 0) {
+        return ERR_NONE;
+    }
+    return wait_durable(imgst_file, lsn);
+}
+
+/** @copybrief */
+int imgst_wal_write(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t offset)
+{
+    if (imgst_file == NULL || buffer == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_wal* wal = imgst_file->wal;
+    if (wal == NULL) {
+        return imgst_pwrite(imgst_file, buffer, size, offset);
+    }
+
+    //a write out of a transaction is a transaction of its own
+    bool const single = !wal->in_transaction;
+    if (single) {
+        imgst_wal_begin(imgst_file);
+    }
+
+    size_t const needed = wal->transaction_size + sizeof(struct wal_write_header) + size;
+    if (needed > wal->transaction_capacity) {
+        size_t capacity = wal->transaction_capacity < MIN_TRANSACTION_CAPACITY ? MIN_TRANSACTION_CAPACITY : wal->transaction_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char* transaction = realloc(wal->transaction, capacity);
+        if (transaction == NULL) {
+            //the transaction of the caller stays open, its imgst_wal_end forgets it
+            return single ? imgst_wal_end(imgst_file, ERR_OUT_OF_MEMORY, NULL) : ERR_OUT_OF_MEMORY;
+        }
+        wal->transaction = transaction;
+        wal->transaction_capacity = capacity;
+    }
+
+    struct wal_write_header const write = {.offset = offset, .size = size};
+    memcpy(wal->transaction + wal->transaction_size, &write, sizeof(write));
+    memcpy(wal->transaction + wal->transaction_size + sizeof(write), buffer, size);
+    wal->transaction_size = needed;
+    ++wal->nb_writes;
+
+    if (!single) {
+        return ERR_NONE;
+    }
+    //no one would wait for it: it is made durable (and written in the imgStore file) right away
+    uint64_t lsn = 0;
+    int const ret = imgst_wal_end(imgst_file, ERR_NONE, &lsn);
+    return ret != ERR_NONE ? ret : imgst_wal_sync(imgst_file, lsn);
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "imgStore.h"
+
+/**
+ * @file imgst_wal.h
+ * @brief write-ahead log of the header and metadata writes of an imgStore.
+ *
+ * The log is a file next to the imgStore (its name followed by ".wal").
+ * A mutation (insert, delete, ...) groups its header and metadata writes
+ * in a transaction, logged as a single checksummed record. The writes
+ * only reach the imgStore file once their record is durable, so a crash
+ * can never leave them half done: do_open replays the durable records
+ * and drops a torn last one.
+ *
+ * The images themselves are not logged. They are appended past the end
+ * of the imgStore, where nothing references them until their metadata is
+ * written, and the imgStore is synced before any record referencing them.
+ *
+ * Durability is given by group commit: whoever waits for a record while
+ * no sync is running syncs every record written so far (becoming the
+ * leader), the others wait for it. A mutation logs its record while it
+ * has the imgStore alone, then waits for it once the imgStore lock is
+ * released, so concurrent mutations share one fdatasync.
+ */
+
+#define WAL_SUFFIX ".wal"
+
+/**
+ * @brief a logged record whose writes are not yet in the imgStore file
+ */
+struct wal_record {
+    uint64_t lsn;
+    uint64_t end_offset; // end of the imgStore file when the record was logged
+    char* data; // record as written in the log
+    size_t size;
+    struct wal_record* next;
+};
+
+/**
+ * @brief the log of an imgst_file opened for writing
+ */
+struct imgst_wal {
+    int fd;
+    char* filename;
+    uint64_t log_size; // bytes of records in the log file
+
+    //transaction being built by a mutation (begin/end)
+    bool in_transaction;
+    char* transaction;
+    size_t transaction_size;
+    size_t transaction_capacity;
+    uint32_t nb_writes;
+
+    //group commit
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    bool syncing; // a leader is syncing
+    uint64_t next_lsn; // lsn of the next record
+    uint64_t synced_lsn; // every record < synced_lsn is durable
+    uint64_t synced_end_offset; // every image below is durable in the imgStore file
+    struct wal_record* pending; // logged records, oldest first, not applied yet
+    struct wal_record* pending_last;
+};
+
+/**
+ * @brief replays the log of the imgStore, then (if writable) opens it for the next mutations
+ *
+ * The records are applied to the header and metadata already loaded in
+ * memory, and to the imgStore file if it is writable (then synced, and
+ * the log emptied). A read-only imgst_file gets no log.
+ *
+ * @param imgst_file with its header and metadata loaded, its indexes not built yet
+ * @param imgst_filename name of the imgStore file
+ * @param writable whether the imgStore file was opened for writing
+ * @return Some error code. 0 if no error.
+ */
+int imgst_wal_open(struct imgst_file* imgst_file, const char* imgst_filename, bool writable);
+
+/**
+ * @brief syncs the imgStore file and removes its log (no-op without log)
+ *
+ * @param imgst_file
+ */
+void imgst_wal_close(struct imgst_file* imgst_file);
+
+/**
+ * @brief removes the log of an imgStore file, for an imgStore that is (re)created
+ *
+ * @param imgst_filename name of the imgStore file
+ */
+void imgst_wal_remove(const char* imgst_filename);
+
+/**
+ * @brief starts a transaction, the next writes of imgst_wal_write are grouped in one record
+ *
+ * @param imgst_file
+ */
+void imgst_wal_begin(struct imgst_file* imgst_file);
+
+/**
+ * @brief ends the transaction: logs it (without waiting for it) if ret is ERR_NONE,
+ *        else forgets its writes
+ *
+ * @param imgst_file
+ * @param ret result of the mutation
+ * @param lsn output, sequence number of the record to give to imgst_wal_sync (0 if nothing was logged)
+ * @return ret, or the error of the logging
+ */
+int imgst_wal_end(struct imgst_file* imgst_file, int ret, uint64_t* lsn);
+
+/**
+ * @brief waits until the record lsn (and the previous ones) is durable,
+ *        to call without holding the lock of the imgStore
+ *
+ * @param imgst_file
+ * @param lsn given by imgst_wal_end, nothing to wait for if 0
+ * @return Some error code. 0 if no error.
+ */
+int imgst_wal_sync(struct imgst_file* imgst_file, uint64_t lsn);
+
+/**
+ * @brief writes bytes of the header or of the metadata:
+ *        in the current transaction, as a transaction of its own outside of one
+ *        (waited for, so better avoided holding the lock of the imgStore),
+ *        or directly in the imgStore file if it has no log
+ *
+ * @param imgst_file
+ * @param buffer bytes to write
+ * @param size number of bytes
+ * @param offset position in the imgStore file
+ * @return Some error code. 0 if no error.
+ */
+int imgst_wal_write(struct imgst_file* imgst_file, const void* buffer, size_t size, uint64_t offset);
@@ -0,0 +1,253 @@
+/**
+ * @file jpeg_header.c
+ * @brief reading of the markers of a JPEG byte stream, without decoding it
+ */
+
+#include "jpeg_header.h"
+#include "error.h"
+
+#include <stdbool.h>
+#include <string.h> // for memcmp
+
+#define MARKER_PREFIX 0xFF
+#define MARKER_SOI 0xD8 // start of image
+#define MARKER_EOI 0xD9 // end of image
+#define MARKER_SOS 0xDA // start of scan, the entropy-coded data follows
+#define MARKER_TEM 0x01
+#define MARKER_RST0 0xD0
+#define MARKER_RST7 0xD7
+#define MARKER_SOF0 0xC0
+#define MARKER_SOF15 0xCF
+#define MARKER_DHT 0xC4 // in the range of the SOFn, but not one
+#define MARKER_JPG 0xC8
+#define MARKER_DAC 0xCC
+#define MARKER_APP1 0xE1
+
+#define SOF_HEIGHT 1 // position in the segment: precision (1 byte), height, width (2 bytes each)
+#define SOF_WIDTH 3
+#define SOF_MIN_LENGTH 6
+
+//APP1 segment of EXIF: its identifier, then a TIFF file (byte order, 42, offset of IFD0)
+#define EXIF_ID "Exif\0\0"
+#define EXIF_ID_LENGTH 6
+#define TIFF_HEADER_LENGTH 8
+#define TIFF_MAGIC 42
+#define IFD_ENTRY_LENGTH 12
+#define TIFF_TYPE_SHORT 3
+#define TIFF_TYPE_LONG 4
+#define TAG_THUMB_OFFSET 0x0201 // JPEGInterchangeFormat, in IFD1
+#define TAG_THUMB_LENGTH 0x0202 // JPEGInterchangeFormatLength, in IFD1
+
+/**
+ * @brief a marker segment of a JPEG stream
+ */
+struct jpeg_segment {
+    uint8_t marker;
+    const uint8_t* data; // after the marker and the length
+    size_t size;
+};
+
+/**
+ * @return the big-endian 16 bits number at bytes
+ */
+static uint16_t read_u16(const uint8_t* bytes)
+{
+    return (uint16_t) (bytes[0] << 8 | bytes[1]);
+}
+
+/**
+ * @return whether the marker starts a frame (SOF0 to SOF15, except the markers sharing their range)
+ */
+static bool is_sof(uint8_t marker)
+{
+    return marker >= MARKER_SOF0 && marker <= MARKER_SOF15 &&
+           marker != MARKER_DHT && marker != MARKER_JPG && marker != MARKER_DAC;
+}
+
+/**
+ * @return whether the marker stands alone, without a segment
+ */
+static bool is_standalone(uint8_t marker)
+{
+    return marker == MARKER_TEM || (marker >= MARKER_RST0 && marker <= MARKER_RST7);
+}
+
+/**
+ * @brief reads the segment at *pos of the stream and moves *pos after it
+ * @param pos position in bytes, 0 for the start of the stream
+ * @return ERR_IMGLIB at the first scan (or end of image) or if the stream is malformed, else ERR_NONE
+ */
+static int next_segment(const uint8_t* bytes, size_t size, size_t* pos, struct jpeg_segment* segment)
+{
+    if(*pos == 0) {
+        if(size < 2 || bytes[0] != MARKER_PREFIX || bytes[1] != MARKER_SOI) {
+            return ERR_IMGLIB;
+        }
+        *pos = 2;
+    }
+    for(;;) {
+        if(*pos >= size || bytes[*pos] != MARKER_PREFIX) {
+            return ERR_IMGLIB;
+        }
+        //any number of fill bytes may precede a marker
+        while(*pos < size && bytes[*pos] == MARKER_PREFIX) {
+            ++*pos;
+        }
+        if(*pos >= size) {
+            return ERR_IMGLIB;
+        }
+        uint8_t const marker = bytes[(*pos)++];
+        if(is_standalone(marker)) {
+            continue;
+        }
+        if(marker == MARKER_EOI || marker == MARKER_SOS || size - *pos < 2) {
+            return ERR_IMGLIB;
+        }
+
+        uint16_t const length = read_u16(bytes + *pos); //includes its own 2 bytes
+        if(length < 2 || length > size - *pos) {
+            return ERR_IMGLIB;
+        }
+        segment->marker = marker;
+        segment->data = bytes + *pos + 2;
+        segment->size = length - 2;
+        *pos += length;
+        return ERR_NONE;
+    }
+}
+
+/**
+ * @brief a TIFF file, in the byte order it tells
+ */
+struct tiff {
+    const uint8_t* data;
+    size_t size;
+    bool big_endian;
+};
+
+/**
+ * @return the 16 bits number at offset of the TIFF file
+ */
+static uint16_t tiff_u16(const struct tiff* tiff, size_t offset)
+{
+    const uint8_t* b = tiff->data + offset;
+    return tiff->big_endian ? (uint16_t) (b[0] << 8 | b[1]) : (uint16_t) (b[1] << 8 | b[0]);
+}
+
+/**
+ * @return the 32 bits number at offset of the TIFF file
+ */
+static uint32_t tiff_u32(const struct tiff* tiff, size_t offset)
+{
+    const uint8_t* b = tiff->data + offset;
+    return tiff->big_endian ?
+           (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3] :
+           (uint32_t) b[3] << 24 | (uint32_t) b[2] << 16 | (uint32_t) b[1] << 8 | b[0];
+}
+
+/**
+ * @brief finds the embedded thumbnail in the IFD1 of the TIFF file of an EXIF segment
+ * @return ERR_IMGLIB if there is none, else ERR_NONE
+ */
+static int tiff_thumbnail(const struct tiff* tiff, size_t* offset, size_t* size)
+{
+    if(tiff->size < TIFF_HEADER_LENGTH || tiff_u16(tiff, 2) != TIFF_MAGIC) {
+        return ERR_IMGLIB;
+    }
+    //IFD0 is only skipped to find IFD1, which follows it in the chain
+    size_t ifd = tiff_u32(tiff, 4);
+    for(int n = 0; n < 2; ++n) {
+        if(ifd < TIFF_HEADER_LENGTH || ifd > tiff->size - 2) {
+            return ERR_IMGLIB;
+        }
+        size_t const nb_entries = tiff_u16(tiff, ifd);
+        size_t const entries = ifd + 2;
+        if(nb_entries * IFD_ENTRY_LENGTH + 4 > tiff->size - entries) {
+            return ERR_IMGLIB;
+        }
+        if(n == 0) {
+            ifd = tiff_u32(tiff, entries + nb_entries * IFD_ENTRY_LENGTH);
+            continue;
+        }
+
+        size_t thumb_offset = 0, thumb_size = 0;
+        for(size_t i = 0; i < nb_entries; ++i) {
+            size_t const entry = entries + i * IFD_ENTRY_LENGTH;
+            uint16_t const tag = tiff_u16(tiff, entry);
+            uint16_t const type = tiff_u16(tiff, entry + 2);
+            if(tag != TAG_THUMB_OFFSET && tag != TAG_THUMB_LENGTH) {
+                continue;
+            }
+            size_t const value = type == TIFF_TYPE_LONG ? tiff_u32(tiff, entry + 8) :
+                                 type == TIFF_TYPE_SHORT ? tiff_u16(tiff, entry + 8) : 0;
+            if(tag == TAG_THUMB_OFFSET) {
+                thumb_offset = value;
+            } else {
+                thumb_size = value;
+            }
+        }
+        if(thumb_offset == 0 || thumb_size == 0 || thumb_offset > tiff->size || thumb_size > tiff->size - thumb_offset) {
+            return ERR_IMGLIB;
+        }
+        *offset = thumb_offset;
+        *size = thumb_size;
+        return ERR_NONE;
+    }
+    return ERR_IMGLIB;
+}
+
+//----------------------------------------------------------------------------------------------------------
+/** @copybrief */
+int jpeg_dimensions(const void* image, size_t size, uint32_t* width, uint32_t* height)
+{
+    if(image == NULL || width == NULL || height == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t pos = 0;
+    struct jpeg_segment segment;
+    while(next_segment(image, size, &pos, &segment) == ERR_NONE) {
+        if(!is_sof(segment.marker)) {
+            continue;
+        }
+        if(segment.size < SOF_MIN_LENGTH) {
+            return ERR_IMGLIB;
+        }
+        *height = read_u16(segment.data + SOF_HEIGHT);
+        *width = read_u16(segment.data + SOF_WIDTH);
+        //a height of 0 is defined later by a DNL marker
+        return *width != 0 && *height != 0 ? ERR_NONE : ERR_IMGLIB;
+    }
+    return ERR_IMGLIB; //no frame before the image data
+}
+
+/** @copybrief */
+int jpeg_exif_thumbnail(const void* image, size_t size, const void** thumbnail, size_t* thumbnail_size)
+{
+    if(image == NULL || thumbnail == NULL || thumbnail_size == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t pos = 0;
+    struct jpeg_segment segment;
+    while(next_segment(image, size, &pos, &segment) == ERR_NONE) {
+        if(segment.marker != MARKER_APP1 || segment.size < EXIF_ID_LENGTH ||
+           memcmp(segment.data, EXIF_ID, EXIF_ID_LENGTH) != 0) {
+            continue; //APP1 is also used by XMP
+        }
+        struct tiff tiff = {segment.data + EXIF_ID_LENGTH, segment.size - EXIF_ID_LENGTH, false};
+        if(tiff.size < 2 || (memcmp(tiff.data, "II", 2) != 0 && memcmp(tiff.data, "MM", 2) != 0)) {
+            return ERR_IMGLIB;
+        }
+        tiff.big_endian = tiff.data[0] == 'M';
+
+        size_t offset = 0;
+        int const ret = tiff_thumbnail(&tiff, &offset, thumbnail_size);
+        if(ret != ERR_NONE) {
+            return ret;
+        }
+        *thumbnail = tiff.data + offset;
+        //the thumbnail can also be stored uncompressed (TIFF strips), not handled
+        return *thumbnail_size >= 2 && tiff.data[offset] == MARKER_PREFIX && tiff.data[offset + 1] == MARKER_SOI ?
+               ERR_NONE : ERR_IMGLIB;
+    }
+    return ERR_IMGLIB;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file jpeg_header.h
+ * @brief reading of the markers of a JPEG byte stream, without decoding it.
+ *
+ * Only the segments before the first scan are walked, so the cost does not
+ * depend on the size of the image. Whatever these functions cannot make
+ * sense of (truncated stream, dimensions defined later by a DNL marker, ...)
+ * is reported as ERR_IMGLIB, for the caller to fall back to vips.
+ */
+
+/**
+ * @brief reads the dimensions of a JPEG image in its start of frame (SOFn) segment
+ *
+ * @param image the JPEG byte stream
+ * @param size number of bytes of the stream
+ * @param width output, width of the image in pixels
+ * @param height output, height of the image in pixels
+ * @return ERR_IMGLIB if the dimensions can't be found in the stream, else ERR_NONE
+ */
+int jpeg_dimensions(const void* image, size_t size, uint32_t* width, uint32_t* height);
+
+/**
+ * @brief finds the JPEG thumbnail embedded by cameras in the EXIF (APP1) segment
+ *
+ * @param image the JPEG byte stream
+ * @param size number of bytes of the stream
+ * @param thumbnail output, the thumbnail (a JPEG stream too), inside image
+ * @param thumbnail_size output, number of bytes of the thumbnail
+ * @return ERR_IMGLIB if the image has no such thumbnail, else ERR_NONE
+ */
+int jpeg_exif_thumbnail(const void* image, size_t size, const void** thumbnail, size_t* thumbnail_size);
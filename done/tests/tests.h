@@ -0,0 +1,143 @@
+#pragma once
+
+/**
+ * @file tests.h
+ * @brief helpers shared by the unit tests (check framework)
+ */
+
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // for getpid, unlink
+
+#include "imgStore.h"
+#include "imgst_wal.h"
+
+#define TEST_JPEG_SIZE 19 // bytes written by make_jpeg
+#define TEST_JPEG_SOF_END 17 // first byte after the SOF0 segment of make_jpeg
+#define TEST_MAX_FILENAME 64
+
+//bytes written by make_gray_jpeg: 140 of markers, then 2 bits per block of 8x8 pixels
+#define TEST_GRAY_JPEG_SIZE(width, height) (140 + ((((width) + 7) / 8) * (((height) + 7) / 8) + 3) / 4)
+
+/**
+ * @brief main function of a unit test, running the suite returned by get_suite
+ */
+#define TEST_SUITE(get_suite) \
+int main(void) \
+{ \
+    SRunner* runner = srunner_create(get_suite()); \
+    srunner_run_all(runner, CK_VERBOSE); \
+    int const nb_failed = srunner_ntests_failed(runner); \
+    srunner_free(runner); \
+    return nb_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE; \
+}
+
+/**
+ * @brief writes a minimal JPEG stream: SOI, a comment holding seed (so that
+ *        streams can differ by their content), a SOF0 segment, then EOI
+ *
+ * @param buffer of at least TEST_JPEG_SIZE bytes
+ * @param width of the frame
+ * @param height of the frame
+ * @param seed byte of the comment
+ * @return number of bytes written (TEST_JPEG_SIZE)
+ */
+static inline size_t make_jpeg(unsigned char* buffer, uint16_t width, uint16_t height, unsigned char seed)
+{
+    unsigned char const jpeg[TEST_JPEG_SIZE] = {
+        0xFF, 0xD8,
+        0xFF, 0xFE, 0x00, 0x03, seed,
+        0xFF, 0xC0, 0x00, 0x08, 0x08, (unsigned char) (height >> 8), (unsigned char) height,
+        (unsigned char) (width >> 8), (unsigned char) width, 0x01,
+        0xFF, 0xD9
+    };
+    memcpy(buffer, jpeg, TEST_JPEG_SIZE);
+    return TEST_JPEG_SIZE;
+}
+
+/**
+ * @brief writes a baseline JPEG stream of a uniform gray image, that a real
+ *        decoder reads (unlike make_jpeg): one component, all the coefficients
+ *        zero, each coded by the only code (a single 0 bit) of its table
+ *
+ * @param buffer of at least TEST_GRAY_JPEG_SIZE(width, height) bytes
+ * @param width of the image
+ * @param height of the image
+ * @return number of bytes written
+ */
+static inline size_t make_gray_jpeg(unsigned char* buffer, uint16_t width, uint16_t height)
+{
+    unsigned char* p = buffer;
+    unsigned char const soi_dqt[] = {0xFF, 0xD8, 0xFF, 0xDB, 0x00, 0x43, 0x00};
+    memcpy(p, soi_dqt, sizeof(soi_dqt));
+    p += sizeof(soi_dqt);
+    memset(p, 1, 64);
+    p += 64;
+
+    unsigned char const sof0[] = {
+        0xFF, 0xC0, 0x00, 0x0B, 0x08, (unsigned char) (height >> 8), (unsigned char) height,
+        (unsigned char) (width >> 8), (unsigned char) width, 0x01, 0x01, 0x11, 0x00
+    };
+    memcpy(p, sof0, sizeof(sof0));
+    p += sizeof(sof0);
+
+    //a DC table (class 0) then an AC table (class 1), both of the symbol 0 alone
+    for(unsigned char table_class = 0; table_class < 2; ++table_class) {
+        unsigned char const dht[] = {0xFF, 0xC4, 0x00, 0x14, (unsigned char) (table_class << 4), 0x01};
+        memcpy(p, dht, sizeof(dht));
+        p += sizeof(dht);
+        memset(p, 0, 16);
+        p += 16;
+    }
+
+    unsigned char const sos[] = {0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00};
+    memcpy(p, sos, sizeof(sos));
+    p += sizeof(sos);
+
+    //per block, a DC difference of 0 and an end of block: 2 zero bits, the last byte padded with ones
+    size_t const nb_blocks = (size_t) ((width + 7) / 8) * (size_t) ((height + 7) / 8);
+    size_t const nb_bytes = (nb_blocks + 3) / 4;
+    memset(p, 0, nb_bytes);
+    if(nb_blocks % 4 != 0) {
+        p[nb_bytes - 1] = (unsigned char) (0xFF >> (2 * (nb_blocks % 4)));
+    }
+    p += nb_bytes;
+
+    p[0] = 0xFF;
+    p[1] = 0xD9;
+    return (size_t) (p + 2 - buffer);
+}
+
+/**
+ * @brief name of a file of the test, in /tmp and unique to the process
+ */
+static inline void test_filename(char* filename, const char* name)
+{
+    snprintf(filename, TEST_MAX_FILENAME, "/tmp/%s-%d.imgst", name, (int) getpid());
+}
+
+/**
+ * @brief creates an empty imgStore of max_files images and of the options flags (IMGST_*),
+ *        then opens it for writing (with its log)
+ */
+static inline void create_imgst(const char* filename, uint32_t max_files, uint32_t flags, struct imgst_file* imgst_file)
+{
+    struct imgst_file new_file = {
+        .header.max_files = max_files, .header.res_resized = {64, 64, 256, 256}, .header.flags = flags
+    };
+    ck_assert_int_eq(do_create(filename, &new_file), ERR_NONE);
+    do_close(&new_file);
+    ck_assert_int_eq(do_open(filename, "rb+", imgst_file), ERR_NONE);
+}
+
+/**
+ * @brief removes an imgStore of the tests and its log
+ */
+static inline void remove_imgst(const char* filename)
+{
+    unlink(filename);
+    imgst_wal_remove(filename);
+}
@@ -0,0 +1,227 @@
+/**
+ * @file unit-test-cache.c
+ * @brief unit tests of the cache of the images answered by the server (imgst_cache.c)
+ */
+
+#include "tests.h"
+#include "error.h"
+#include "imgst_cache.h"
+
+#define IMAGE_SIZE 100
+#define BUDGET (100 * IMAGE_SIZE) // in one shard: a window of one image, and 99 in the main part
+#define NB_HOT 50
+#define NB_HOT_LOOKUPS 3
+#define NB_SCANNED 1000
+
+/**
+ * @brief adds to the cache an image of IMAGE_SIZE bytes, all of them fill
+ * @return its entry, to release
+ */
+static const struct imgst_cache_entry* put(struct imgst_cache* cache, const struct imgst_cache_key* key, char fill)
+{
+    char* image = malloc(IMAGE_SIZE);
+    ck_assert_ptr_nonnull(image);
+    memset(image, fill, IMAGE_SIZE);
+    const struct imgst_cache_entry* entry = NULL;
+    ck_assert_int_eq(imgst_cache_put(cache, key, image, IMAGE_SIZE, &entry), ERR_NONE);
+    ck_assert_ptr_nonnull(entry);
+    return entry;
+}
+
+/**
+ * @brief checks that the image of the entry is the one put with fill
+ */
+static void assert_image(const struct imgst_cache_entry* entry, char fill)
+{
+    char expected[IMAGE_SIZE];
+    memset(expected, fill, IMAGE_SIZE);
+    ck_assert_uint_eq(entry->size, IMAGE_SIZE);
+    ck_assert_mem_eq(entry->image, expected, IMAGE_SIZE);
+}
+
+/**
+ * @return the bytes of the images in the cache
+ */
+static size_t used(struct imgst_cache* cache)
+{
+    struct imgst_cache_stats stats;
+    imgst_cache_get_stats(cache, &stats);
+    return stats.used;
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(hits_and_misses)
+{
+    struct imgst_cache cache;
+    ck_assert_int_eq(imgst_cache_init(&cache, BUDGET, 1), ERR_NONE);
+    struct imgst_cache_key const key = {.index = 3, .generation = 1, .res = RES_THUMB};
+
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &key), NULL);
+    const struct imgst_cache_entry* added = put(&cache, &key, 'a');
+    const struct imgst_cache_entry* found = imgst_cache_get(&cache, &key);
+    ck_assert_ptr_eq(found, added);
+    assert_image(found, 'a');
+
+    //another generation, resolution or box is another image
+    struct imgst_cache_key other = key;
+    other.generation = 2;
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &other), NULL);
+    other = key;
+    other.res = CACHE_RES_BOX;
+    other.width = other.height = 32;
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &other), NULL);
+
+    //the image put again meanwhile is freed, the one cached is given
+    const struct imgst_cache_entry* again = put(&cache, &key, 'b');
+    ck_assert_ptr_eq(again, added);
+    assert_image(again, 'a');
+    ck_assert_uint_eq(used(&cache), IMAGE_SIZE);
+
+    struct imgst_cache_stats stats;
+    imgst_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.hits, 1);
+    ck_assert_uint_eq(stats.misses, 3);
+    ck_assert_uint_eq(stats.budget, BUDGET);
+
+    imgst_cache_release(&cache, added);
+    imgst_cache_release(&cache, found);
+    imgst_cache_release(&cache, again);
+    imgst_cache_close(&cache);
+}
+END_TEST
+
+START_TEST(held_entries_outlive_their_eviction)
+{
+    struct imgst_cache cache;
+    ck_assert_int_eq(imgst_cache_init(&cache, BUDGET, 1), ERR_NONE);
+
+    //larger than the shard, evicted as soon as it is put
+    struct imgst_cache_key const large_key = {.index = 1, .generation = 1, .res = CACHE_RES_BOX, .width = 4096, .height = 4096};
+    char* large = malloc(BUDGET + 1);
+    ck_assert_ptr_nonnull(large);
+    memset(large, 'l', BUDGET + 1);
+    const struct imgst_cache_entry* large_entry = NULL;
+    ck_assert_int_eq(imgst_cache_put(&cache, &large_key, large, BUDGET + 1, &large_entry), ERR_NONE);
+    ck_assert_int_eq(large_entry->cached, false);
+    ck_assert_uint_eq(used(&cache), 0);
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &large_key), NULL);
+    ck_assert_int_eq(large_entry->image[BUDGET], 'l');
+
+    //evicted while held by two readers, freed by the release of the last one
+    struct imgst_cache_key const key = {.index = 2, .generation = 1, .res = RES_SMALL};
+    const struct imgst_cache_entry* first = put(&cache, &key, 's');
+    const struct imgst_cache_entry* second = imgst_cache_get(&cache, &key);
+    imgst_cache_invalidate(&cache, key.index);
+    ck_assert_int_eq(first->cached, false);
+    imgst_cache_release(&cache, first);
+    assert_image(second, 's');
+    imgst_cache_release(&cache, second);
+    imgst_cache_release(&cache, large_entry);
+    imgst_cache_close(&cache);
+}
+END_TEST
+
+START_TEST(invalidate_frees_the_slot)
+{
+    struct imgst_cache cache;
+    ck_assert_int_eq(imgst_cache_init(&cache, BUDGET, 2), ERR_NONE);
+    struct imgst_cache_key const thumb = {.index = 4, .generation = 1, .res = RES_THUMB};
+    struct imgst_cache_key const small = {.index = 4, .generation = 1, .res = RES_SMALL};
+    struct imgst_cache_key const box = {.index = 4, .generation = 1, .res = CACHE_RES_BOX, .width = 10, .height = 10};
+    struct imgst_cache_key const kept = {.index = 6, .generation = 1, .res = RES_THUMB}; // in the same shard
+    const struct imgst_cache_key* const keys[] = {&thumb, &small, &box, &kept};
+    for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        imgst_cache_release(&cache, put(&cache, keys[i], (char) ('0' + i)));
+    }
+    ck_assert_uint_eq(used(&cache), 4 * IMAGE_SIZE);
+
+    imgst_cache_invalidate(&cache, 4);
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &thumb), NULL);
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &small), NULL);
+    ck_assert_ptr_eq(imgst_cache_get(&cache, &box), NULL);
+    ck_assert_uint_eq(used(&cache), IMAGE_SIZE);
+
+    const struct imgst_cache_entry* entry = imgst_cache_get(&cache, &kept);
+    ck_assert_ptr_nonnull(entry);
+    assert_image(entry, '3');
+    imgst_cache_release(&cache, entry);
+
+    //the slot is free for the next image (a new generation)
+    struct imgst_cache_key replaced = thumb;
+    replaced.generation = 2;
+    imgst_cache_release(&cache, put(&cache, &replaced, 'r'));
+    ck_assert_uint_eq(used(&cache), 2 * IMAGE_SIZE);
+    imgst_cache_close(&cache);
+}
+END_TEST
+
+START_TEST(scan_keeps_the_hot_entries)
+{
+    struct imgst_cache cache;
+    ck_assert_int_eq(imgst_cache_init(&cache, BUDGET, 1), ERR_NONE);
+
+    //missed, read then put, as the server does, then asked again
+    for(uint32_t i = 0; i < NB_HOT; ++i) {
+        struct imgst_cache_key const key = {.index = i, .generation = 1, .res = RES_THUMB};
+        ck_assert_ptr_eq(imgst_cache_get(&cache, &key), NULL);
+        imgst_cache_release(&cache, put(&cache, &key, 'h'));
+        for(int k = 0; k < NB_HOT_LOOKUPS; ++k) {
+            imgst_cache_release(&cache, imgst_cache_get(&cache, &key));
+        }
+    }
+
+    //images asked once each, one of them held all along (once the main part is full)
+    uint32_t const held_index = NB_HOT + NB_SCANNED / 2;
+    const struct imgst_cache_entry* held = NULL;
+    for(uint32_t i = NB_HOT; i < NB_HOT + NB_SCANNED; ++i) {
+        struct imgst_cache_key const key = {.index = i, .generation = 1, .res = RES_THUMB};
+        ck_assert_ptr_eq(imgst_cache_get(&cache, &key), NULL);
+        const struct imgst_cache_entry* entry = put(&cache, &key, i == held_index ? 'x' : 's');
+        if(i == held_index) {
+            held = entry;
+        } else {
+            imgst_cache_release(&cache, entry);
+        }
+    }
+
+    //which filled the room left in the main part, and did not evict any hot image from it
+    struct imgst_cache_stats stats;
+    imgst_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.evicted, 0);
+    ck_assert_uint_eq(stats.rejected + stats.admitted, NB_HOT + NB_SCANNED - 1);
+    ck_assert_uint_eq(stats.used, BUDGET);
+    for(uint32_t i = 0; i < NB_HOT; ++i) {
+        struct imgst_cache_key const key = {.index = i, .generation = 1, .res = RES_THUMB};
+        const struct imgst_cache_entry* entry = imgst_cache_get(&cache, &key);
+        ck_assert_ptr_nonnull(entry);
+        assert_image(entry, 'h');
+        imgst_cache_release(&cache, entry);
+    }
+
+    //the held one was rejected with the others, and is still readable
+    ck_assert_int_eq(held->cached, false);
+    assert_image(held, 'x');
+    imgst_cache_release(&cache, held);
+    imgst_cache_close(&cache);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* cache_test_suite(void)
+{
+    Suite* s = suite_create("imgst_cache.c");
+
+    TCase* lru = tcase_create("lru");
+    tcase_add_test(lru, hits_and_misses);
+    tcase_add_test(lru, held_entries_outlive_their_eviction);
+    tcase_add_test(lru, invalidate_frees_the_slot);
+    suite_add_tcase(s, lru);
+
+    TCase* admission = tcase_create("admission");
+    tcase_add_test(admission, scan_keeps_the_hot_entries);
+    suite_add_tcase(s, admission);
+
+    return s;
+}
+
+TEST_SUITE(cache_test_suite)
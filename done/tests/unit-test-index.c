@@ -0,0 +1,262 @@
+/**
+ * @file unit-test-index.c
+ * @brief unit tests of the in-memory indexes (imgst_index.c), kept up to date by do_insert and do_delete
+ */
+
+#include "tests.h"
+#include "error.h"
+#include "imgst_index.h"
+
+#define MAX_PAGE 10
+
+/**
+ * @brief checks that every index agrees with the metadata
+ */
+static void assert_consistent(const struct imgst_file* imgst_file)
+{
+    uint32_t nb_valid = 0;
+    for(uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgst_file->metadata[i];
+        ck_assert_int_eq(imgst_index_is_valid(imgst_file, i), metadata->is_valid == NON_EMPTY);
+        if(metadata->is_valid != NON_EMPTY) continue;
+        ++nb_valid;
+
+        uint32_t index = INDEX_NIL;
+        ck_assert_int_eq(imgst_index_find_id(imgst_file, metadata->img_id, &index), ERR_NONE);
+        ck_assert_uint_eq(index, i);
+        ck_assert_int_eq(imgst_index_find_sha(imgst_file, metadata->SHA, INDEX_NIL, &index), ERR_NONE);
+        ck_assert_mem_eq(imgst_file->metadata[index].SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+    }
+
+    uint32_t nb_iterated = 0;
+    for(uint32_t i = imgst_index_next_valid(imgst_file, 0); i != INDEX_NIL; i = imgst_index_next_valid(imgst_file, i + 1)) {
+        ++nb_iterated;
+    }
+    ck_assert_uint_eq(nb_iterated, nb_valid);
+    ck_assert_uint_eq(imgst_file->header.num_files, nb_valid);
+
+    const struct id_order* order = &imgst_file->id_order;
+    ck_assert_uint_eq(order->nb_slots, nb_valid);
+    for(uint32_t k = 0; k < order->nb_slots; ++k) {
+        ck_assert_int_eq(imgst_file->metadata[order->slots[k]].is_valid, NON_EMPTY);
+        if(k > 0) {
+            ck_assert_str_lt(imgst_file->metadata[order->slots[k - 1]].img_id, imgst_file->metadata[order->slots[k]].img_id);
+        }
+    }
+}
+
+/**
+ * @brief inserts the image made by make_jpeg from seed
+ * @return the result of do_insert
+ */
+static int insert(struct imgst_file* imgst_file, const char* img_id, unsigned char seed)
+{
+    unsigned char jpeg[TEST_JPEG_SIZE];
+    return do_insert((const char*) jpeg, make_jpeg(jpeg, 640, 480, seed), img_id, imgst_file);
+}
+
+/**
+ * @brief checks the ids of a page given by imgst_index_page, and whether more follow
+ * @param expected ids of the page, separated by spaces ("" for an empty page)
+ */
+static void assert_page(const struct imgst_file* imgst_file, const char* prefix, const char* after, uint32_t limit,
+                        const char* expected, bool expected_more)
+{
+    uint32_t slots[MAX_PAGE];
+    uint32_t nb_slots = 0;
+    bool const more = imgst_index_page(imgst_file, prefix, after, limit, slots, &nb_slots);
+
+    char page[MAX_PAGE * (MAX_IMG_ID + 1) + 1] = "";
+    for(uint32_t k = 0; k < nb_slots; ++k) {
+        if(k > 0) strcat(page, " ");
+        strcat(page, imgst_file->metadata[slots[k]].img_id);
+    }
+    ck_assert_str_eq(page, expected);
+    ck_assert_int_eq(more, expected_more);
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(insert_delete_and_duplicate)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-index");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+    assert_consistent(&imgst_file);
+
+    ck_assert_int_eq(insert(&imgst_file, "pic2", 2), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "pic1", 1), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "pic3", 3), ERR_NONE);
+    assert_consistent(&imgst_file);
+
+    //a rejected duplicate leaves the image having the id, and the indexes, untouched
+    uint32_t index = INDEX_NIL;
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "pic1", &index), ERR_NONE);
+    struct img_metadata const before = imgst_file.metadata[index];
+    uint32_t const version = imgst_file.header.imgst_version;
+    ck_assert_int_eq(insert(&imgst_file, "pic1", 4), ERR_DUPLICATE_ID);
+    assert_consistent(&imgst_file);
+    ck_assert_uint_eq(imgst_file.header.num_files, 3);
+    ck_assert_uint_eq(imgst_file.header.imgst_version, version);
+    ck_assert_mem_eq(imgst_file.metadata[index].SHA, before.SHA, SHA256_DIGEST_LENGTH);
+
+    //another id with the same content shares it
+    ck_assert_int_eq(insert(&imgst_file, "copy1", 1), ERR_NONE);
+    assert_consistent(&imgst_file);
+
+    ck_assert_int_eq(do_delete("pic1", &imgst_file), ERR_NONE);
+    assert_consistent(&imgst_file);
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "pic1", &index), ERR_FILE_NOT_FOUND);
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "copy1", &index), ERR_NONE);
+    ck_assert_int_eq(imgst_index_find_sha(&imgst_file, before.SHA, INDEX_NIL, &index), ERR_NONE);
+    ck_assert_int_eq(do_delete("pic1", &imgst_file), ERR_FILE_NOT_FOUND);
+
+    //the id can be used again once deleted
+    ck_assert_int_eq(insert(&imgst_file, "pic1", 5), ERR_NONE);
+    assert_consistent(&imgst_file);
+    ck_assert_uint_eq(imgst_file.header.num_files, 4);
+
+    //the indexes rebuilt by do_open agree with the ones kept up to date
+    do_close(&imgst_file);
+    ck_assert_int_eq(do_open(filename, "rb+", &imgst_file), ERR_NONE);
+    assert_consistent(&imgst_file);
+    assert_page(&imgst_file, "", NULL, MAX_PAGE, "copy1 pic1 pic2 pic3", false);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+START_TEST(full_imgst)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-index");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 2, 0, &imgst_file);
+
+    ck_assert_int_eq(insert(&imgst_file, "a", 1), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "b", 2), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "c", 3), ERR_FULL_IMGSTORE);
+    assert_consistent(&imgst_file);
+
+    //the slot of a deleted image is taken by the next one
+    uint32_t freed = INDEX_NIL, taken = INDEX_NIL;
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "a", &freed), ERR_NONE);
+    ck_assert_int_eq(do_delete("a", &imgst_file), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "c", 3), ERR_NONE);
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "c", &taken), ERR_NONE);
+    ck_assert_uint_eq(taken, freed);
+    assert_consistent(&imgst_file);
+    assert_page(&imgst_file, "", NULL, MAX_PAGE, "b c", false);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+START_TEST(pages_by_prefix_and_cursor)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-index");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+    assert_page(&imgst_file, "", NULL, MAX_PAGE, "", false);
+
+    const char* const ids[] = {"ba", "abc", "c", "a", "b", "ab"};
+    for(unsigned char i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        ck_assert_int_eq(insert(&imgst_file, ids[i], i), ERR_NONE);
+    }
+
+    //pages of the whole list, the cursor being the last id of the previous page
+    assert_page(&imgst_file, "", NULL, 2, "a ab", true);
+    assert_page(&imgst_file, "", "ab", 2, "abc b", true);
+    assert_page(&imgst_file, "", "b", 2, "ba c", false);
+    assert_page(&imgst_file, "", "c", 2, "", false);
+    assert_page(&imgst_file, "", NULL, 6, "a ab abc b ba c", false);
+    assert_page(&imgst_file, "", NULL, 0, "", true);
+
+    //a cursor that is not an id (deleted meanwhile) starts the page at the next one
+    assert_page(&imgst_file, "", "aa", 2, "ab abc", true);
+    assert_page(&imgst_file, "", "", 1, "a", true);
+    assert_page(&imgst_file, "", "zz", 2, "", false);
+
+    //the prefix is an id, and a prefix of other ids
+    assert_page(&imgst_file, "a", NULL, MAX_PAGE, "a ab abc", false);
+    assert_page(&imgst_file, "a", NULL, 3, "a ab abc", false);
+    assert_page(&imgst_file, "a", NULL, 2, "a ab", true);
+    assert_page(&imgst_file, "a", "ab", 2, "abc", false);
+    assert_page(&imgst_file, "ab", NULL, MAX_PAGE, "ab abc", false);
+
+    //a cursor before the ids with the prefix, or after them
+    assert_page(&imgst_file, "b", "a", MAX_PAGE, "b ba", false);
+    assert_page(&imgst_file, "b", "abc", 1, "b", true);
+    assert_page(&imgst_file, "b", "c", MAX_PAGE, "", false);
+
+    //no id with the prefix, before, between and after the ids
+    assert_page(&imgst_file, "0", NULL, MAX_PAGE, "", false);
+    assert_page(&imgst_file, "bb", NULL, MAX_PAGE, "", false);
+    assert_page(&imgst_file, "abcd", NULL, MAX_PAGE, "", false);
+    assert_page(&imgst_file, "d", NULL, MAX_PAGE, "", false);
+
+    //deleted images leave the pages
+    ck_assert_int_eq(do_delete("ab", &imgst_file), ERR_NONE);
+    assert_page(&imgst_file, "a", NULL, MAX_PAGE, "a abc", false);
+    assert_page(&imgst_file, "", "a", 1, "abc", true);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+START_TEST(failed_delete_keeps_the_image)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-index");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+    ck_assert_int_eq(insert(&imgst_file, "a", 1), ERR_NONE);
+    ck_assert_int_eq(insert(&imgst_file, "b", 2), ERR_NONE);
+    do_close(&imgst_file);
+
+    //opened for reading, none of its writes succeed
+    ck_assert_int_eq(do_open(filename, "rb", &imgst_file), ERR_NONE);
+    uint32_t const version = imgst_file.header.imgst_version;
+    ck_assert_int_eq(do_delete("a", &imgst_file), ERR_IO);
+    assert_consistent(&imgst_file);
+    ck_assert_uint_eq(imgst_file.header.num_files, 2);
+    ck_assert_uint_eq(imgst_file.header.imgst_version, version);
+    assert_page(&imgst_file, "", NULL, MAX_PAGE, "a b", false);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+START_TEST(failed_create_frees_the_indexes)
+{
+    //every write of /dev/full fails (no space left on device)
+    struct imgst_file imgst_file = {.header.max_files = 10, .header.res_resized = {64, 64, 256, 256}};
+    ck_assert_int_eq(do_create("/dev/full", &imgst_file), ERR_IO);
+    ck_assert_ptr_eq(imgst_file.file, NULL);
+    ck_assert_ptr_eq(imgst_file.metadata, NULL);
+    ck_assert_ptr_eq(imgst_file.columns.valid, NULL);
+    ck_assert_ptr_eq(imgst_file.id_order.slots, NULL);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* index_test_suite(void)
+{
+    Suite* s = suite_create("imgst_index.c");
+
+    TCase* mutations = tcase_create("mutations");
+    tcase_add_test(mutations, insert_delete_and_duplicate);
+    tcase_add_test(mutations, full_imgst);
+    tcase_add_test(mutations, failed_delete_keeps_the_image);
+    tcase_add_test(mutations, failed_create_frees_the_indexes);
+    suite_add_tcase(s, mutations);
+
+    TCase* pages = tcase_create("imgst_index_page");
+    tcase_add_test(pages, pages_by_prefix_and_cursor);
+    suite_add_tcase(s, pages);
+
+    return s;
+}
+
+TEST_SUITE(index_test_suite)
@@ -0,0 +1,247 @@
+/**
+ * @file unit-test-jpeg.c
+ * @brief unit tests of the reading of the JPEG markers (jpeg_header.c)
+ */
+
+#include "tests.h"
+#include "error.h"
+#include "jpeg_header.h"
+
+#define EXIF_THUMB_OFFSET 44 // in the TIFF file of make_exif_jpeg, after IFD0 (empty) and IFD1 (two entries)
+#define MAX_EXIF_JPEG 256
+
+/**
+ * @brief writes 16 (or 32) bits in the byte order of a TIFF file
+ */
+static void put_u16(unsigned char* bytes, uint16_t value, int big_endian)
+{
+    bytes[big_endian ? 0 : 1] = (unsigned char) (value >> 8);
+    bytes[big_endian ? 1 : 0] = (unsigned char) value;
+}
+
+static void put_u32(unsigned char* bytes, uint32_t value, int big_endian)
+{
+    put_u16(bytes + (big_endian ? 0 : 2), (uint16_t) (value >> 16), big_endian);
+    put_u16(bytes + (big_endian ? 2 : 0), (uint16_t) value, big_endian);
+}
+
+/**
+ * @brief writes a JPEG stream whose EXIF segment embeds the thumbnail made by make_jpeg,
+ *        followed by the SOF0 segment of the image and EOI
+ * @param tiff_out output, position of the TIFF file in the stream
+ * @return number of bytes written
+ */
+static size_t make_exif_jpeg(unsigned char* buffer, int big_endian, size_t* tiff_out)
+{
+    unsigned char thumbnail[TEST_JPEG_SIZE];
+    make_jpeg(thumbnail, 160, 120, 0);
+
+    unsigned char* tiff = buffer + 2 + 4 + 6;
+    memset(tiff, 0, EXIF_THUMB_OFFSET);
+    memcpy(tiff, big_endian ? "MM" : "II", 2);
+    put_u16(tiff + 2, 42, big_endian);
+    put_u32(tiff + 4, 8, big_endian); // IFD0, no entries
+    put_u32(tiff + 10, 14, big_endian); // IFD1, two entries
+    put_u16(tiff + 14, 2, big_endian);
+    put_u16(tiff + 16, 0x0201, big_endian);
+    put_u16(tiff + 18, 4, big_endian);
+    put_u32(tiff + 20, 1, big_endian);
+    put_u32(tiff + 24, EXIF_THUMB_OFFSET, big_endian);
+    put_u16(tiff + 28, 0x0202, big_endian);
+    put_u16(tiff + 30, 3, big_endian); // the length as a SHORT, as some cameras do
+    put_u32(tiff + 32, 1, big_endian);
+    put_u16(tiff + 36, TEST_JPEG_SIZE, big_endian);
+    memcpy(tiff + EXIF_THUMB_OFFSET, thumbnail, TEST_JPEG_SIZE);
+    size_t const tiff_size = EXIF_THUMB_OFFSET + TEST_JPEG_SIZE;
+
+    size_t const app1_length = 2 + 6 + tiff_size;
+    unsigned char const head[] = {0xFF, 0xD8, 0xFF, 0xE1, (unsigned char) (app1_length >> 8), (unsigned char) app1_length,
+                                  'E', 'x', 'i', 'f', 0, 0
+                                 };
+    memcpy(buffer, head, sizeof(head));
+
+    //the frame of the image itself: the end of make_jpeg, after SOI and the comment
+    unsigned char image[TEST_JPEG_SIZE];
+    make_jpeg(image, 4000, 3000, 0);
+    memcpy(tiff + tiff_size, image + 7, TEST_JPEG_SIZE - 7);
+    *tiff_out = (size_t) (tiff - buffer);
+    return (size_t) (tiff - buffer) + tiff_size + TEST_JPEG_SIZE - 7;
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(dimensions_of_the_frame)
+{
+    unsigned char jpeg[TEST_JPEG_SIZE];
+    uint32_t width = 0, height = 0;
+    ck_assert_int_eq(jpeg_dimensions(jpeg, make_jpeg(jpeg, 640, 480, 0), &width, &height), ERR_NONE);
+    ck_assert_uint_eq(width, 640);
+    ck_assert_uint_eq(height, 480);
+
+    //fill bytes before a marker, and a standalone marker
+    unsigned char padded[TEST_JPEG_SIZE + 4] = {0xFF, 0xD8, 0xFF, 0xFF, 0xFF, 0xD0};
+    memcpy(padded + 6, jpeg + 2, TEST_JPEG_SIZE - 2);
+    ck_assert_int_eq(jpeg_dimensions(padded, TEST_JPEG_SIZE + 4, &width, &height), ERR_NONE);
+    ck_assert_uint_eq(width, 640);
+
+    ck_assert_int_eq(jpeg_dimensions(NULL, TEST_JPEG_SIZE, &width, &height), ERR_INVALID_ARGUMENT);
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, NULL, &height), ERR_INVALID_ARGUMENT);
+}
+END_TEST
+
+START_TEST(dimensions_of_a_truncated_stream)
+{
+    unsigned char jpeg[TEST_JPEG_SIZE];
+    make_jpeg(jpeg, 640, 480, 0);
+    uint32_t width = 0, height = 0;
+    //the dimensions are only read from a complete frame segment
+    for(size_t size = 0; size < TEST_JPEG_SOF_END; ++size) {
+        ck_assert_int_eq(jpeg_dimensions(jpeg, size, &width, &height), ERR_IMGLIB);
+    }
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SOF_END, &width, &height), ERR_NONE);
+}
+END_TEST
+
+START_TEST(dimensions_of_a_malformed_stream)
+{
+    unsigned char jpeg[TEST_JPEG_SIZE];
+    uint32_t width = 0, height = 0;
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[1] = 0xD9; // no SOI
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[5] = 1; // length of the comment shorter than its own bytes
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[4] = 0x7F; // length of the comment past the end of the stream
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[7] = 0x00; // garbage instead of the marker of the frame
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[8] = 0xDA; // the scan starts before any frame
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[8] = 0xC4; // DHT, in the range of the SOFn: skipped, then EOI
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 480, 0);
+    jpeg[10] = 0x05; // frame segment too short for the dimensions
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+
+    make_jpeg(jpeg, 640, 0, 0); // height defined later by a DNL marker
+    ck_assert_int_eq(jpeg_dimensions(jpeg, TEST_JPEG_SIZE, &width, &height), ERR_IMGLIB);
+}
+END_TEST
+
+START_TEST(exif_thumbnail_in_both_byte_orders)
+{
+    for(int big_endian = 0; big_endian < 2; ++big_endian) {
+        unsigned char jpeg[MAX_EXIF_JPEG];
+        size_t tiff = 0;
+        size_t const size = make_exif_jpeg(jpeg, big_endian, &tiff);
+
+        const void* thumbnail = NULL;
+        size_t thumbnail_size = 0;
+        ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_NONE);
+        ck_assert_ptr_eq(thumbnail, jpeg + tiff + EXIF_THUMB_OFFSET);
+        ck_assert_uint_eq(thumbnail_size, TEST_JPEG_SIZE);
+
+        uint32_t width = 0, height = 0;
+        ck_assert_int_eq(jpeg_dimensions(thumbnail, thumbnail_size, &width, &height), ERR_NONE);
+        ck_assert_uint_eq(width, 160);
+        ck_assert_int_eq(jpeg_dimensions(jpeg, size, &width, &height), ERR_NONE);
+        ck_assert_uint_eq(width, 4000);
+    }
+}
+END_TEST
+
+START_TEST(exif_thumbnail_of_a_truncated_stream)
+{
+    unsigned char jpeg[MAX_EXIF_JPEG];
+    size_t tiff = 0;
+    size_t const size = make_exif_jpeg(jpeg, 0, &tiff);
+    size_t const app1_end = tiff + EXIF_THUMB_OFFSET + TEST_JPEG_SIZE;
+
+    const void* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+    for(size_t cut = 0; cut < app1_end; ++cut) {
+        ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, cut, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+    }
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, app1_end, &thumbnail, &thumbnail_size), ERR_NONE);
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, NULL, &thumbnail_size), ERR_INVALID_ARGUMENT);
+}
+END_TEST
+
+START_TEST(exif_thumbnail_of_a_malformed_stream)
+{
+    unsigned char jpeg[MAX_EXIF_JPEG];
+    size_t tiff = 0;
+    size_t size = 0;
+    const void* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    memcpy(jpeg + tiff, "XX", 2); // unknown byte order
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u16(jpeg + tiff + 2, 43, 0); // not a TIFF file
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u32(jpeg + tiff + 4, 0xFFFFFF00, 0); // IFD0 past the end of the TIFF file
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u32(jpeg + tiff + 10, 0, 0); // no IFD1
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u16(jpeg + tiff + 14, 0xFFFF, 0); // more entries than bytes
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u16(jpeg + tiff + 36, TEST_JPEG_SIZE + 1, 0); // thumbnail past the end of the TIFF file
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    put_u16(jpeg + tiff + 28, 0x0100, 0); // no length of the thumbnail
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    jpeg[tiff + EXIF_THUMB_OFFSET + 1] = 0x00; // uncompressed thumbnail, not a JPEG stream
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+
+    size = make_exif_jpeg(jpeg, 0, &tiff);
+    memcpy(jpeg + tiff - 6, "http:/", 6); // an APP1 segment of XMP, not of EXIF
+    ck_assert_int_eq(jpeg_exif_thumbnail(jpeg, size, &thumbnail, &thumbnail_size), ERR_IMGLIB);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* jpeg_test_suite(void)
+{
+    Suite* s = suite_create("jpeg_header.c");
+
+    TCase* dimensions = tcase_create("jpeg_dimensions");
+    tcase_add_test(dimensions, dimensions_of_the_frame);
+    tcase_add_test(dimensions, dimensions_of_a_truncated_stream);
+    tcase_add_test(dimensions, dimensions_of_a_malformed_stream);
+    suite_add_tcase(s, dimensions);
+
+    TCase* exif = tcase_create("jpeg_exif_thumbnail");
+    tcase_add_test(exif, exif_thumbnail_in_both_byte_orders);
+    tcase_add_test(exif, exif_thumbnail_of_a_truncated_stream);
+    tcase_add_test(exif, exif_thumbnail_of_a_malformed_stream);
+    suite_add_tcase(s, exif);
+
+    return s;
+}
+
+TEST_SUITE(jpeg_test_suite)
@@ -0,0 +1,85 @@
+/**
+ * @file unit-test-list.c
+ * @brief unit tests of the JSON list of the images, serialized once per imgst_version (imgst_list.c)
+ */
+
+#include "tests.h"
+#include "error.h"
+
+/**
+ * @brief inserts the image made by make_jpeg from seed
+ */
+static void insert(struct imgst_file* imgst_file, const char* img_id, unsigned char seed)
+{
+    unsigned char jpeg[TEST_JPEG_SIZE];
+    ck_assert_int_eq(do_insert((const char*) jpeg, make_jpeg(jpeg, 640, 480, seed), img_id, imgst_file), ERR_NONE);
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(list_cached_until_the_version_changes)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-list");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+    insert(&imgst_file, "pic1", 1);
+    insert(&imgst_file, "pic2", 2);
+
+    char sha[SHA_STRING_LENGTH];
+    char* json = NULL;
+    ck_assert_int_eq(do_list_json_cached(&imgst_file, sha, &json), ERR_NONE);
+    ck_assert_ptr_nonnull(strstr(json, "\"pic1\""));
+    ck_assert_ptr_nonnull(strstr(json, "\"pic2\""));
+    ck_assert_uint_eq(imgst_file.list_cache.version, imgst_file.header.imgst_version);
+
+    //listed again from the cache, as long as nothing is inserted nor deleted
+    const char* const cached = imgst_file.list_cache.json;
+    char sha_again[SHA_STRING_LENGTH];
+    char* json_again = NULL;
+    ck_assert_int_eq(do_list_json_cached(&imgst_file, sha_again, NULL), ERR_NONE);
+    ck_assert_int_eq(do_list_json_cached(&imgst_file, sha_again, &json_again), ERR_NONE);
+    ck_assert_ptr_eq(imgst_file.list_cache.json, cached);
+    ck_assert_str_eq(sha_again, sha);
+    ck_assert_str_eq(json_again, json);
+    free(json_again);
+
+    char* listed = do_list(&imgst_file, JSON);
+    ck_assert_ptr_nonnull(listed);
+    ck_assert_str_eq(listed, json);
+    free(listed);
+
+    //serialized again after an insertion
+    insert(&imgst_file, "pic3", 3);
+    ck_assert_int_eq(do_list_json_cached(&imgst_file, sha_again, &json_again), ERR_NONE);
+    ck_assert_ptr_nonnull(strstr(json_again, "\"pic3\""));
+    ck_assert_int_ne(strcmp(sha_again, sha), 0);
+    ck_assert_uint_eq(imgst_file.list_cache.version, imgst_file.header.imgst_version);
+    free(json_again);
+
+    //and after a deletion, which gives back the first list
+    ck_assert_int_eq(do_delete("pic3", &imgst_file), ERR_NONE);
+    ck_assert_int_eq(do_list_json_cached(&imgst_file, sha_again, &json_again), ERR_NONE);
+    ck_assert_ptr_eq(strstr(json_again, "\"pic3\""), NULL);
+    ck_assert_str_eq(sha_again, sha);
+    ck_assert_str_eq(json_again, json);
+    free(json_again);
+
+    free(json);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* list_test_suite(void)
+{
+    Suite* s = suite_create("imgst_list.c");
+
+    TCase* cache = tcase_create("list_cache");
+    tcase_add_test(cache, list_cached_until_the_version_changes);
+    suite_add_tcase(s, cache);
+
+    return s;
+}
+
+TEST_SUITE(list_test_suite)
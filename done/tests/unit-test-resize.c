@@ -0,0 +1,214 @@
+/**
+ * @file unit-test-resize.c
+ * @brief unit tests of the creation of the missing resolutions (imgst_resize.c), asked for by do_read
+ */
+
+#include "tests.h"
+#include "error.h"
+#include "imgst_index.h"
+#include "imgst_resize.h"
+
+#include <pthread.h>
+#include <time.h> // for nanosleep
+
+#define NB_READERS 4
+#define MAX_WAIT_MS 5000 // for the readers to join the flight
+
+#define ORIG_WIDTH 512 // of the images inserted
+#define ORIG_HEIGHT 384
+#define EXIF_THUMB_WIDTH 64 // the width of the thumbnails of create_imgst, so that it is stored as it is
+#define EXIF_THUMB_HEIGHT 48
+#define EXIF_THUMB_OFFSET 44 // in the TIFF file, after IFD0 (empty) and IFD1 (two entries)
+#define EXIF_HEAD_SIZE 12 // SOI, then the APP1 marker, its length and "Exif\0\0"
+#define MAX_EXIF_JPEG (EXIF_HEAD_SIZE + EXIF_THUMB_OFFSET + \
+                       TEST_GRAY_JPEG_SIZE(EXIF_THUMB_WIDTH, EXIF_THUMB_HEIGHT) + \
+                       TEST_GRAY_JPEG_SIZE(ORIG_WIDTH, ORIG_HEIGHT))
+
+/**
+ * @brief writes 16 (or 32) bits of a little-endian TIFF file
+ */
+static void put_u16(unsigned char* bytes, uint16_t value)
+{
+    bytes[0] = (unsigned char) value;
+    bytes[1] = (unsigned char) (value >> 8);
+}
+
+static void put_u32(unsigned char* bytes, uint32_t value)
+{
+    put_u16(bytes, (uint16_t) value);
+    put_u16(bytes + 2, (uint16_t) (value >> 16));
+}
+
+/**
+ * @brief writes a gray JPEG of ORIG_WIDTH x ORIG_HEIGHT, which EXIF data
+ *        embeds a gray thumbnail of EXIF_THUMB_WIDTH x EXIF_THUMB_HEIGHT
+ *
+ * @param buffer of MAX_EXIF_JPEG bytes
+ * @param thumbnail output, where the embedded thumbnail starts in buffer
+ * @param thumbnail_size output, its size
+ * @return number of bytes written
+ */
+static size_t make_exif_jpeg(unsigned char* buffer, const unsigned char** thumbnail, size_t* thumbnail_size)
+{
+    unsigned char* tiff = buffer + EXIF_HEAD_SIZE;
+    memset(tiff, 0, EXIF_THUMB_OFFSET);
+    memcpy(tiff, "II", 2);
+    put_u16(tiff + 2, 42);
+    put_u32(tiff + 4, 8); // IFD0, no entries
+    put_u32(tiff + 10, 14); // IFD1, two entries
+    put_u16(tiff + 14, 2);
+    put_u16(tiff + 16, 0x0201);
+    put_u16(tiff + 18, 4);
+    put_u32(tiff + 20, 1);
+    put_u32(tiff + 24, EXIF_THUMB_OFFSET);
+    put_u16(tiff + 28, 0x0202);
+    put_u16(tiff + 30, 4);
+    put_u32(tiff + 32, 1);
+    *thumbnail = tiff + EXIF_THUMB_OFFSET;
+    *thumbnail_size = make_gray_jpeg(tiff + EXIF_THUMB_OFFSET, EXIF_THUMB_WIDTH, EXIF_THUMB_HEIGHT);
+    put_u32(tiff + 36, (uint32_t) *thumbnail_size);
+    size_t const tiff_size = EXIF_THUMB_OFFSET + *thumbnail_size;
+
+    size_t const app1_length = 2 + 6 + tiff_size;
+    unsigned char const head[EXIF_HEAD_SIZE] = {
+        0xFF, 0xD8, 0xFF, 0xE1, (unsigned char) (app1_length >> 8), (unsigned char) app1_length,
+        'E', 'x', 'i', 'f', 0, 0
+    };
+    memcpy(buffer, head, EXIF_HEAD_SIZE);
+
+    //the image itself, after its own SOI
+    unsigned char image[TEST_GRAY_JPEG_SIZE(ORIG_WIDTH, ORIG_HEIGHT)];
+    size_t const image_size = make_gray_jpeg(image, ORIG_WIDTH, ORIG_HEIGHT);
+    memcpy(tiff + tiff_size, image + 2, image_size - 2);
+    return EXIF_HEAD_SIZE + tiff_size + image_size - 2;
+}
+
+/**
+ * @brief a reader missing the small image of the image "gray", at index, as find_and_resize
+ */
+struct reader {
+    struct imgst_file* imgst_file;
+    uint32_t index;
+    uint64_t orig_offset;
+    uint32_t orig_size;
+    int result;
+};
+
+static void* read_small(void* arg)
+{
+    struct reader* reader = arg;
+    reader->result = imgst_resize(reader->imgst_file, "gray", RES_SMALL, reader->index,
+                                  reader->orig_offset, reader->orig_size);
+    return NULL;
+}
+
+/**
+ * @return the number of readers waiting for the only flight of the resizer, -1 if it has not one flight
+ */
+static int nb_waiters(struct imgst_resizer* resizer)
+{
+    pthread_mutex_lock(&resizer->lock);
+    int const nb = resizer->flights == NULL || resizer->flights->next != NULL ? -1 : (int) resizer->flights->nb_waiters;
+    pthread_mutex_unlock(&resizer->lock);
+    return nb;
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(concurrent_readers_share_the_resize)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-resize");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+
+    unsigned char jpeg[TEST_GRAY_JPEG_SIZE(ORIG_WIDTH, ORIG_HEIGHT)];
+    size_t const size = make_gray_jpeg(jpeg, ORIG_WIDTH, ORIG_HEIGHT);
+    ck_assert_int_eq(do_insert((const char*) jpeg, size, "gray", &imgst_file), ERR_NONE);
+    uint32_t index = INDEX_NIL;
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "gray", &index), ERR_NONE);
+    const struct img_metadata* metadata = &imgst_file.metadata[index];
+
+    //the imgStore held, the first reader can't get further than its flight, which the others join
+    pthread_rwlock_wrlock(&imgst_file.lock);
+    struct reader readers[NB_READERS];
+    pthread_t threads[NB_READERS];
+    for(int k = 0; k < NB_READERS; ++k) {
+        readers[k] = (struct reader) {
+            &imgst_file, index, metadata->offset[RES_ORIG], metadata->size[RES_ORIG], -1
+        };
+        ck_assert_int_eq(pthread_create(&threads[k], NULL, read_small, &readers[k]), 0);
+    }
+    struct timespec const millisecond = {0, 1000000};
+    for(int waited = 0; waited < MAX_WAIT_MS && nb_waiters(imgst_file.resizer) != NB_READERS - 1; ++waited) {
+        nanosleep(&millisecond, NULL);
+    }
+    int const nb = nb_waiters(imgst_file.resizer);
+    uint64_t const end_offset = imgst_file.end_offset;
+    pthread_rwlock_unlock(&imgst_file.lock);
+    for(int k = 0; k < NB_READERS; ++k) {
+        pthread_join(threads[k], NULL);
+        ck_assert_int_eq(readers[k].result, ERR_NONE);
+    }
+    ck_assert_int_eq(nb, NB_READERS - 1);
+    ck_assert_ptr_eq(imgst_file.resizer->flights, NULL);
+
+    //stored once, with the thumbnail made from the same decode
+    ck_assert_int_gt(metadata->size[RES_SMALL], 0);
+    ck_assert_int_gt(metadata->size[RES_THUMB], 0);
+    ck_assert_uint_eq(imgst_file.end_offset, end_offset + metadata->size[RES_SMALL] + metadata->size[RES_THUMB]);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+START_TEST(exif_thumbnail_alone)
+{
+    char filename[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-resize");
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, IMGST_EXIF_THUMBS, &imgst_file);
+
+    unsigned char jpeg[MAX_EXIF_JPEG];
+    const unsigned char* embedded = NULL;
+    size_t embedded_size = 0;
+    size_t const size = make_exif_jpeg(jpeg, &embedded, &embedded_size);
+    ck_assert_int_eq(do_insert((const char*) jpeg, size, "exif", &imgst_file), ERR_NONE);
+
+    //the thumbnail is the embedded one, and the original is not decoded for the small image
+    char* image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_int_eq(do_read("exif", RES_THUMB, &image, &image_size, &imgst_file), ERR_NONE);
+    ck_assert_uint_eq(image_size, embedded_size);
+    ck_assert_mem_eq(image, embedded, embedded_size);
+    free(image);
+
+    uint32_t index = INDEX_NIL;
+    ck_assert_int_eq(imgst_index_find_id(&imgst_file, "exif", &index), ERR_NONE);
+    ck_assert_uint_eq(imgst_file.metadata[index].size[RES_SMALL], 0);
+
+    //which is made when it is asked for
+    ck_assert_int_eq(do_read("exif", RES_SMALL, &image, &image_size, &imgst_file), ERR_NONE);
+    ck_assert_uint_eq(imgst_file.metadata[index].size[RES_SMALL], image_size);
+    free(image);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* resize_test_suite(void)
+{
+    Suite* s = suite_create("imgst_resize.c");
+
+    TCase* flight = tcase_create("single_flight");
+    tcase_add_test(flight, concurrent_readers_share_the_resize);
+    suite_add_tcase(s, flight);
+
+    TCase* exif = tcase_create("exif_thumbnail");
+    tcase_add_test(exif, exif_thumbnail_alone);
+    suite_add_tcase(s, exif);
+
+    return s;
+}
+
+TEST_SUITE(resize_test_suite)
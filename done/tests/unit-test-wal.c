@@ -0,0 +1,156 @@
+/**
+ * @file unit-test-wal.c
+ * @brief unit tests of the replay of the write-ahead log (imgst_wal.c)
+ */
+
+#include "tests.h"
+#include "error.h"
+
+#include <sys/stat.h> // for stat
+
+/**
+ * @brief copies the file named from to the file named to
+ */
+static void copy_file(const char* from, const char* to)
+{
+    FILE* in = fopen(from, "rb");
+    FILE* out = fopen(to, "wb");
+    ck_assert_ptr_nonnull(in);
+    ck_assert_ptr_nonnull(out);
+    char buffer[4096];
+    size_t nb_read = 0;
+    while((nb_read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ck_assert_uint_eq(fwrite(buffer, 1, nb_read, out), nb_read);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+/**
+ * @return the size of the log of the imgStore named filename
+ */
+static long wal_size(const char* filename)
+{
+    char wal[TEST_MAX_FILENAME + sizeof(WAL_SUFFIX)];
+    snprintf(wal, sizeof(wal), "%s%s", filename, WAL_SUFFIX);
+    struct stat wal_stat;
+    return stat(wal, &wal_stat) == 0 ? (long) wal_stat.st_size : -1;
+}
+
+/**
+ * @brief logs two transactions setting the version of the imgStore to 1 then 2, and
+ *        copies the imgStore and its log to crashed before they are synced (as a crash would leave them)
+ */
+static void log_then_crash(const char* filename, const char* crashed)
+{
+    struct imgst_file imgst_file;
+    create_imgst(filename, 10, 0, &imgst_file);
+
+    uint64_t lsn = 0;
+    for(uint32_t version = 1; version <= 2; ++version) {
+        imgst_wal_begin(&imgst_file);
+        imgst_file.header.imgst_version = version;
+        ck_assert_int_eq(imgst_wal_end(&imgst_file, write_header(&imgst_file), &lsn), ERR_NONE);
+    }
+    ck_assert_int_gt(wal_size(filename), 0);
+
+    char wal[TEST_MAX_FILENAME + sizeof(WAL_SUFFIX)];
+    char crashed_wal[TEST_MAX_FILENAME + sizeof(WAL_SUFFIX)];
+    snprintf(wal, sizeof(wal), "%s%s", filename, WAL_SUFFIX);
+    snprintf(crashed_wal, sizeof(crashed_wal), "%s%s", crashed, WAL_SUFFIX);
+    copy_file(filename, crashed);
+    copy_file(wal, crashed_wal);
+
+    ck_assert_int_eq(imgst_wal_sync(&imgst_file, lsn), ERR_NONE);
+    do_close(&imgst_file);
+    remove_imgst(filename);
+}
+
+/**
+ * @return the version of the imgStore named filename once opened (and its log replayed)
+ */
+static uint32_t version_after_replay(const char* filename, const char* open_mode)
+{
+    struct imgst_file imgst_file;
+    ck_assert_int_eq(do_open(filename, open_mode, &imgst_file), ERR_NONE);
+    uint32_t const version = imgst_file.header.imgst_version;
+    do_close(&imgst_file);
+    return version;
+}
+
+//----------------------------------------------------------------------------------------------------------
+START_TEST(complete_records_are_replayed)
+{
+    char filename[TEST_MAX_FILENAME], crashed[TEST_MAX_FILENAME];
+    test_filename(filename, "unit-test-wal");
+    test_filename(crashed, "unit-test-wal-crashed");
+    log_then_crash(filename, crashed);
+
+    //read-only: replayed in memory only
+    ck_assert_uint_eq(version_after_replay(crashed, "rb"), 2);
+    ck_assert_int_gt(wal_size(crashed), 0);
+
+    //for writing: replayed in the imgStore file, then the log is emptied
+    ck_assert_uint_eq(version_after_replay(crashed, "rb+"), 2);
+    ck_assert_int_eq(wal_size(crashed), -1);
+    ck_assert_uint_eq(version_after_replay(crashed, "rb"), 2);
+    remove_imgst(crashed);
+}
+END_TEST
+
+START_TEST(torn_record_is_dropped)
+{
+    char filename[TEST_MAX_FILENAME], crashed[TEST_MAX_FILENAME], wal[TEST_MAX_FILENAME + sizeof(WAL_SUFFIX)];
+    test_filename(filename, "unit-test-wal");
+    test_filename(crashed, "unit-test-wal-crashed");
+    snprintf(wal, sizeof(wal), "%s%s", crashed, WAL_SUFFIX);
+
+    //whatever the number of bytes of the last record that reached the disk
+    for(long missing = 1; missing < 64; missing += 9) {
+        log_then_crash(filename, crashed);
+        ck_assert_int_eq(truncate(wal, wal_size(crashed) - missing), 0);
+
+        ck_assert_uint_eq(version_after_replay(crashed, "rb+"), 1);
+        ck_assert_uint_eq(version_after_replay(crashed, "rb"), 1);
+        remove_imgst(crashed);
+    }
+}
+END_TEST
+
+START_TEST(corrupted_record_is_dropped)
+{
+    char filename[TEST_MAX_FILENAME], crashed[TEST_MAX_FILENAME], wal[TEST_MAX_FILENAME + sizeof(WAL_SUFFIX)];
+    test_filename(filename, "unit-test-wal");
+    test_filename(crashed, "unit-test-wal-crashed");
+    snprintf(wal, sizeof(wal), "%s%s", crashed, WAL_SUFFIX);
+    log_then_crash(filename, crashed);
+
+    //a byte of the last record is wrong: its checksum does not match
+    FILE* log = fopen(wal, "rb+");
+    ck_assert_ptr_nonnull(log);
+    ck_assert_int_eq(fseek(log, -1, SEEK_END), 0);
+    int const last = fgetc(log);
+    ck_assert_int_eq(fseek(log, -1, SEEK_END), 0);
+    fputc(last ^ 0x01, log);
+    fclose(log);
+
+    ck_assert_uint_eq(version_after_replay(crashed, "rb+"), 1);
+    remove_imgst(crashed);
+}
+END_TEST
+
+//----------------------------------------------------------------------------------------------------------
+Suite* wal_test_suite(void)
+{
+    Suite* s = suite_create("imgst_wal.c");
+
+    TCase* replay = tcase_create("replay");
+    tcase_add_test(replay, complete_records_are_replayed);
+    tcase_add_test(replay, torn_record_is_dropped);
+    tcase_add_test(replay, corrupted_record_is_dropped);
+    suite_add_tcase(s, replay);
+
+    return s;
+}
+
+TEST_SUITE(wal_test_suite)
@@ -6,27 +6,26 @@
  */
 
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
+#include "imgst_resize.h"
 
 #include <stdint.h> // for uint8_t
 #include <stdlib.h> // for malloc and calloc
 #include <stdio.h> // for sprintf
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <string.h> // for strchr
+#include <sys/stat.h> // for fstat
 
 #define ERR_ATOI -1
 
 /** @copybrief */
 int write_header(struct imgst_file* imgst_file)
 {
-    //moving to the start of the file
-    if (fseek(imgst_file->file, NO_OFFSET, SEEK_SET) != ERR_NONE) {
-        fprintf(stderr, "Error: can't set head reader at the start of the file");
-        return ERR_IO;
-    }
-
-    // writing updated header to file
-    int nb_header_to_write = 1;
-    if(fwrite(&imgst_file->header, sizeof (struct imgst_header), nb_header_to_write, imgst_file->file) != nb_header_to_write) {
-        fprintf(stderr, "ERROR: fail to write updated metadata");
+    // writing updated header at the start of the file (through the log, if any)
+    if(imgst_wal_write(imgst_file, &imgst_file->header, sizeof (struct imgst_header), NO_OFFSET) != ERR_NONE) {
+        fprintf(stderr, "ERROR: fail to write updated header");
         return ERR_IO;
     }
 
@@ -36,25 +35,27 @@ int write_header(struct imgst_file* imgst_file)
 /** @copybrief */
 int write_metadata(struct imgst_file* imgst_file, size_t i)
 {
-    //moving to the start of the file
-    if (fseek(imgst_file->file, i * sizeof (struct img_metadata) + sizeof (struct imgst_header), SEEK_SET) != ERR_NONE) {
-        fprintf(stderr, "Error: can't set head reader at the start of the file");
-        return ERR_IO;
-    }
+    return write_metadata_range(imgst_file, i, 1);
+}
 
-    // writing metadata to file
-    int nb_metadata_to_write = 1;
-    if(fwrite(&imgst_file->metadata[i], sizeof (struct img_metadata), nb_metadata_to_write, imgst_file->file) != nb_metadata_to_write) {
-        return ERR_IO;
+/** @copybrief */
+int write_metadata_range(struct imgst_file* imgst_file, size_t first, size_t nb)
+{
+    //the metadata are being persisted, their in-memory columns must follow
+    for (size_t i = first; i < first + nb; ++i) {
+        imgst_index_update(imgst_file, i);
     }
-    return ERR_NONE;
+
+    // writing the metadata at their position in the file (through the log, if any)
+    return imgst_wal_write(imgst_file, &imgst_file->metadata[first], nb * sizeof (struct img_metadata),
+                           first * sizeof (struct img_metadata) + sizeof (struct imgst_header));
 }
 
 
 /********************************************************************//**
  * Human-readable SHA
  */
-static void
+void
 sha_to_string(const unsigned char *SHA,
               char *sha_string)
 {
@@ -97,7 +98,7 @@ void
 print_metadata(const struct img_metadata* metadata)
 {
 
-    char sha_printable[2 * SHA256_DIGEST_LENGTH + 1];
+    char sha_printable[SHA_STRING_LENGTH];
     sha_to_string(metadata->SHA, sha_printable);
 
     printf("IMAGE ID: %s\n", metadata->img_id);
@@ -158,10 +159,25 @@ int do_open (const char* imgst_filename, const char* open_mode, struct imgst_fil
     if(imgst_file->file == NULL) {
         return ERR_IO;
     }
+    imgst_file->fd = fileno(imgst_file->file);
+    imgst_file->mapping = NULL;
+    imgst_file->wal = NULL;
+    imgst_file->resizer = NULL;
+    imgst_file->on_delete = NULL;
+    imgst_file->on_delete_arg = NULL;
+
+    struct stat file_stat;
+    if(fstat(imgst_file->fd, &file_stat) != 0) {
+        fclose(imgst_file->file);
+        imgst_file->file = NULL;
+        return ERR_IO;
+    }
+    imgst_file->end_offset = (uint64_t) file_stat.st_size;
 
-    // read header from stream
-    if(fread(&(imgst_file->header), sizeof(struct imgst_header), NB_HEADER_PER_FILE, imgst_file->file) != NB_HEADER_PER_FILE) {
+    // read header from file
+    if(imgst_pread(imgst_file, &imgst_file->header, sizeof(struct imgst_header), NO_OFFSET) != ERR_NONE) {
         fclose(imgst_file->file);
+        imgst_file->file = NULL;
         return ERR_IO;
     }
 
@@ -170,17 +186,53 @@ int do_open (const char* imgst_filename, const char* open_mode, struct imgst_fil
     //failed calloc
     if(imgst_file->metadata == NULL) {
         fclose(imgst_file->file);
+        imgst_file->file = NULL;
         return ERR_OUT_OF_MEMORY;
     }
 
     // read metadatas from file to the imgst_file->metadata
-    if(fread(imgst_file->metadata, sizeof(struct img_metadata), imgst_file->header.max_files, imgst_file->file)
-       != imgst_file->header.max_files) {
+    if(imgst_pread(imgst_file, imgst_file->metadata, imgst_file->header.max_files * sizeof(struct img_metadata),
+                   sizeof(struct imgst_header)) != ERR_NONE) {
         fclose(imgst_file->file);
+        imgst_file->file = NULL;
         free(imgst_file->metadata);
         return ERR_IO;
     }
 
+    // redo the logged writes that may not have reached the file before a crash
+    int err_wal = imgst_wal_open(imgst_file, imgst_filename, strchr(open_mode, '+') != NULL);
+    if(err_wal != ERR_NONE) {
+        fclose(imgst_file->file);
+        imgst_file->file = NULL;
+        free(imgst_file->metadata);
+        return err_wal;
+    }
+
+    // build the in-memory indexes over the metadata we just read
+    int err_index = imgst_index_build(imgst_file);
+    if(err_index != ERR_NONE) {
+        imgst_wal_close(imgst_file);
+        fclose(imgst_file->file);
+        imgst_file->file = NULL;
+        free(imgst_file->metadata);
+        return err_index;
+    }
+
+    imgst_file->eager_variants = (imgst_file->header.flags & IMGST_EAGER_VARIANTS) != 0;
+    int err_resizer = imgst_resizer_open(imgst_file);
+    if(err_resizer != ERR_NONE) {
+        imgst_wal_close(imgst_file);
+        imgst_index_free(imgst_file);
+        fclose(imgst_file->file);
+        imgst_file->file = NULL;
+        free(imgst_file->metadata);
+        return err_resizer;
+    }
+
+    pthread_rwlock_init(&imgst_file->lock, NULL);
+    pthread_mutex_init(&imgst_file->mapping_lock, NULL);
+    pthread_mutex_init(&imgst_file->list_cache.lock, NULL);
+    imgst_file->list_cache.json = NULL;
     return ERR_NONE;
 }
 
@@ -194,9 +246,19 @@ void do_close (struct imgst_file* imgst_file)
         fprintf(stderr, "ERROR: Pointer to file stream was null\n");
         return;
     }
+    //the background resizes write in the log, they are stopped first
+    imgst_resizer_close(imgst_file);
+    imgst_wal_close(imgst_file);
     vector_metadata_delete(imgst_file);
+    imgst_index_free(imgst_file);
+    imgst_unmap(imgst_file);
     fclose(imgst_file->file);
     imgst_file->file = NULL;
+    pthread_rwlock_destroy(&imgst_file->lock);
+    pthread_mutex_destroy(&imgst_file->mapping_lock);
+    free(imgst_file->list_cache.json);
+    imgst_file->list_cache.json = NULL;
+    pthread_mutex_destroy(&imgst_file->list_cache.lock);
 }
 
 /** @copybrief */